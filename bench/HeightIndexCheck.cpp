@@ -0,0 +1,145 @@
+// Randomized checks for HeightIndex. Appends, changes, assigns and clears
+// rows at random and compares every offset and row lookup with a plain prefix sum:
+//
+//	make -C bench && bench/HeightIndexCheck [iterations] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "HeightIndex.h"
+
+
+// Halves and zeros keep every sum exact, so results must match exactly
+static float
+RandomHeight()
+{
+	if (rand() % 8 == 0)
+		return 0;
+	return (rand() % 400) / 2.0f;
+}
+
+
+// Row covering offset as HeightIndex defines it: the last row starting
+// at or before offset, skipping empty rows there, clamped to the rows
+static int32_t
+NaiveIndexAt(const std::vector<float>& heights, double offset)
+{
+	if (heights.empty())
+		return -1;
+
+	int32_t rows = 0;
+	double sum = 0;
+	for (size_t i = 0; i < heights.size(); i++) {
+		sum += heights[i];
+		if (sum > offset)
+			break;
+		rows = i + 1;
+	}
+	int32_t last = static_cast<int32_t>(heights.size()) - 1;
+	return rows < last ? rows : last;
+}
+
+
+static bool
+Fail(const char* what, int32_t count, double at, double expected,
+	double got)
+{
+	printf("FAILED: %s with %d rows at %g: expected %g, got %g\n", what,
+		(int)count, at, expected, got);
+	return false;
+}
+
+
+static bool
+Check(const HeightIndex& index, const std::vector<float>& heights)
+{
+	int32_t count = static_cast<int32_t>(heights.size());
+	if (index.Count() != count)
+		return Fail("count", count, -1, count, index.Count());
+
+	std::vector<double> prefix(count + 1, 0);
+	for (int32_t i = 0; i < count; i++) {
+		prefix[i + 1] = prefix[i] + heights[i];
+		if (index.Height(i) != heights[i])
+			return Fail("height", count, i, heights[i], index.Height(i));
+	}
+
+	for (int32_t i = 0; i <= count; i++) {
+		if (index.Offset(i) != prefix[i])
+			return Fail("offset", count, i, prefix[i], index.Offset(i));
+	}
+	if (index.Total() != prefix[count])
+		return Fail("total", count, count, prefix[count], index.Total());
+
+	// Past both ends, and some row boundaries and just either side
+	std::vector<double> offsets;
+	offsets.push_back(-10);
+	offsets.push_back(prefix[count] + 10);
+	for (int i = 0; i < 16; i++) {
+		double boundary = prefix[rand() % (count + 1)];
+		offsets.push_back(boundary);
+		offsets.push_back(boundary - 0.25);
+		offsets.push_back(boundary + 0.25);
+	}
+	for (size_t i = 0; i < offsets.size(); i++) {
+		int32_t expected = NaiveIndexAt(heights, offsets[i]);
+		int32_t got = index.IndexAt(static_cast<float>(offsets[i]));
+		if (got != expected)
+			return Fail("row at offset", count, offsets[i], expected, got);
+	}
+	return true;
+}
+
+
+int
+main(int argc, char** argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+	unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+	srand(seed);
+
+	HeightIndex index;
+	std::vector<float> heights;
+	for (int i = 0; i < iterations; i++) {
+		int operation = rand() % 1000;
+		if (operation == 0) {
+			index.Clear();
+			heights.clear();
+		} else if (operation < 10) {
+			// All of them again, one more or less, as after loading a
+			// slice of history
+			heights.resize(heights.size() + rand() % 3);
+			if (!heights.empty() && rand() % 2 == 0)
+				heights.pop_back();
+			for (size_t j = 0; j < heights.size(); j++) {
+				if (rand() % 4 == 0)
+					heights[j] = RandomHeight();
+			}
+			index.Assign(heights);
+		} else if (operation < 600 || heights.empty()) {
+			// Batches cross several powers of two at once
+			int appends = 1 + rand() % 8;
+			for (int j = 0; j < appends; j++) {
+				float height = RandomHeight();
+				index.Append(height);
+				heights.push_back(height);
+			}
+		} else {
+			int32_t row = rand() % heights.size();
+			float height = RandomHeight();
+			index.Set(row, height);
+			heights[row] = height;
+		}
+
+		if (!Check(index, heights)) {
+			printf("seed %u, iteration %d\n", seed, i);
+			return 1;
+		}
+	}
+
+	printf("%d operations ok (seed %u), %d rows at the end\n", iterations,
+		seed, (int)heights.size());
+	return 0;
+}
@@ -0,0 +1,206 @@
+// Throughput benchmark for MarkdownLexer and CodeHighlighter. Builds on any system with a C++11
+// compiler, no Haiku headers needed:
+//
+//	make -C bench && bench/MarkdownBench [megabytes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "CodeHighlighter.h"
+#include "MarkdownLexer.h"
+
+
+static const char* kParagraphs[] = {
+	"Here is **bold text**, some *italic words* and `inline code` in a "
+	"sentence that runs long enough to wrap in a chat bubble.\n\n",
+	"## A header line\n\n",
+	"- first bullet with a snake_case_name\n"
+	"- second bullet with **strong** emphasis\n"
+	"* third bullet\n\n",
+	"```cpp\n"
+	"int main(int argc, char** argv)\n"
+	"{\n"
+	"\treturn argc > 1 ? atoi(argv[1]) : 0;\n"
+	"}\n"
+	"```\n\n",
+	"Plain prose without any markup at all keeps the vector loop busy for "
+	"a while, which is what most of a typical answer looks like anyway, "
+	"sentence after sentence after sentence.\n\n"
+};
+
+
+static const char* kCode =
+	"#include <stdio.h>\n"
+	"\n"
+	"/* Counts the lines of a file */\n"
+	"static int\n"
+	"count_lines(const char* path, unsigned long* lines)\n"
+	"{\n"
+	"\tFILE* file = fopen(path, \"r\");\n"
+	"\tif (file == NULL)\n"
+	"\t\treturn -1;\n"
+	"\tfor (int c; (c = fgetc(file)) != EOF;) {\n"
+	"\t\tif (c == '\\n')\n"
+	"\t\t\t(*lines)++;  // one more\n"
+	"\t}\n"
+	"\tfclose(file);\n"
+	"\treturn 0x0;\n"
+	"}\n\n";
+
+
+static double
+Seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+
+// Inputs that defeat naive lookahead matching: unmatched openers, long
+// runs of delimiters and paragraphs that never end
+struct Pathological {
+	const char*	name;
+	const char*	unit;
+};
+
+static const Pathological kPathological[] = {
+	{ "snake_case", "call some_long_function_name with an_argument " },
+	{ "open stars", "*a " },
+	{ "open bold", "**a " },
+	{ "backticks", "`a " },
+	{ "mixed", "*_`*_`**__" },
+	{ "ascii table", "| col_a | col_b | col_c |\n|---|---|---|\n" },
+	{ "fences", "```\n```\n" },
+	{ "hashes", "####### #\n" },
+	{ "stars", "****************" }
+};
+
+
+static double
+LexRate(MarkdownLexer& lexer, const std::string& text,
+	std::vector<MarkdownRun>& runs)
+{
+	auto start = std::chrono::steady_clock::now();
+	lexer.Lex(text.c_str(), static_cast<int32_t>(text.size()), runs);
+	return double(text.size()) / (1024.0 * 1024.0) / Seconds(start);
+}
+
+
+static std::string
+MakeDocument(size_t size)
+{
+	std::string document;
+	size_t count = sizeof(kParagraphs) / sizeof(kParagraphs[0]);
+	for (size_t i = 0; document.size() < size; i++)
+		document += kParagraphs[(i * 7) % count];
+	return document;
+}
+
+
+int
+main(int argc, char** argv)
+{
+	size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+	std::string document = MakeDocument(megabytes * 1024 * 1024);
+	const char* text = document.c_str();
+	int32_t length = static_cast<int32_t>(document.size());
+	const int kIterations = 10;
+
+	// Raw scanning speed of the skip loop
+	int32_t hits = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < kIterations; i++) {
+		for (int32_t pos = 0; pos < length; pos++, hits++)
+			pos = MarkdownLexer::FindSpecialScalar(text, pos, length);
+	}
+	double scalar = Seconds(start);
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < kIterations; i++) {
+		for (int32_t pos = 0; pos < length; pos++, hits++)
+			pos = MarkdownLexer::FindSpecial(text, pos, length);
+	}
+	double vector = Seconds(start);
+
+	// Whole lexer
+	MarkdownLexer lexer;
+	std::vector<MarkdownRun> runs;
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < kIterations; i++)
+		lexer.Lex(text, length, runs);
+	double lex = Seconds(start);
+
+	// Streaming: a 64 KB answer arriving in 32 byte chunks, relexed in full
+	// on every chunk versus resumed at the stable boundary
+	int32_t streamLength = length < 65536 ? length : 65536;
+	const int32_t kChunk = 32;
+	std::vector<MarkdownRun> full;
+	start = std::chrono::steady_clock::now();
+	for (int32_t end = kChunk; end < streamLength + kChunk; end += kChunk)
+		lexer.Lex(text, end < streamLength ? end : streamLength, full);
+	double streamFull = Seconds(start);
+
+	runs.clear();
+	lexer.Lex(text, 0, runs);
+	start = std::chrono::steady_clock::now();
+	for (int32_t end = kChunk; end < streamLength + kChunk; end += kChunk)
+		lexer.LexAppended(text, end < streamLength ? end : streamLength, runs);
+	double streamTail = Seconds(start);
+	if (runs.size() != full.size())
+		fprintf(stderr, "incremental runs differ from a full lex\n");
+
+	// Code highlighting of one large C block
+	std::string code;
+	while (code.size() < document.size())
+		code += kCode;
+	const CodeLanguage* language = CodeHighlighter::FindLanguage("c", 1);
+	std::vector<CodeToken> tokens;
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < kIterations; i++) {
+		CodeHighlighter::Tokenize(language, code.c_str(),
+			static_cast<int32_t>(code.size()), tokens);
+	}
+	double highlight = Seconds(start);
+
+	double total = double(length) * kIterations / (1024.0 * 1024.0);
+	printf("document:        %d bytes, %d runs\n", (int)length,
+		(int)runs.size());
+	printf("skip (scalar):   %8.1f MB/s\n", total / scalar);
+#if defined(__SSE2__)
+	printf("skip (SSE2):     %8.1f MB/s\n", total / vector);
+#else
+	printf("skip (no SIMD):  %8.1f MB/s\n", total / vector);
+#endif
+	printf("lex:             %8.1f MB/s\n", total / lex);
+	printf("highlight (C):   %8.1f MB/s, %d tokens\n",
+		double(code.size()) * kIterations / (1024.0 * 1024.0) / highlight,
+		(int)tokens.size());
+	printf("stream (full):   %8.2f ms for %d bytes\n", streamFull * 1000,
+		(int)streamLength);
+	printf("stream (tail):   %8.2f ms for %d bytes\n", streamTail * 1000,
+		(int)streamLength);
+
+	// Linear time shows as the same rate at both sizes
+	printf("pathological:          64 KB       4 MB\n");
+	for (size_t i = 0; i < sizeof(kPathological) / sizeof(kPathological[0]);
+			i++) {
+		std::string small;
+		while (small.size() < 64 * 1024)
+			small += kPathological[i].unit;
+		std::string large;
+		while (large.size() < 4 * 1024 * 1024)
+			large += small;
+
+		double smallRate = LexRate(lexer, small, runs);
+		double largeRate = LexRate(lexer, large, runs);
+		printf("  %-13s %8.1f MB/s %6.1f MB/s\n", kPathological[i].name,
+			smallRate, largeRate);
+	}
+
+	return hits == 0;
+}
@@ -0,0 +1,200 @@
+// Randomized checks for MarkdownLexer and CodeHighlighter. Feeds soups of
+// delimiters and checks that runs tile the text, that streaming lexes
+// agree with full ones, and that the time per byte does not grow with the
+// size of the input:
+//
+//	make -C bench && bench/MarkdownFuzz [iterations] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "CodeHighlighter.h"
+#include "MarkdownLexer.h"
+
+
+static const char* kAtoms[] = {
+	"*", "**", "***", "_", "__", "`", "``", "```", "```cpp\n", "```py\n",
+	"\n", "\n\n", "# ", "###### ", "- ", "* ", "word", " ", "\t", "a_b",
+	"x", "/*", "*/", "\"", "'", "#", "$x", "//", "+", "-", "@@", "0x1f"
+};
+static const int kAtomCount = sizeof(kAtoms) / sizeof(kAtoms[0]);
+
+// Worst accepted per byte slowdown of a soup ten times as large
+static const double kMaxGrowth = 4.0;
+
+
+static std::string
+Soup(int atoms)
+{
+	std::string text;
+	for (int i = 0; i < atoms; i++)
+		text += kAtoms[rand() % kAtomCount];
+	return text;
+}
+
+
+static bool
+SameRuns(const std::vector<MarkdownRun>& a, const std::vector<MarkdownRun>& b)
+{
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); i++) {
+		if (a[i].offset != b[i].offset || a[i].length != b[i].length
+			|| a[i].flags != b[i].flags || a[i].level != b[i].level)
+			return false;
+	}
+	return true;
+}
+
+
+static bool
+Tiles(const std::vector<MarkdownRun>& runs, int32_t length)
+{
+	int32_t offset = 0;
+	for (size_t i = 0; i < runs.size(); i++) {
+		if (runs[i].offset != offset || runs[i].length <= 0)
+			return false;
+		offset += runs[i].length;
+	}
+	return offset == length;
+}
+
+
+static bool
+SameTokens(const std::vector<CodeToken>& a, const std::vector<CodeToken>& b)
+{
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); i++) {
+		if (a[i].offset != b[i].offset || a[i].length != b[i].length
+			|| a[i].kind != b[i].kind)
+			return false;
+	}
+	return true;
+}
+
+
+static bool
+Fail(const char* what, const std::string& text)
+{
+	printf("FAILED: %s\n--- input (%d bytes) ---\n%s\n---\n", what,
+		(int)text.size(), text.c_str());
+	return false;
+}
+
+
+static bool
+CheckMarkdown(const std::string& text)
+{
+	int32_t length = static_cast<int32_t>(text.size());
+	MarkdownLexer lexer;
+	std::vector<MarkdownRun> full;
+	lexer.Lex(text.c_str(), length, full);
+	if (!Tiles(full, length))
+		return Fail("runs do not tile the text", text);
+
+	// Stream it in random chunks
+	MarkdownLexer streaming;
+	std::vector<MarkdownRun> runs;
+	streaming.Lex(text.c_str(), 0, runs);
+	for (int32_t end = 0; end < length;) {
+		end += 1 + rand() % 8;
+		if (end > length)
+			end = length;
+		streaming.LexAppended(text.c_str(), end, runs);
+		if (streaming.StableOffset() > end)
+			return Fail("stable offset past the text", text);
+	}
+	if (!SameRuns(runs, full))
+		return Fail("streamed runs differ from a full lex", text);
+	return true;
+}
+
+
+static bool
+CheckCode(const std::string& text)
+{
+	static const char* kTags[] = { "c", "python", "js", "sh", "json", "diff" };
+	const char* tag = kTags[rand() % 6];
+	const CodeLanguage* language = CodeHighlighter::FindLanguage(tag,
+		strlen(tag));
+	int32_t length = static_cast<int32_t>(text.size());
+
+	std::vector<CodeToken> full;
+	CodeHighlighter::Tokenize(language, text.c_str(), length, full);
+
+	CodeHighlighter highlighter;
+	for (int32_t end = 0; end < length;) {
+		end += 1 + rand() % 8;
+		if (end > length)
+			end = length;
+		highlighter.Highlight(0, language, text.c_str(), end);
+	}
+	const std::vector<CodeToken>& streamed = highlighter.Highlight(0,
+		language, text.c_str(), length);
+	if (!SameTokens(streamed, full))
+		return Fail("streamed code tokens differ", text);
+
+	int32_t previousEnd = 0;
+	for (size_t i = 0; i < full.size(); i++) {
+		if (full[i].offset < previousEnd || full[i].length <= 0
+			|| full[i].offset + full[i].length > length)
+			return Fail("code tokens overlap or overflow", text);
+		previousEnd = full[i].offset + full[i].length;
+	}
+	return true;
+}
+
+
+static double
+NanosPerByte(const std::string& text)
+{
+	MarkdownLexer lexer;
+	std::vector<MarkdownRun> runs;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < 4; i++)
+		lexer.Lex(text.c_str(), static_cast<int32_t>(text.size()), runs);
+	double seconds = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	return seconds * 1e9 / (4.0 * text.size());
+}
+
+
+int
+main(int argc, char** argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+	unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+	srand(seed);
+
+	for (int i = 0; i < iterations; i++) {
+		std::string text = Soup(rand() % 80);
+		if (!CheckMarkdown(text) || !CheckCode(text)) {
+			printf("seed %u, iteration %d\n", seed, i);
+			return 1;
+		}
+	}
+
+	// Linear time: a ten times larger soup costs about the same per byte
+	double worst = 0;
+	for (int i = 0; i < 10; i++) {
+		std::string small = Soup(30000);
+		std::string large = Soup(300000);
+		double growth = NanosPerByte(large) / NanosPerByte(small);
+		if (growth > worst)
+			worst = growth;
+		if (growth > kMaxGrowth) {
+			Fail("time per byte grows with input size", large.substr(0, 200));
+			return 1;
+		}
+	}
+
+	printf("%d inputs ok (seed %u), worst per byte growth at 10x size "
+		"%.2f\n", iterations, seed, worst);
+	return 0;
+}
@@ -10,7 +10,8 @@ App::App()
 	:
 	BApplication("application/x-vnd.HaikuChat"),
 	fSettings(NULL),
-	fMainWindow(NULL)
+	fMainWindow(NULL),
+	fBatchRunner(NULL)
 {
 	fSettings = new Settings();
 	status_t status = fSettings->Load();
@@ -23,6 +24,8 @@ App::App()
 
 App::~App()
 {
+	if (fBatchRunner != NULL && fBatchRunner->Lock())
+		fBatchRunner->Quit();
 	delete fSettings;
 }
 
@@ -34,12 +37,25 @@ App::ArgvReceived(int32 argc, char** argv)
 		if (strcmp(argv[i], "-log") == 0 || strcmp(argv[i], "--log") == 0) {
 			InitLogging(true);
 			LOG("Logging enabled via command line");
+		} else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			fBatchInput = argv[++i];
+		} else if (strcmp(argv[i], "--batch-endpoint") == 0 && i + 1 < argc) {
+			fBatchEndpoint = argv[++i];
+		} else if (strcmp(argv[i], "--batch-model") == 0 && i + 1 < argc) {
+			fBatchModel = argv[++i];
 		} else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
 			printf("HaikuChat - Native AI chat client for Haiku\n\n");
 			printf("Usage: HaikuChat [options]\n\n");
 			printf("Options:\n");
 			printf("  -log, --log    Enable console logging for debugging\n");
 			printf("  -h, --help     Show this help message\n");
+			printf("  --batch <file> Run a JSONL file of conversations through the\n");
+			printf("                 provider's batch API and save the replies as\n");
+			printf("                 chats, without opening a window\n");
+			printf("  --batch-endpoint <url>\n");
+			printf("                 Override the API endpoint for --batch\n");
+			printf("  --batch-model <model>\n");
+			printf("                 Override the model for --batch\n");
 			printf("\n");
 			printf("Supports OpenAI, Claude, and Gemini APIs.\n");
 			be_app->PostMessage(B_QUIT_REQUESTED);
@@ -51,6 +67,22 @@ App::ArgvReceived(int32 argc, char** argv)
 void
 App::ReadyToRun()
 {
+	if (fBatchInput.Length() > 0) {
+		// Batch mode runs with the current provider settings and no window
+		ApiType apiType = fSettings->GetApiType();
+		BString endpoint(fBatchEndpoint.Length() > 0
+			? fBatchEndpoint.String() : fSettings->GetApiEndpoint());
+		BString model(fBatchModel.Length() > 0
+			? fBatchModel.String() : fSettings->GetModel());
+
+		LOG("App::ReadyToRun - Starting batch for %s", fBatchInput.String());
+		fBatchRunner = new BatchRunner(fSettings, BMessenger(this),
+			fBatchInput.String(), apiType, endpoint.String(),
+			fSettings->GetApiKey(), model.String());
+		fBatchRunner->Start();
+		return;
+	}
+
 	LOG("App::ReadyToRun - Creating main window");
 
 	// Initialize theme from settings
@@ -63,6 +95,31 @@ App::ReadyToRun()
 }
 
 
+void
+App::MessageReceived(BMessage* message)
+{
+	switch (message->what) {
+		case kMsgBatchDone:
+		{
+			int32 sessions = message->GetInt32("sessions", 0);
+			int32 failed = message->GetInt32("failed", 0);
+			const char* error = message->GetString("error", NULL);
+
+			if (error != NULL)
+				fprintf(stderr, "Batch failed: %s\n", error);
+			printf("Batch: %d chats saved, %d results failed\n",
+				(int)sessions, (int)failed);
+			PostMessage(B_QUIT_REQUESTED);
+			break;
+		}
+
+		default:
+			BApplication::MessageReceived(message);
+			break;
+	}
+}
+
+
 void
 App::AboutRequested()
 {
@@ -2,7 +2,9 @@
 #define APP_H
 
 #include <Application.h>
+#include <String.h>
 
+#include "BatchRunner.h"
 #include "MainWindow.h"
 #include "Settings.h"
 
@@ -13,11 +15,18 @@ public:
 
 	virtual void		ArgvReceived(int32 argc, char** argv);
 	virtual void		ReadyToRun();
+	virtual void		MessageReceived(BMessage* message);
 	virtual void		AboutRequested();
 
 private:
 	Settings*			fSettings;
 	MainWindow*			fMainWindow;
+	BatchRunner*		fBatchRunner;
+
+	// Headless batch mode (--batch)
+	BString				fBatchInput;
+	BString				fBatchEndpoint;
+	BString				fBatchModel;
 };
 
 #endif // APP_H
@@ -0,0 +1,721 @@
+#include "BatchRunner.h"
+
+#include <File.h>
+#include <HttpHeaders.h>
+#include <HttpRequest.h>
+#include <HttpResult.h>
+#include <UrlProtocolRoster.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "ChatMessage.h"
+#include "ChatSession.h"
+#include "JsonUtils.h"
+#include "Log.h"
+
+// Poll delay after the batch is created, grown by kPollBackoff per poll
+static const bigtime_t kInitialPollDelay = 5000000;
+static const bigtime_t kMaxPollDelay = 60000000;
+static const float kPollBackoff = 1.5f;
+// Network errors tolerated in a row while polling
+static const int32 kMaxPollFailures = 5;
+
+
+// BatchProtocolListener implementation
+
+BatchProtocolListener::BatchProtocolListener(BatchRunner* runner)
+	:
+	fRunner(runner)
+{
+}
+
+
+BatchProtocolListener::~BatchProtocolListener()
+{
+}
+
+
+void
+BatchProtocolListener::HeadersReceived(BUrlRequest* caller)
+{
+	if (fRunner != NULL)
+		fRunner->HandleHeaders(caller);
+}
+
+
+void
+BatchProtocolListener::RequestCompleted(BUrlRequest* caller, bool success)
+{
+	if (fRunner != NULL)
+		fRunner->HandleStepCompleted(caller, success);
+}
+
+
+// BatchResultOutput implementation
+
+BatchResultOutput::BatchResultOutput(BatchRunner* runner)
+	:
+	fRunner(runner),
+	fErrorOutput(NULL)
+{
+}
+
+
+BatchResultOutput::~BatchResultOutput()
+{
+}
+
+
+ssize_t
+BatchResultOutput::Write(const void* buffer, size_t size)
+{
+	if (fErrorOutput != NULL)
+		return fErrorOutput->Write(buffer, size);
+
+	fBuffer.Append(static_cast<const char*>(buffer), size);
+
+	int32 pos;
+	while ((pos = fBuffer.FindFirst('\n')) >= 0) {
+		BString line;
+		fBuffer.MoveInto(line, 0, pos + 1);
+		line.Trim();
+		if (line.Length() > 0)
+			fRunner->HandleResultLine(line);
+	}
+	return size;
+}
+
+
+void
+BatchResultOutput::Flush()
+{
+	fBuffer.Trim();
+	if (fBuffer.Length() > 0)
+		fRunner->HandleResultLine(fBuffer);
+	fBuffer = "";
+}
+
+
+// BatchRunner implementation
+
+BatchRunner::BatchRunner(Settings* settings, BMessenger target,
+	const char* inputPath, ApiType apiType, const char* endpoint,
+	const char* apiKey, const char* model)
+	:
+	BLooper("BatchRunner"),
+	fSettings(settings),
+	fTarget(target),
+	fInputPath(inputPath),
+	fApiType(apiType),
+	fEndpoint(endpoint),
+	fApiKey(apiKey),
+	fModel(model),
+	fEntries(100, true),
+	fStep(kStepIdle),
+	fRequest(NULL),
+	fListener(NULL),
+	fOutput(NULL),
+	fResultOutput(NULL),
+	fPollRunner(NULL),
+	fPollDelay(kInitialPollDelay),
+	fPollFailures(0),
+	fSessionsCreated(0),
+	fFailedResults(0)
+{
+	fListener = new BatchProtocolListener(this);
+	fOutput = new CollectingOutput();
+	fResultOutput = new BatchResultOutput(this);
+	Run();
+}
+
+
+BatchRunner::~BatchRunner()
+{
+	delete fPollRunner;
+	if (fRequest != NULL) {
+		fRequest->Stop();
+		delete fRequest;
+	}
+	delete fListener;
+	delete fOutput;
+	delete fResultOutput;
+}
+
+
+void
+BatchRunner::MessageReceived(BMessage* message)
+{
+	switch (message->what) {
+		case kMsgBatchStart:
+		{
+			status_t status = _LoadInput();
+			if (status != B_OK) {
+				BString error;
+				error.SetToFormat("Could not read %s: %s",
+					fInputPath.String(), strerror(status));
+				_Finish(error.String());
+				break;
+			}
+			if (fEntries.CountItems() == 0) {
+				_Finish("The input file contains no conversations");
+				break;
+			}
+
+			printf("Batch: %d conversations from %s\n",
+				(int)fEntries.CountItems(), fInputPath.String());
+
+			if (fApiType == kApiTypeOpenAI)
+				_Upload();
+			else if (fApiType == kApiTypeClaude)
+				_Create();
+			else {
+				_Finish("Batch mode supports OpenAI-compatible and Claude "
+					"providers");
+			}
+			break;
+		}
+
+		case kMsgBatchStep:
+		{
+			bool success = message->FindBool("success");
+			int32 statusCode = 0;
+			message->FindInt32("status", &statusCode);
+			_StepDone(success, statusCode);
+			break;
+		}
+
+		case kMsgBatchPoll:
+			_Poll();
+			break;
+
+		case kMsgBatchFinished:
+		{
+			BMessage done;
+			if (message->FindMessage("done", &done) == B_OK)
+				fTarget.SendMessage(&done);
+			break;
+		}
+
+		case kMsgBatchResultLine:
+		{
+			BString line;
+			if (message->FindString("line", &line) == B_OK)
+				_AddResult(line);
+			break;
+		}
+
+		default:
+			BLooper::MessageReceived(message);
+			break;
+	}
+}
+
+
+void
+BatchRunner::Start()
+{
+	PostMessage(kMsgBatchStart);
+}
+
+
+void
+BatchRunner::HandleHeaders(BUrlRequest* caller)
+{
+	// Runs on the request thread before any of the body is written. An
+	// error body is not result lines; it goes where the other steps'
+	// responses go, for _StepDone to report. Redirects are followed, so
+	// only error statuses get here as the final status.
+	const BHttpResult* result
+		= dynamic_cast<const BHttpResult*>(&caller->Result());
+	if (result != NULL && result->StatusCode() >= 400)
+		fResultOutput->SetErrorOutput(fOutput);
+}
+
+
+void
+BatchRunner::HandleStepCompleted(BUrlRequest* caller, bool success)
+{
+	// Runs on the request thread - hand over to the looper
+	BMessage message(kMsgBatchStep);
+	message.AddBool("success", success);
+
+	const BHttpResult* result
+		= dynamic_cast<const BHttpResult*>(&caller->Result());
+	if (result != NULL)
+		message.AddInt32("status", result->StatusCode());
+
+	PostMessage(&message);
+}
+
+
+void
+BatchRunner::HandleResultLine(const BString& line)
+{
+	// Runs on the request thread - hand over to the looper
+	BMessage message(kMsgBatchResultLine);
+	message.AddString("line", line);
+	PostMessage(&message);
+}
+
+
+status_t
+BatchRunner::_LoadInput()
+{
+	BFile file(fInputPath.String(), B_READ_ONLY);
+	status_t status = file.InitCheck();
+	if (status != B_OK)
+		return status;
+
+	off_t size;
+	status = file.GetSize(&size);
+	if (status != B_OK)
+		return status;
+
+	BString data;
+	char* buffer = data.LockBuffer(size + 1);
+	if (buffer == NULL)
+		return B_NO_MEMORY;
+	ssize_t bytesRead = file.Read(buffer, size);
+	data.UnlockBuffer(bytesRead > 0 ? bytesRead : 0);
+
+	int32 start = 0;
+	int32 lineNumber = 0;
+	while (start < data.Length()) {
+		int32 end = data.FindFirst('\n', start);
+		if (end < 0)
+			end = data.Length();
+
+		BString line;
+		data.CopyInto(line, start, end - start);
+		line.Trim();
+		start = end + 1;
+		lineNumber++;
+
+		if (line.Length() == 0)
+			continue;
+
+		BatchEntry* entry = new BatchEntry;
+		if (!FindJsonRaw(line, "messages", entry->messagesJson)
+			|| !entry->messagesJson.StartsWith("[")) {
+			LOG_ERROR("BatchRunner - Line %d has no messages array, skipped",
+				lineNumber);
+			delete entry;
+			continue;
+		}
+		if (!FindJsonString(line, "custom_id", entry->customId))
+			entry->customId.SetToFormat("request-%d", lineNumber);
+		FindJsonString(line, "title", entry->title);
+
+		fEntries.AddItem(entry);
+	}
+
+	return B_OK;
+}
+
+
+void
+BatchRunner::_Upload()
+{
+	// OpenAI batches read their requests from an uploaded JSONL file
+	BString jsonl;
+	for (int32 i = 0; i < fEntries.CountItems(); i++) {
+		BatchEntry* entry = fEntries.ItemAt(i);
+		BString line;
+		line.SetToFormat(
+			"{\"custom_id\":\"%s\",\"method\":\"POST\","
+			"\"url\":\"/v1/chat/completions\","
+			"\"body\":{\"model\":\"%s\",\"messages\":%s}}\n",
+			EscapeJson(entry->customId.String()).String(),
+			EscapeJson(fModel.String()).String(),
+			entry->messagesJson.String());
+		jsonl.Append(line);
+	}
+
+	printf("Batch: uploading %d bytes\n", (int)jsonl.Length());
+
+	BHttpForm form;
+	form.SetFormType(B_HTTP_FORM_MULTIPART);
+	form.AddString("purpose", "batch");
+	form.AddFileBuffer("file", "batch.jsonl", jsonl.String(), jsonl.Length());
+
+	fOutput->Clear();
+	if (_Request(kStepUpload, B_HTTP_POST, _Url("files"), NULL, &form,
+			fOutput) != B_OK) {
+		_Finish("Failed to create upload request");
+	}
+}
+
+
+void
+BatchRunner::_Create()
+{
+	BString body;
+	BString path;
+
+	if (fApiType == kApiTypeOpenAI) {
+		path = "batches";
+		body.SetToFormat(
+			"{\"input_file_id\":\"%s\","
+			"\"endpoint\":\"/v1/chat/completions\","
+			"\"completion_window\":\"24h\"}",
+			EscapeJson(fInputFileId.String()).String());
+	} else {
+		path = "messages/batches";
+		body = "{\"requests\":[";
+		for (int32 i = 0; i < fEntries.CountItems(); i++) {
+			BatchEntry* entry = fEntries.ItemAt(i);
+			BString request;
+			request.SetToFormat(
+				"%s{\"custom_id\":\"%s\",\"params\":{\"model\":\"%s\","
+				"\"max_tokens\":4096,\"messages\":%s}}",
+				i > 0 ? "," : "",
+				EscapeJson(entry->customId.String()).String(),
+				EscapeJson(fModel.String()).String(),
+				entry->messagesJson.String());
+			body.Append(request);
+		}
+		body.Append("]}");
+	}
+
+	fOutput->Clear();
+	if (_Request(kStepCreate, B_HTTP_POST, _Url(path.String()), &body, NULL,
+			fOutput) != B_OK) {
+		_Finish("Failed to create batch request");
+	}
+}
+
+
+void
+BatchRunner::_Poll()
+{
+	BString path;
+	if (fApiType == kApiTypeOpenAI)
+		path.SetToFormat("batches/%s", fBatchId.String());
+	else
+		path.SetToFormat("messages/batches/%s", fBatchId.String());
+
+	fOutput->Clear();
+	if (_Request(kStepPoll, B_HTTP_GET, _Url(path.String()), NULL, NULL,
+			fOutput) != B_OK) {
+		_Finish("Failed to create poll request");
+	}
+}
+
+
+void
+BatchRunner::_SchedulePoll()
+{
+	delete fPollRunner;
+
+	BMessage poll(kMsgBatchPoll);
+	fPollRunner = new BMessageRunner(BMessenger(this), &poll, fPollDelay, 1);
+
+	fPollDelay = (bigtime_t)(fPollDelay * kPollBackoff);
+	if (fPollDelay > kMaxPollDelay)
+		fPollDelay = kMaxPollDelay;
+}
+
+
+void
+BatchRunner::_Download(const char* url)
+{
+	printf("Batch: downloading results\n");
+
+	fOutput->Clear();
+	fResultOutput->SetErrorOutput(NULL);
+	if (_Request(kStepDownload, B_HTTP_GET, BString(url), NULL, NULL,
+			fResultOutput) != B_OK) {
+		_Finish("Failed to create download request");
+	}
+}
+
+
+void
+BatchRunner::_StepDone(bool success, int32 statusCode)
+{
+	BatchStep step = fStep;
+	fStep = kStepIdle;
+	delete fRequest;
+	fRequest = NULL;
+
+	bool httpOk = success && statusCode >= 200 && statusCode < 300;
+
+	if (step == kStepPoll && !httpOk) {
+		// Transient trouble while waiting is retried with the same backoff
+		if (++fPollFailures <= kMaxPollFailures) {
+			LOG_ERROR("BatchRunner - Poll failed (status %d), retrying",
+				(int)statusCode);
+			_SchedulePoll();
+			return;
+		}
+	}
+
+	if (!httpOk) {
+		BString error;
+		BString apiMessage;
+		if (FindJsonString(fOutput->Data(), "message", apiMessage))
+			error.SetToFormat("HTTP %d: %s", (int)statusCode,
+				apiMessage.String());
+		else if (!success)
+			error = "Request failed - check the endpoint and network";
+		else
+			error.SetToFormat("HTTP %d", (int)statusCode);
+		_Finish(error.String());
+		return;
+	}
+
+	const BString& json = fOutput->Data();
+
+	switch (step) {
+		case kStepUpload:
+			if (!FindJsonString(json, "id", fInputFileId)) {
+				_Finish("Upload response has no file id");
+				return;
+			}
+			LOG("BatchRunner - Uploaded input file %s", fInputFileId.String());
+			_Create();
+			break;
+
+		case kStepCreate:
+			if (!FindJsonString(json, "id", fBatchId)) {
+				_Finish("Batch response has no batch id");
+				return;
+			}
+			printf("Batch: created %s, waiting for completion\n",
+				fBatchId.String());
+			_SchedulePoll();
+			break;
+
+		case kStepPoll:
+		{
+			fPollFailures = 0;
+			BString status;
+			if (fApiType == kApiTypeOpenAI) {
+				FindJsonString(json, "status", status);
+				if (status == "completed") {
+					BString outputFile;
+					if (!FindJsonString(json, "output_file_id", outputFile)) {
+						_Finish("Batch completed without an output file");
+						return;
+					}
+					BString path;
+					path.SetToFormat("files/%s/content", outputFile.String());
+					_Download(_Url(path.String()).String());
+					return;
+				}
+				if (status == "failed" || status == "expired"
+					|| status == "cancelled") {
+					BString error;
+					error.SetToFormat("Batch %s", status.String());
+					_Finish(error.String());
+					return;
+				}
+			} else {
+				FindJsonString(json, "processing_status", status);
+				if (status == "ended") {
+					BString resultsUrl;
+					if (!FindJsonString(json, "results_url", resultsUrl)) {
+						_Finish("Batch ended without a results URL");
+						return;
+					}
+					_Download(resultsUrl.String());
+					return;
+				}
+			}
+
+			printf("Batch: %s, next check in %ds\n", status.String(),
+				(int)(fPollDelay / 1000000));
+			_SchedulePoll();
+			break;
+		}
+
+		case kStepDownload:
+			// Result lines were posted while downloading, so the last one
+			// queued here is processed before the finish message
+			fResultOutput->Flush();
+			_Finish(NULL);
+			break;
+
+		default:
+			break;
+	}
+}
+
+
+void
+BatchRunner::_AddResult(const BString& line)
+{
+	BString customId;
+	FindJsonString(line, "custom_id", customId);
+	BatchEntry* entry = _FindEntry(customId);
+	if (entry == NULL) {
+		LOG_ERROR("BatchRunner - Result for unknown id '%s'",
+			customId.String());
+		fFailedResults++;
+		return;
+	}
+
+	BString reply;
+	bool found = false;
+	if (fApiType == kApiTypeOpenAI) {
+		BString choices;
+		found = FindJsonRaw(line, "choices", choices)
+			&& FindJsonString(choices, "content", reply);
+	} else {
+		BString result;
+		BString type;
+		BString content;
+		found = FindJsonRaw(line, "result", result)
+			&& FindJsonString(result, "type", type) && type == "succeeded"
+			&& FindJsonRaw(result, "content", content)
+			&& FindJsonString(content, "text", reply);
+	}
+
+	if (!found) {
+		LOG_ERROR("BatchRunner - No reply for '%s': %s", customId.String(),
+			line.String());
+		fFailedResults++;
+		return;
+	}
+
+	ChatSession* session = new ChatSession();
+	_AddMessages(session, entry->messagesJson);
+	session->AddMessage(new ChatMessage(kRoleAssistant, reply.String()));
+	if (entry->title.Length() > 0)
+		session->SetTitle(entry->title.String());
+
+	fSettings->GetSessions().AddItem(session, 0);
+	fSettings->SaveSession(session);
+	fSessionsCreated++;
+
+	LOG("BatchRunner - Saved '%s' as session %s", customId.String(),
+		session->Id());
+}
+
+
+void
+BatchRunner::_AddMessages(ChatSession* session, const BString& messagesJson)
+{
+	// Each message is read on its own, its keys may come in any order
+	int32 pos = 0;
+	BString message;
+	while (FindJsonObject(messagesJson, message, pos, &pos)) {
+		BString role;
+		FindJsonString(message, "role", role);
+
+		// Content is a string, or an array of parts of which the text
+		// ones are kept
+		BString content;
+		if (!FindJsonString(message, "content", content)) {
+			BString parts;
+			if (FindJsonRaw(message, "content", parts)
+				&& parts.StartsWith("[")) {
+				int32 partPos = 0;
+				BString part;
+				while (FindJsonObject(parts, part, partPos, &partPos)) {
+					BString text;
+					if (!FindJsonString(part, "text", text))
+						continue;
+					if (content.Length() > 0)
+						content << "\n";
+					content << text;
+				}
+			}
+		}
+
+		MessageRole messageRole = kRoleUser;
+		if (role == "assistant")
+			messageRole = kRoleAssistant;
+		else if (role == "system")
+			messageRole = kRoleSystem;
+
+		session->AddMessage(new ChatMessage(messageRole, content.String()));
+	}
+}
+
+
+BatchEntry*
+BatchRunner::_FindEntry(const BString& customId) const
+{
+	for (int32 i = 0; i < fEntries.CountItems(); i++) {
+		if (fEntries.ItemAt(i)->customId == customId)
+			return fEntries.ItemAt(i);
+	}
+	return NULL;
+}
+
+
+status_t
+BatchRunner::_Request(BatchStep step, const char* method, const BString& url,
+	const BString* body, BHttpForm* form, BDataIO* output)
+{
+	LOG("BatchRunner - %s %s", method, url.String());
+
+	BUrlRequest* request = BUrlProtocolRoster::MakeRequest(
+		BUrl(url.String()), output, fListener, NULL);
+	BHttpRequest* httpRequest = dynamic_cast<BHttpRequest*>(request);
+	if (httpRequest == NULL) {
+		delete request;
+		return B_ERROR;
+	}
+
+	httpRequest->SetMethod(method);
+
+	BHttpHeaders* headers = new BHttpHeaders();
+	if (fApiType == kApiTypeOpenAI) {
+		BString authHeader;
+		authHeader.SetToFormat("Bearer %s", fApiKey.String());
+		headers->AddHeader("Authorization", authHeader.String());
+	} else if (fApiType == kApiTypeClaude) {
+		headers->AddHeader("x-api-key", fApiKey.String());
+		headers->AddHeader("anthropic-version", "2023-06-01");
+	}
+
+	if (body != NULL) {
+		headers->AddHeader("Content-Type", "application/json");
+
+		BMallocIO* bodyData = new BMallocIO();
+		bodyData->Write(body->String(), body->Length());
+		bodyData->Seek(0, SEEK_SET);
+		httpRequest->AdoptInputData(bodyData, body->Length());
+	} else if (form != NULL)
+		httpRequest->SetPostFields(*form);
+
+	httpRequest->AdoptHeaders(headers);
+
+	fStep = step;
+	fRequest = request;
+	fRequest->Run();
+	return B_OK;
+}
+
+
+BString
+BatchRunner::_Url(const char* path) const
+{
+	BString url(fEndpoint);
+	if (!url.EndsWith("/"))
+		url.Append("/");
+	url.Append(path);
+	return url;
+}
+
+
+void
+BatchRunner::_Finish(const char* error)
+{
+	BMessage done(kMsgBatchDone);
+	if (error != NULL) {
+		LOG_ERROR("BatchRunner - %s", error);
+		done.AddString("error", error);
+	}
+	done.AddInt32("sessions", fSessionsCreated);
+	done.AddInt32("failed", fFailedResults);
+
+	// Queue behind any result lines still waiting in this looper
+	BMessage forward(kMsgBatchFinished);
+	forward.AddMessage("done", &done);
+	PostMessage(&forward);
+}
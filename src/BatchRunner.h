@@ -0,0 +1,136 @@
+#ifndef BATCH_RUNNER_H
+#define BATCH_RUNNER_H
+
+#include <DataIO.h>
+#include <HttpForm.h>
+#include <Looper.h>
+#include <MessageRunner.h>
+#include <Messenger.h>
+#include <ObjectList.h>
+#include <String.h>
+#include <UrlProtocolListener.h>
+#include <UrlRequest.h>
+
+#include "Constants.h"
+#include "LLMClient.h"
+#include "Settings.h"
+
+using namespace BPrivate::Network;
+
+class BatchRunner;
+
+
+// One conversation read from the input JSONL file
+struct BatchEntry {
+	BString				customId;
+	BString				title;
+	BString				messagesJson;
+};
+
+
+class BatchProtocolListener : public BUrlProtocolListener {
+public:
+						BatchProtocolListener(BatchRunner* runner);
+	virtual				~BatchProtocolListener();
+
+	virtual void		HeadersReceived(BUrlRequest* caller);
+	virtual void		RequestCompleted(BUrlRequest* caller, bool success);
+
+private:
+	BatchRunner*		fRunner;
+};
+
+
+// Splits the downloaded result file into lines and hands each one to the
+// runner as soon as it arrives
+class BatchResultOutput : public BDataIO {
+public:
+						BatchResultOutput(BatchRunner* runner);
+	virtual				~BatchResultOutput();
+
+	virtual ssize_t		Write(const void* buffer, size_t size);
+	void				Flush();
+
+	// While set, the data goes there whole instead, as for an error body
+	void				SetErrorOutput(BDataIO* output)
+							{ fErrorOutput = output; }
+
+private:
+	BatchRunner*		fRunner;
+	BDataIO*			fErrorOutput;
+	BString				fBuffer;
+};
+
+
+// Runs a JSONL file of conversations through the provider's batch API
+// without a window: upload, create the batch, poll with backoff, then turn
+// each result line into a saved ChatSession. Reports kMsgBatchDone to the
+// target when finished.
+class BatchRunner : public BLooper {
+public:
+						BatchRunner(Settings* settings, BMessenger target,
+							const char* inputPath, ApiType apiType,
+							const char* endpoint, const char* apiKey,
+							const char* model);
+	virtual				~BatchRunner();
+
+	virtual void		MessageReceived(BMessage* message);
+
+	void				Start();
+
+	void				HandleHeaders(BUrlRequest* caller);
+	void				HandleStepCompleted(BUrlRequest* caller,
+							bool success);
+	void				HandleResultLine(const BString& line);
+
+private:
+	enum BatchStep {
+		kStepIdle = 0,
+		kStepUpload,
+		kStepCreate,
+		kStepPoll,
+		kStepDownload
+	};
+
+	status_t			_LoadInput();
+	void				_Upload();
+	void				_Create();
+	void				_Poll();
+	void				_SchedulePoll();
+	void				_Download(const char* url);
+	void				_StepDone(bool success, int32 statusCode);
+	void				_AddResult(const BString& line);
+	void				_AddMessages(ChatSession* session,
+							const BString& messagesJson);
+	BatchEntry*			_FindEntry(const BString& customId) const;
+	status_t			_Request(BatchStep step, const char* method,
+							const BString& url, const BString* body,
+							BHttpForm* form, BDataIO* output);
+	BString				_Url(const char* path) const;
+	void				_Finish(const char* error);
+
+	Settings*			fSettings;
+	BMessenger			fTarget;
+	BString				fInputPath;
+	ApiType				fApiType;
+	BString				fEndpoint;
+	BString				fApiKey;
+	BString				fModel;
+
+	BObjectList<BatchEntry> fEntries;
+	BatchStep			fStep;
+	BUrlRequest*		fRequest;
+	BatchProtocolListener* fListener;
+	CollectingOutput*	fOutput;
+	BatchResultOutput*	fResultOutput;
+	BMessageRunner*		fPollRunner;
+	bigtime_t			fPollDelay;
+	int32				fPollFailures;
+
+	BString				fInputFileId;
+	BString				fBatchId;
+	int32				fSessionsCreated;
+	int32				fFailedResults;
+};
+
+#endif // BATCH_RUNNER_H
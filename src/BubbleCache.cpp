@@ -0,0 +1,75 @@
+#include "BubbleCache.h"
+
+
+BubbleCache::BubbleCache(size_t budget)
+	:
+	fEntries(64, true),
+	fBudget(budget),
+	fBytes(0)
+{
+}
+
+
+BubbleCache::~BubbleCache()
+{
+}
+
+
+BBitmap*
+BubbleCache::Acquire(const BubbleCacheKey& key)
+{
+	for (int32 i = 0; i < fEntries.CountItems(); i++) {
+		Entry* entry = fEntries.ItemAt(i);
+		if (!(entry->key == key))
+			continue;
+
+		if (i > 0)
+			fEntries.MoveItem(i, 0);
+		entry->users++;
+		return entry->bitmap;
+	}
+	return NULL;
+}
+
+
+void
+BubbleCache::Add(const BubbleCacheKey& key, BBitmap* bitmap)
+{
+	Entry* entry = new Entry;
+	entry->key = key;
+	entry->bitmap = bitmap;
+	entry->users = 1;
+	fEntries.AddItem(entry, 0);
+	fBytes += bitmap->BitsLength();
+	_Trim(fBudget);
+}
+
+
+void
+BubbleCache::Release(BBitmap* bitmap)
+{
+	for (int32 i = 0; i < fEntries.CountItems(); i++) {
+		Entry* entry = fEntries.ItemAt(i);
+		if (entry->bitmap == bitmap) {
+			entry->users--;
+			break;
+		}
+	}
+	_Trim(fBudget);
+}
+
+
+void
+BubbleCache::_Trim(size_t budget)
+{
+	for (int32 i = fEntries.CountItems() - 1; i >= 0 && fBytes > budget;
+			i--) {
+		Entry* entry = fEntries.ItemAt(i);
+		if (entry->users > 0)
+			continue;
+
+		fBytes -= entry->bitmap->BitsLength();
+		fEntries.RemoveItemAt(i);
+		delete entry;
+	}
+}
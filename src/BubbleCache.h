@@ -0,0 +1,58 @@
+#ifndef BUBBLE_CACHE_H
+#define BUBBLE_CACHE_H
+
+#include <Bitmap.h>
+#include <ObjectList.h>
+
+// What a rendered bubble looked like: the bitmap is reused only for the
+// same message version at the same size and theme. Messages are told
+// apart by serial, as a new one may get the address of a deleted one.
+struct BubbleCacheKey {
+	uint32				message;	// ChatMessage::Serial()
+	uint32				version;
+	int32				width;
+	int32				height;
+	uint32				theme;
+
+	bool				operator==(const BubbleCacheKey& other) const
+							{ return message == other.message
+								&& version == other.version
+								&& width == other.width
+								&& height == other.height
+								&& theme == other.theme; }
+};
+
+
+// Bitmaps of finished bubbles, so scrolling blits them instead of drawing
+// styled text again. Bitmaps a bubble still shows are never evicted; the
+// others go least recently used first once over the memory budget.
+class BubbleCache {
+public:
+						BubbleCache(size_t budget);
+						~BubbleCache();
+
+	// Returns the cached bitmap, acquired, or NULL
+	BBitmap*			Acquire(const BubbleCacheKey& key);
+	// Takes ownership of bitmap and acquires it
+	void				Add(const BubbleCacheKey& key, BBitmap* bitmap);
+	void				Release(BBitmap* bitmap);
+	// Frees every bitmap no bubble shows
+	void				Purge() { _Trim(0); }
+
+private:
+	struct Entry {
+						~Entry() { delete bitmap; }
+
+		BubbleCacheKey	key;
+		BBitmap*		bitmap;
+		int32			users;
+	};
+
+	void				_Trim(size_t budget);
+
+	BObjectList<Entry>	fEntries;	// most recent first
+	size_t				fBudget;
+	size_t				fBytes;
+};
+
+#endif // BUBBLE_CACHE_H
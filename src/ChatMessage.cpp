@@ -1,28 +1,54 @@
 #include "ChatMessage.h"
 
+#include <ByteOrder.h>
+#include <OS.h>
+
+
+static int32 sNextSerial = 1;
+
+// Saved runs are little-endian int32 triples: offset, length, and the
+// flags with the header level in bits 16-23
+static const int32 kPackedRunFields = 3;
+
+
 ChatMessage::ChatMessage()
 	:
+	fSerial(atomic_add(&sNextSerial, 1)),
 	fRole(kRoleUser),
 	fContent(""),
-	fTimestamp(time(NULL))
+	fTimestamp(time(NULL)),
+	fVersion(1),
+	fRunsVersion(0),
+	fNextTextSize(0),
+	fExpanded(false)
 {
 }
 
 
 ChatMessage::ChatMessage(MessageRole role, const char* content)
 	:
+	fSerial(atomic_add(&sNextSerial, 1)),
 	fRole(role),
 	fContent(content),
-	fTimestamp(time(NULL))
+	fTimestamp(time(NULL)),
+	fVersion(1),
+	fRunsVersion(0),
+	fNextTextSize(0),
+	fExpanded(false)
 {
 }
 
 
 ChatMessage::ChatMessage(const BMessage* archive)
 	:
+	fSerial(atomic_add(&sNextSerial, 1)),
 	fRole(kRoleUser),
 	fContent(""),
-	fTimestamp(time(NULL))
+	fTimestamp(time(NULL)),
+	fVersion(1),
+	fRunsVersion(0),
+	fNextTextSize(0),
+	fExpanded(false)
 {
 	if (archive == NULL)
 		return;
@@ -38,6 +64,8 @@ ChatMessage::ChatMessage(const BMessage* archive)
 	int64 timestamp;
 	if (archive->FindInt64("timestamp", &timestamp) == B_OK)
 		fTimestamp = static_cast<time_t>(timestamp);
+
+	_LoadRuns(archive);
 }
 
 
@@ -58,6 +86,24 @@ ChatMessage::Archive(BMessage* archive) const
 	if (status == B_OK)
 		status = archive->AddInt64("timestamp", static_cast<int64>(fTimestamp));
 
+	// Saving the runs lets a reopened session skip parsing
+	if (status == B_OK && HasCurrentRuns() && !fRuns.empty()) {
+		status = archive->AddInt32("markdown_format", kMarkdownRunFormat);
+		if (status == B_OK) {
+			std::vector<int32> packed(fRuns.size() * kPackedRunFields);
+			for (size_t i = 0; i < fRuns.size(); i++) {
+				const MarkdownRun& run = fRuns[i];
+				int32* fields = &packed[i * kPackedRunFields];
+				fields[0] = B_HOST_TO_LENDIAN_INT32(run.offset);
+				fields[1] = B_HOST_TO_LENDIAN_INT32(run.length);
+				fields[2] = B_HOST_TO_LENDIAN_INT32(run.flags
+					| (int32)run.level << 16);
+			}
+			status = archive->AddData("markdown_run_data", B_RAW_TYPE,
+				&packed[0], packed.size() * sizeof(int32));
+		}
+	}
+
 	return status;
 }
 
@@ -73,6 +119,7 @@ void
 ChatMessage::SetContent(const char* content)
 {
 	fContent = content;
+	fVersion++;
 }
 
 
@@ -80,4 +127,85 @@ void
 ChatMessage::AppendContent(const char* text)
 {
 	fContent.Append(text);
+	fVersion++;
+}
+
+
+bool
+ChatMessage::GetTextSize(int32 wrapWidth, uint32 fontKey, float* height,
+	float* lineWidth) const
+{
+	for (int32 i = 0; i < 2; i++) {
+		const TextSize& size = fTextSizes[i];
+		if (size.version == fVersion && size.wrapWidth == wrapWidth
+			&& size.fontKey == fontKey) {
+			*height = size.height;
+			*lineWidth = size.lineWidth;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void
+ChatMessage::SetTextSize(int32 wrapWidth, uint32 fontKey, float height,
+	float lineWidth)
+{
+	// Overwrite the entry for this width, else the older one
+	int32 index = fNextTextSize;
+	for (int32 i = 0; i < 2; i++) {
+		if (fTextSizes[i].wrapWidth == wrapWidth
+			&& fTextSizes[i].version != 0) {
+			index = i;
+			break;
+		}
+	}
+	if (index == fNextTextSize)
+		fNextTextSize = 1 - fNextTextSize;
+
+	TextSize& size = fTextSizes[index];
+	size.version = fVersion;
+	size.wrapWidth = wrapWidth;
+	size.fontKey = fontKey;
+	size.height = height;
+	size.lineWidth = lineWidth;
+}
+
+
+void
+ChatMessage::_LoadRuns(const BMessage* archive)
+{
+	int32 format;
+	const void* data;
+	ssize_t size;
+	if (archive->FindInt32("markdown_format", &format) != B_OK
+		|| format != kMarkdownRunFormat
+		|| archive->FindData("markdown_run_data", B_RAW_TYPE, &data,
+			&size) != B_OK
+		|| size <= 0 || size % (kPackedRunFields * sizeof(int32)) != 0)
+		return;
+
+	// Only trust runs that exactly tile the content
+	const int32* packed = static_cast<const int32*>(data);
+	size_t count = size / (kPackedRunFields * sizeof(int32));
+	std::vector<MarkdownRun> runs(count);
+	int32 offset = 0;
+	for (size_t i = 0; i < count; i++) {
+		const int32* fields = packed + i * kPackedRunFields;
+		MarkdownRun& run = runs[i];
+		run.offset = B_LENDIAN_TO_HOST_INT32(fields[0]);
+		run.length = B_LENDIAN_TO_HOST_INT32(fields[1]);
+		int32 flags = B_LENDIAN_TO_HOST_INT32(fields[2]);
+		run.flags = flags & 0xffff;
+		run.level = (flags >> 16) & 0xff;
+		if (run.offset != offset || run.length <= 0)
+			return;
+		offset += run.length;
+	}
+	if (offset != fContent.Length())
+		return;
+
+	fRuns.swap(runs);
+	fRunsVersion = fVersion;
 }
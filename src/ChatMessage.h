@@ -4,6 +4,9 @@
 #include <Message.h>
 #include <String.h>
 #include <ctime>
+#include <vector>
+
+#include "MarkdownLexer.h"
 
 enum MessageRole {
 	kRoleUser = 0,
@@ -24,14 +27,56 @@ public:
 	MessageRole			Role() const { return fRole; }
 	const char*			Content() const { return fContent.String(); }
 	time_t				Timestamp() const { return fTimestamp; }
+	uint32				Version() const { return fVersion; }
+	// Unique for the life of the app, unlike the address of a deleted
+	// message; caches key on it
+	uint32				Serial() const { return fSerial; }
 
 	void				SetContent(const char* content);
 	void				AppendContent(const char* text);
 
+	// Parsed markdown of the content, shared by every view of the message
+	// and saved with it. Only valid while HasCurrentRuns().
+	std::vector<MarkdownRun>& MarkdownRuns() { return fRuns; }
+	bool				HasCurrentRuns() const
+							{ return fRunsVersion == fVersion; }
+	void				SetRunsCurrent() { fRunsVersion = fVersion; }
+
+	// Laid out size of the content at a wrap width with the fonts of
+	// fontKey, kept for the current version. The last two widths are
+	// remembered.
+	bool				GetTextSize(int32 wrapWidth, uint32 fontKey,
+							float* height, float* lineWidth) const;
+	void				SetTextSize(int32 wrapWidth, uint32 fontKey,
+							float height, float lineWidth);
+
+	// Shown whole even when long enough to be collapsed; not saved
+	bool				IsExpanded() const { return fExpanded; }
+	void				SetExpanded(bool expanded) { fExpanded = expanded; }
+
 private:
+	struct TextSize {
+						TextSize() : version(0) {}
+
+		uint32			version;
+		int32			wrapWidth;
+		uint32			fontKey;
+		float			height;
+		float			lineWidth;
+	};
+
+	void				_LoadRuns(const BMessage* archive);
+
+	uint32				fSerial;
 	MessageRole			fRole;
 	BString				fContent;
 	time_t				fTimestamp;
+	uint32				fVersion;
+	std::vector<MarkdownRun> fRuns;
+	uint32				fRunsVersion;
+	TextSize			fTextSizes[2];
+	int32				fNextTextSize;
+	bool				fExpanded;
 };
 
 #endif // CHAT_MESSAGE_H
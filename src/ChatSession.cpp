@@ -4,6 +4,7 @@
 #include <File.h>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include "Log.h"
 
@@ -12,7 +13,9 @@ ChatSession::ChatSession()
 	fTitle("New Chat"),
 	fCreatedAt(time(NULL)),
 	fUpdatedAt(time(NULL)),
-	fMessages(20, true)
+	fMessages(20, true),
+	fResponseMessageCount(0),
+	fSummarizedCount(0)
 {
 	_GenerateId();
 }
@@ -24,7 +27,9 @@ ChatSession::ChatSession(const char* id)
 	fTitle("New Chat"),
 	fCreatedAt(time(NULL)),
 	fUpdatedAt(time(NULL)),
-	fMessages(20, true)
+	fMessages(20, true),
+	fResponseMessageCount(0),
+	fSummarizedCount(0)
 {
 }
 
@@ -34,7 +39,9 @@ ChatSession::ChatSession(const BMessage* archive)
 	fTitle("New Chat"),
 	fCreatedAt(time(NULL)),
 	fUpdatedAt(time(NULL)),
-	fMessages(20, true)
+	fMessages(20, true),
+	fResponseMessageCount(0),
+	fSummarizedCount(0)
 {
 	if (archive == NULL)
 		return;
@@ -54,6 +61,16 @@ ChatSession::ChatSession(const BMessage* archive)
 	if (archive->FindInt64("updated_at", &timestamp) == B_OK)
 		fUpdatedAt = static_cast<time_t>(timestamp);
 
+	if (archive->FindString("response_id", &str) == B_OK)
+		fResponseId = str;
+	if (archive->FindString("response_endpoint", &str) == B_OK)
+		fResponseEndpoint = str;
+	archive->FindInt32("response_count", &fResponseMessageCount);
+
+	if (archive->FindString("summary", &str) == B_OK)
+		fSummary = str;
+	archive->FindInt32("summarized_count", &fSummarizedCount);
+
 	// Load messages
 	BMessage msgArchive;
 	for (int32 i = 0; archive->FindMessage("message", i, &msgArchive) == B_OK; i++) {
@@ -82,6 +99,20 @@ ChatSession::Archive(BMessage* archive) const
 		status = archive->AddInt64("created_at", static_cast<int64>(fCreatedAt));
 	if (status == B_OK)
 		status = archive->AddInt64("updated_at", static_cast<int64>(fUpdatedAt));
+	if (status == B_OK && fResponseId.Length() > 0) {
+		status = archive->AddString("response_id", fResponseId.String());
+		if (status == B_OK) {
+			status = archive->AddString("response_endpoint",
+				fResponseEndpoint.String());
+		}
+		if (status == B_OK)
+			status = archive->AddInt32("response_count", fResponseMessageCount);
+	}
+	if (status == B_OK && fSummary.Length() > 0) {
+		status = archive->AddString("summary", fSummary.String());
+		if (status == B_OK)
+			status = archive->AddInt32("summarized_count", fSummarizedCount);
+	}
 
 	// Save messages
 	for (int32 i = 0; i < fMessages.CountItems() && status == B_OK; i++) {
@@ -120,6 +151,19 @@ ChatSession::Load(const char* path)
 	if (archive.FindInt64("updated_at", &timestamp) == B_OK)
 		fUpdatedAt = static_cast<time_t>(timestamp);
 
+	ClearResponseState();
+	if (archive.FindString("response_id", &str) == B_OK)
+		fResponseId = str;
+	if (archive.FindString("response_endpoint", &str) == B_OK)
+		fResponseEndpoint = str;
+	archive.FindInt32("response_count", &fResponseMessageCount);
+
+	fSummary = "";
+	fSummarizedCount = 0;
+	if (archive.FindString("summary", &str) == B_OK)
+		fSummary = str;
+	archive.FindInt32("summarized_count", &fSummarizedCount);
+
 	// Load messages
 	fMessages.MakeEmpty();
 	BMessage msgArchive;
@@ -196,10 +240,32 @@ ChatSession::ClearMessages()
 {
 	fMessages.MakeEmpty();
 	fTitle = "New Chat";
+	ClearResponseState();
+	fSummary = "";
+	fSummarizedCount = 0;
 	UpdateTimestamp();
 }
 
 
+void
+ChatSession::SetResponseState(const char* responseId, const char* endpoint,
+	int32 messageCount)
+{
+	fResponseId = responseId;
+	fResponseEndpoint = endpoint;
+	fResponseMessageCount = messageCount;
+}
+
+
+void
+ChatSession::ClearResponseState()
+{
+	fResponseId = "";
+	fResponseEndpoint = "";
+	fResponseMessageCount = 0;
+}
+
+
 void
 ChatSession::GenerateTitle()
 {
@@ -226,9 +292,65 @@ ChatSession::GenerateTitle()
 void
 ChatSession::_GenerateId()
 {
-	// Generate unique ID based on timestamp and random number
-	char id[32];
-	snprintf(id, sizeof(id), "chat_%ld_%d",
-		static_cast<long>(time(NULL)), rand() % 10000);
+	// Generate unique ID based on timestamp and random number; the sequence
+	// keeps sessions created within the same second (batch mode) apart
+	static int32 sSequence = 0;
+	char id[48];
+	snprintf(id, sizeof(id), "chat_%ld_%d_%d",
+		static_cast<long>(time(NULL)), rand() % 10000,
+		(int)atomic_add(&sSequence, 1));
 	fId = id;
 }
+
+
+void
+ChatSession::SetSummary(const char* summary, int32 messageCount)
+{
+	fSummary = summary;
+	fSummarizedCount = messageCount;
+}
+
+
+int32
+ChatSession::CompactionCutoff(int32 threshold, int32 keepRecent) const
+{
+	int32 bytes = 0;
+	for (int32 i = fSummarizedCount; i < fMessages.CountItems(); i++)
+		bytes += strlen(fMessages.ItemAt(i)->Content());
+	if (bytes < threshold)
+		return -1;
+
+	// Let the verbatim tail start with a user turn, as Claude requires
+	int32 cutoff = fMessages.CountItems() - keepRecent;
+	while (cutoff > fSummarizedCount
+		&& fMessages.ItemAt(cutoff)->Role() != kRoleUser)
+		cutoff--;
+
+	return cutoff > fSummarizedCount ? cutoff : -1;
+}
+
+
+BString
+ChatSession::Transcript(int32 from, int32 to) const
+{
+	BString transcript;
+	for (int32 i = from; i < to && i < fMessages.CountItems(); i++) {
+		ChatMessage* message = fMessages.ItemAt(i);
+		if (message->Content()[0] == '\0')
+			continue;
+
+		switch (message->Role()) {
+			case kRoleUser:
+				transcript << "User: ";
+				break;
+			case kRoleAssistant:
+				transcript << "Assistant: ";
+				break;
+			case kRoleSystem:
+				transcript << "System: ";
+				break;
+		}
+		transcript << message->Content() << "\n\n";
+	}
+	return transcript;
+}
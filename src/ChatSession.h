@@ -35,6 +35,32 @@ public:
 	// Generate title from first user message
 	void				GenerateTitle();
 
+	// Server-side conversation state (OpenAI Responses API). The response
+	// id covers the first ResponseMessageCount() messages, so only the
+	// messages after those have to be sent with the next turn.
+	const char*			ResponseId() const { return fResponseId.String(); }
+	const char*			ResponseEndpoint() const
+							{ return fResponseEndpoint.String(); }
+	int32				ResponseMessageCount() const
+							{ return fResponseMessageCount; }
+	void				SetResponseState(const char* responseId,
+							const char* endpoint, int32 messageCount);
+	void				ClearResponseState();
+
+	// Rolling summary of the first SummarizedCount() messages. Requests
+	// send the summary in place of those messages; the transcript itself
+	// is kept whole.
+	const char*			Summary() const { return fSummary.String(); }
+	int32				SummarizedCount() const { return fSummarizedCount; }
+	void				SetSummary(const char* summary, int32 messageCount);
+
+	// Index up to which messages should be folded into the summary, or -1
+	// while the unsummarized history is below threshold bytes. The last
+	// keepRecent messages always stay verbatim.
+	int32				CompactionCutoff(int32 threshold,
+							int32 keepRecent) const;
+	BString				Transcript(int32 from, int32 to) const;
+
 private:
 	void				_GenerateId();
 
@@ -43,6 +69,13 @@ private:
 	time_t				fCreatedAt;
 	time_t				fUpdatedAt;
 	BObjectList<ChatMessage> fMessages;
+
+	BString				fResponseId;
+	BString				fResponseEndpoint;
+	int32				fResponseMessageCount;
+
+	BString				fSummary;
+	int32				fSummarizedCount;
 };
 
 #endif // CHAT_SESSION_H
@@ -1,25 +1,94 @@
 #include "ChatView.h"
 
 #include <ScrollBar.h>
+#include <algorithm>
 #include <cmath>
+#include <string.h>
 
 #include "Constants.h"
 #include "Log.h"
 
+// Rows within this distance of the viewport get bubbles
+static const float kOverscan = 600;
+
+// Bubbles kept around for reuse once scrolled away
+static const int32 kMaxRecycled = 16;
+
+// Memory for bitmaps of finished bubbles not on screen
+static const size_t kBitmapCacheBudget = 32 * 1024 * 1024;
+
+// Larger messages without cached runs are styled by the pool; smaller
+// ones are styled as soon as their bubble is created
+static const int32 kInlineStyleLength = 16 * 1024;
+
+// Streaming updates are shown at most once per display frame
+static const bigtime_t kFrameInterval = 1000000 / 60;
+
+// History above the first screen loads in slices of about this much
+// window thread time, or of this many rows when scrolled to
+static const bigtime_t kHistoryBudget = 4000;
+static const int32 kHistoryChunk = 50;
+
+// Heights of rows off screen are refined after a resize in slices of
+// about this much window thread time
+static const bigtime_t kRefineBudget = 4000;
+
+// Bounds the re-measuring when rows come out taller or shorter than
+// their estimates and so change which rows are in range
+static const int32 kMaxVisiblePasses = 4;
+
 ChatView::ChatView()
 	:
 	BView("ChatView", B_WILL_DRAW | B_FRAME_EVENTS),
-	fBubbles(20, true),
+	fHistoryPosted(false),
+	fFirstShown(-1),
+	fLastShown(-1),
+	fRecycled(kMaxRecycled, true),
+	fBitmapCache(kBitmapCacheBudget),
+	fLastStreaming(false),
 	fContentHeight(0),
 	fViewWidth(0),
-	fLayoutInProgress(false)
+	fWrapWidth(0),
+	fRefinePosted(false),
+	fHeightsBuildTime(0),
+	fLayoutInProgress(false),
+	fUpdatingVisible(false),
+	fFollowing(true),
+	fNewContent(false),
+	fScrollPending(false),
+	fTickRunner(NULL),
+	fLastDirty(false),
+	fFrames(0),
+	fSlowFrames(0),
+	fWorstFrame(0),
+	fGeneration(0),
+	fLayoutPending(false)
 {
 	SetViewColor(B_TRANSPARENT_COLOR);  // We'll draw our own background
+
+	// Metrics for the heights of rows that have no bubble yet
+	static const char* kSample = "The quick brown fox jumps over the lazy dog";
+	font_height height;
+	be_plain_font->GetHeight(&height);
+	fLineHeight = ceilf(height.ascent + height.descent + height.leading);
+	fCharWidth = be_plain_font->StringWidth(kSample) / strlen(kSample);
+	fFontKey = TextFontKey();
 }
 
 
 ChatView::~ChatView()
 {
+	delete fTickRunner;
+
+	// Bubbles release their bitmaps, so they go before the cache
+	for (int32 i = fFirstShown; i >= 0 && i <= fLastShown; i++) {
+		MessageBubble* bubble = fRows[i].bubble;
+		if (bubble != NULL) {
+			RemoveChild(bubble);
+			delete bubble;
+		}
+	}
+	fRecycled.MakeEmpty();
 }
 
 
@@ -60,42 +129,285 @@ ChatView::Draw(BRect updateRect)
 
 
 void
-ChatView::AddMessage(ChatMessage* message)
+ChatView::MessageReceived(BMessage* message)
+{
+	switch (message->what) {
+		case kMsgMarkdownReady:
+			_StylesReady(message);
+			break;
+
+		case kMsgRenderTick:
+			_RenderTick();
+			break;
+
+		case kMsgLoadHistory:
+			fHistoryPosted = false;
+			_LoadHistory(1, kHistoryBudget);
+			_PostLoadHistory();
+			break;
+
+		case kMsgExpandMessage:
+		{
+			ChatMessage* chatMessage;
+			if (message->FindPointer("message", (void**)&chatMessage) == B_OK)
+				_ExpandMessage(chatMessage);
+			break;
+		}
+
+		case kMsgRefineHeights:
+			fRefinePosted = false;
+			_RefineHeights(kRefineBudget);
+			break;
+
+		case kMsgChatLayout:
+		{
+			// Styled text may change the heights of the shown rows
+			fLayoutPending = false;
+			Anchor anchor = _Anchor();
+			int32 changed = -1;
+			for (int32 i = fFirstShown; i >= 0 && i <= fLastShown; i++) {
+				Row& row = fRows[i];
+				if (row.bubble == NULL)
+					continue;
+				float height = _BubbleHeight(row.bubble);
+				if (fabs(height - row.height) <= 0.5f)
+					continue;
+				_SetRowHeight(i, height);
+				row.bubble->ResizeTo(fViewWidth - 2 * kBubbleMargin, height);
+				if (changed < 0)
+					changed = i;
+			}
+			if (changed >= 0) {
+				_Reposition(changed, anchor);
+				_UpdateVisible();
+			}
+			break;
+		}
+
+		default:
+			BView::MessageReceived(message);
+			break;
+	}
+}
+
+
+void
+ChatView::ScrollTo(BPoint where)
+{
+	BView::ScrollTo(where);
+
+	// Wherever a scroll ends decides whether new content is followed
+	_SetFollowing(_AtBottom());
+
+	// Scrolling up to history not loaded yet loads it now
+	while (Bounds().top < kOverscan && !fOlderMessages.empty()
+		&& !fLayoutInProgress)
+		_LoadHistory(kHistoryChunk, 0);
+	_UpdateVisible();
+}
+
+
+void
+ChatView::AddMessage(ChatMessage* message, bool streaming)
 {
 	LOG("ChatView::AddMessage - Role: %d, Content length: %d",
 		message->Role(), (int)strlen(message->Content()));
 
-	MessageBubble* bubble = new MessageBubble(message);
-	fBubbles.AddItem(bubble);
-	AddChild(bubble);
+	FinishLastMessage();
+	fLastStreaming = streaming;
 
-	_LayoutMessages();
-	ScrollToBottom();
+	// A message being streamed is never collapsed under the reader
+	if (streaming)
+		message->SetExpanded(true);
+
+	Row row;
+	row.message = message;
+	row.height = _EstimateHeight(message);
+	row.bubble = NULL;
+	row.styling = false;
+	row.stale = false;
+	fRows.push_back(row);
+	fHeights.Append(row.height + kBubbleMargin);
+
+	_PositionRows(fRows.size() - 1);
+	_ContentAdded();
+	_UpdateVisible();
 }
 
 
 void
-ChatView::UpdateLastMessage()
+ChatView::SetMessages(const BObjectList<ChatMessage>& messages,
+	const ChatViewState* state)
 {
-	MessageBubble* last = LastBubble();
-	if (last != NULL) {
-		last->UpdateContent();
-		_LayoutMessages();
+	ClearMessages();
+	_UpdateViewWidth();
+	fFontKey = TextFontKey();
+
+	// Saved heights hold for messages unchanged since, at the same width
+	// and fonts; the rest are estimated. Only the rows that end up in
+	// view get bubbles.
+	int32 count = messages.CountItems();
+	int32 wrapWidth = MessageBubble::WrapWidth(fViewWidth
+		* kBubbleMaxWidthRatio);
+	bool warm = state != NULL && state->wrapWidth == wrapWidth
+		&& state->fontKey == fFontKey;
+	fWrapWidth = wrapWidth;
+	bool restore = state != NULL && !state->atBottom
+		&& state->anchorRow >= 0 && state->anchorRow < count;
+
+	// Rows are built from the end up to the first screen: the viewport
+	// above the last message, or the saved anchor row, plus overscan. The
+	// older messages wait, so the first paint costs the same for any
+	// length of history.
+	int32 anchorRow = restore ? state->anchorRow : count;
+	float needed = restore ? kOverscan : _ViewportHeight() + kOverscan;
+	float filled = 0;
+	int32 first = count;
+	std::vector<Row> rows;
+	while (first > 0 && (first > anchorRow || filled < needed)) {
+		first--;
+		Row row;
+		row.message = messages.ItemAt(first);
+		row.height = _InitialHeight(row.message, state, warm, first);
+		row.bubble = NULL;
+		row.styling = false;
+		row.stale = false;
+		rows.push_back(row);
+		if (first < anchorRow)
+			filled += row.height + kBubbleMargin;
+	}
+	fRows.assign(rows.rbegin(), rows.rend());
+	_BuildHeights();
+
+	fOlderMessages.resize(first);
+	fOlderHeights.resize(first);
+	for (int32 i = 0; i < first; i++) {
+		fOlderMessages[i] = messages.ItemAt(i);
+		fOlderHeights[i] = -1;
+		if (warm && i < (int32)state->rows.size()
+			&& state->rows[i].message == fOlderMessages[i]
+			&& state->rows[i].version == fOlderMessages[i]->Version())
+			fOlderHeights[i] = state->rows[i].height;
+	}
+	_PositionRows(0);
+
+	if (restore) {
+		_SetScroll(_RowTop(anchorRow - first) + state->anchorOffset);
+		_UpdateVisible();
+	} else
 		ScrollToBottom();
+	_RequestStyles(0, fRows.size());
+	_PostLoadHistory();
+
+	LOG("ChatView::SetMessages - %d of %d rows built, the rest loads "
+		"in the background", (int)fRows.size(), (int)count);
+}
+
+
+ChatViewState*
+ChatView::SaveState() const
+{
+	ChatViewState* state = new ChatViewState;
+	size_t older = fOlderMessages.size();
+	state->rows.resize(older + fRows.size());
+	for (size_t i = 0; i < older; i++) {
+		state->rows[i].message = fOlderMessages[i];
+		state->rows[i].version = fOlderMessages[i]->Version();
+		state->rows[i].height = fOlderHeights[i];
+	}
+	for (size_t i = 0; i < fRows.size(); i++) {
+		state->rows[older + i].message = fRows[i].message;
+		state->rows[older + i].version = fRows[i].message->Version();
+		state->rows[older + i].height = fRows[i].stale ? -1 : fRows[i].height;
 	}
+	state->wrapWidth = MessageBubble::WrapWidth(fViewWidth
+		* kBubbleMaxWidthRatio);
+	state->fontKey = fFontKey;
+
+	Anchor anchor = _Anchor();
+	state->anchorRow = anchor.row >= 0 ? anchor.row + (int32)older : -1;
+	state->anchorOffset = anchor.offset;
+	state->atBottom = anchor.atBottom;
+	return state;
 }
 
 
 void
-ChatView::ClearMessages()
+ChatView::FinishLastMessage()
 {
-	for (int32 i = fBubbles.CountItems() - 1; i >= 0; i--) {
-		MessageBubble* bubble = fBubbles.ItemAt(i);
-		RemoveChild(bubble);
+	if (!fLastStreaming)
+		return;
+	fLastStreaming = false;
+
+	// Show the last chunks now rather than redrawing after the next tick
+	if (fLastDirty) {
+		fLastDirty = false;
+		UpdateLastMessage();
 	}
-	fBubbles.MakeEmpty();
+
+	MessageBubble* bubble = LastBubble();
+	if (bubble != NULL)
+		bubble->SetStreaming(false);
+}
+
+
+void
+ChatView::InvalidateLastMessage()
+{
+	fLastDirty = true;
+	_StartTick();
+}
+
+
+void
+ChatView::UpdateLastMessage()
+{
+	if (fRows.empty())
+		return;
+
+	int32 index = fRows.size() - 1;
+	Row& row = fRows[index];
+	float height;
+	if (row.bubble != NULL) {
+		row.bubble->UpdateContent();
+		height = _BubbleHeight(row.bubble);
+	} else
+		height = _EstimateHeight(row.message);
+
+	// Only the last row changed; the ones above keep their place
+	if (fabs(height - row.height) > 0.5f) {
+		_SetRowHeight(index, height);
+		if (row.bubble != NULL)
+			row.bubble->ResizeTo(fViewWidth - 2 * kBubbleMargin, height);
+		_PositionRows(index);
+		_ContentAdded();
+	}
+}
+
+
+void
+ChatView::ClearMessages()
+{
+	for (int32 i = fFirstShown; i >= 0 && i <= fLastShown; i++)
+		_HideRow(i);
+	fRows.clear();
+	fHeights.Clear();
+	// The bitmaps were of the rows that are gone
+	fBitmapCache.Purge();
+	fOlderMessages.clear();
+	fOlderHeights.clear();
+	fLastDirty = false;
+	fLastStreaming = false;
+	fScrollPending = false;
+	_SetFollowing(true);
+	fFirstShown = -1;
+	fLastShown = -1;
 	fContentHeight = 0;
 
+	// Results still in flight belong to rows that are gone
+	fGeneration++;
+	fPool.CancelAll();
+
 	BScrollBar* scrollBar = ScrollBar(B_VERTICAL);
 	if (scrollBar != NULL)
 		scrollBar->SetRange(0, 0);
@@ -104,6 +416,18 @@ ChatView::ClearMessages()
 }
 
 
+void
+ChatView::RefreshColors()
+{
+	// Recycled bubbles take the new colors when they get a message
+	for (int32 i = fFirstShown; i >= 0 && i <= fLastShown; i++) {
+		if (fRows[i].bubble != NULL)
+			fRows[i].bubble->RefreshColors();
+	}
+	Invalidate();
+}
+
+
 void
 ChatView::ScrollToBottom()
 {
@@ -113,15 +437,35 @@ ChatView::ScrollToBottom()
 		scrollBar->GetRange(&min, &max);
 		scrollBar->SetValue(max);
 	}
+	// Also when already there, so that a pending notice goes
+	_SetFollowing(true);
+	_UpdateVisible();
+}
+
+
+void
+ChatView::ScrollToMessage(int32 index)
+{
+	int32 older = fOlderMessages.size();
+	if (index < 0 || index >= older + (int32)fRows.size())
+		return;
+
+	if (index < older) {
+		_LoadHistory(older - index, 0);
+		older = fOlderMessages.size();
+		if (index < older)
+			return;
+	}
+	_SetScroll(_RowTop(index - older) - kBubbleMargin);
 }
 
 
 MessageBubble*
 ChatView::LastBubble() const
 {
-	if (fBubbles.CountItems() == 0)
+	if (fRows.empty())
 		return NULL;
-	return fBubbles.ItemAt(fBubbles.CountItems() - 1);
+	return fRows.back().bubble;
 }
 
 
@@ -133,14 +477,257 @@ ChatView::_LayoutMessages()
 		return;
 	fLayoutInProgress = true;
 
+	_UpdateViewWidth();
+	Anchor anchor = _Anchor();
+	int32 firstVisible, lastVisible;
+	_VisibleRows(&firstVisible, &lastVisible);
+
+	uint32 fontKey = TextFontKey();
+	int32 wrapWidth = MessageBubble::WrapWidth(fViewWidth
+		* kBubbleMaxWidthRatio);
+	bool rewrap = fontKey != fFontKey || wrapWidth != fWrapWidth;
+	float ratio = 1;
+	if (fontKey == fFontKey && fWrapWidth > 0)
+		ratio = (float)fWrapWidth / wrapWidth;
+	fFontKey = fontKey;
+	fWrapWidth = wrapWidth;
+
+	// Only the rows on screen are rewrapped now. The others have their
+	// text height scaled by the change in width, or taken from the
+	// message if it was measured at this width before, and are refined
+	// in idle time; bubbles just off screen keep their old layout until
+	// then.
+	for (int32 i = 0; i < (int32)fRows.size(); i++) {
+		Row& row = fRows[i];
+		if (row.bubble != NULL && i >= firstVisible && i <= lastVisible) {
+			_MeasureRow(i);
+			continue;
+		}
+		if (row.bubble != NULL) {
+			row.bubble->ResizeTo(fViewWidth - 2 * kBubbleMargin,
+				row.bubble->Bounds().Height());
+		}
+		if (!rewrap)
+			continue;
+
+		float height;
+		if (row.bubble == NULL && _CachedHeight(row.message, &height)) {
+			row.height = height;
+			row.stale = false;
+		} else {
+			height = (row.height - 2 * kBubblePadding) * ratio
+				+ 2 * kBubblePadding;
+			row.height = height < 40 ? 40 : ceilf(height);
+			row.stale = true;
+		}
+	}
+
+	if (rewrap) {
+		_BuildHeights();
+
+		// Saved heights of history not loaded yet are for the old width
+		std::fill(fOlderHeights.begin(), fOlderHeights.end(), -1.0f);
+	}
+
+	_Reposition(0, anchor);
+	fLayoutInProgress = false;
+	_UpdateVisible();
+	if (rewrap)
+		_PostRefine();
+}
+
+
+void
+ChatView::_VisibleRows(int32* first, int32* last) const
+{
+	float top = Bounds().top;
+	*first = _RowAt(top);
+	*last = _RowAt(top + _ViewportHeight());
+}
+
+
+bool
+ChatView::_MeasureRow(int32 index)
+{
+	// Lays the bubble out at the current width; true if its height changed
+	Row& row = fRows[index];
+	row.bubble->SetMaxWidth(fViewWidth * kBubbleMaxWidthRatio);
+	float height = _BubbleHeight(row.bubble);
+	bool changed = fabs(height - row.height) > 0.5f;
+	row.stale = false;
+	_SetRowHeight(index, height);
+	row.bubble->ResizeTo(fViewWidth - 2 * kBubbleMargin, height);
+	return changed;
+}
+
+
+void
+ChatView::_PostRefine()
+{
+	if (fRefinePosted || Looper() == NULL)
+		return;
+	fRefinePosted = true;
+	Looper()->PostMessage(kMsgRefineHeights, this);
+}
+
+
+void
+ChatView::_RefineHeights(bigtime_t budget)
+{
+	int32 firstVisible, lastVisible;
+	_VisibleRows(&firstVisible, &lastVisible);
+	if (firstVisible < 0)
+		return;
+
+	// Outwards from the viewport, so the rows scrolled to next are right
+	// soonest. Rows without bubbles get the usual estimate, or their
+	// cached size.
+	Anchor anchor = _Anchor();
+	int32 count = fRows.size();
+	int32 changed = -1;
+	bool more = false;
+	bigtime_t start = system_time();
+	for (int32 distance = 1; firstVisible - distance >= 0
+			|| lastVisible + distance < count; distance++) {
+		if (system_time() - start >= budget) {
+			more = true;
+			break;
+		}
+
+		int32 sides[2] = { firstVisible - distance, lastVisible + distance };
+		for (int32 j = 0; j < 2; j++) {
+			int32 i = sides[j];
+			if (i < 0 || i >= count || !fRows[i].stale)
+				continue;
+
+			Row& row = fRows[i];
+			bool resized;
+			if (row.bubble != NULL)
+				resized = _MeasureRow(i);
+			else {
+				float height = _EstimateHeight(row.message);
+				resized = fabs(height - row.height) > 0.5f;
+				row.stale = false;
+				_SetRowHeight(i, height);
+			}
+			if (resized && (changed < 0 || i < changed))
+				changed = i;
+		}
+	}
+
+	if (changed >= 0) {
+		_Reposition(changed, anchor);
+		_UpdateVisible();
+	}
+	if (more)
+		_PostRefine();
+}
+
+
+float
+ChatView::_InitialHeight(ChatMessage* message, const ChatViewState* state,
+	bool warm, int32 index) const
+{
+	if (warm && index < (int32)state->rows.size()
+		&& state->rows[index].message == message
+		&& state->rows[index].version == message->Version()
+		&& state->rows[index].height >= 0)
+		return state->rows[index].height;
+	return _EstimateHeight(message);
+}
+
+
+void
+ChatView::_PostLoadHistory()
+{
+	// One load message at a time; it reposts itself until all are loaded
+	if (fHistoryPosted || fOlderMessages.empty() || Looper() == NULL)
+		return;
+	fHistoryPosted = true;
+	Looper()->PostMessage(kMsgLoadHistory, this);
+}
+
+
+void
+ChatView::_LoadHistory(int32 minRows, bigtime_t budget)
+{
+	if (fOlderMessages.empty() || fLayoutInProgress)
+		return;
+	fLayoutInProgress = true;
+
+	// Newest of the older messages first, at least minRows of them, then
+	// more while the time budget lasts, leaving time to rebuild the
+	// height index for all rows
+	Anchor anchor = _Anchor();
+	bigtime_t start = system_time();
+	std::vector<Row> rows;
+	while (!fOlderMessages.empty() && ((int32)rows.size() < minRows
+			|| system_time() - start + fHeightsBuildTime < budget)) {
+		Row row;
+		row.message = fOlderMessages.back();
+		row.height = fOlderHeights.back() >= 0
+			? fOlderHeights.back() : _EstimateHeight(row.message);
+		row.bubble = NULL;
+		row.styling = false;
+		row.stale = false;
+		rows.push_back(row);
+		fOlderMessages.pop_back();
+		fOlderHeights.pop_back();
+	}
+
+	int32 count = rows.size();
+	fRows.insert(fRows.begin(), rows.rbegin(), rows.rend());
+	_BuildHeights();
+	if (fFirstShown >= 0) {
+		fFirstShown += count;
+		fLastShown += count;
+	}
+
+	// The rows in view stay where they were on screen
+	if (anchor.row >= 0)
+		anchor.row += count;
+	_Reposition(0, anchor);
+	fLayoutInProgress = false;
+
+	_UpdateVisible();
+	_RequestStyles(0, count);
+}
+
+
+void
+ChatView::_BuildHeights()
+{
+	bigtime_t start = system_time();
+	std::vector<float> heights(fRows.size());
+	for (size_t i = 0; i < fRows.size(); i++)
+		heights[i] = fRows[i].height + kBubbleMargin;
+	fHeights.Assign(heights);
+	fHeightsBuildTime = system_time() - start;
+}
+
+
+void
+ChatView::_SetRowHeight(int32 index, float height)
+{
+	fRows[index].height = height;
+	fHeights.Set(index, height + kBubbleMargin);
+}
+
+
+float
+ChatView::_RowTop(int32 index) const
+{
+	return kBubbleMargin + fHeights.Offset(index);
+}
+
+
+void
+ChatView::_UpdateViewWidth()
+{
 	// Get viewport dimensions from parent scroll view
-	float viewportHeight = 400;
 	float viewportWidth = 600;
-
-	if (Parent() != NULL) {
-		viewportHeight = Parent()->Bounds().Height();
+	if (Parent() != NULL)
 		viewportWidth = Parent()->Bounds().Width() - B_V_SCROLL_BAR_WIDTH;
-	}
 
 	// Always use the current viewport width
 	if (viewportWidth > 100) {
@@ -149,41 +736,452 @@ ChatView::_LayoutMessages()
 		// Fallback to reasonable default
 		fViewWidth = 500;
 	}
+}
 
-	float maxBubbleWidth = fViewWidth * kBubbleMaxWidthRatio;
-	float y = kBubbleMargin;
-
-	for (int32 i = 0; i < fBubbles.CountItems(); i++) {
-		MessageBubble* bubble = fBubbles.ItemAt(i);
-		bubble->SetMaxWidth(maxBubbleWidth);
 
-		float prefWidth, prefHeight;
-		bubble->GetPreferredSize(&prefWidth, &prefHeight);
+void
+ChatView::_SetScroll(float y)
+{
+	if (y < 0)
+		y = 0;
 
-		// Bubble height is text height plus padding
-		float bubbleHeight = prefHeight + 2 * kBubblePadding;
+	BScrollBar* scrollBar = ScrollBar(B_VERTICAL);
+	if (scrollBar != NULL)
+		scrollBar->SetValue(y);
+	else
+		BView::ScrollTo(0, y);
 
-		// Ensure minimum height
-		if (bubbleHeight < 40)
-			bubbleHeight = 40;
+	// The scroll bar does not scroll to where it already is
+	_SetFollowing(_AtBottom());
+}
 
-		bubble->MoveTo(kBubbleMargin, y);
-		bubble->ResizeTo(fViewWidth - 2 * kBubbleMargin, bubbleHeight);
 
-		y += bubbleHeight + kBubbleMargin;
+void
+ChatView::_PositionRows(int32 from)
+{
+	// The index already has the new offsets; only bubbles need moving
+	int32 first = max_c(from, fFirstShown);
+	for (int32 i = first; i >= 0 && i <= fLastShown; i++) {
+		if (fRows[i].bubble != NULL)
+			fRows[i].bubble->MoveTo(kBubbleMargin, _RowTop(i));
 	}
 
-	fContentHeight = y;
+	fContentHeight = kBubbleMargin + fHeights.Total();
 
 	// Calculate new height - only resize if needed
-	float currentHeight = Bounds().Height();
+	float viewportHeight = _ViewportHeight();
 	float newHeight = max_c(viewportHeight, fContentHeight);
-
-	if (fabs(newHeight - currentHeight) > 1.0f) {
+	if (fabs(newHeight - Bounds().Height()) > 1.0f)
 		ResizeTo(fViewWidth, newHeight);
+
+	_UpdateScrollBar(viewportHeight);
+
+	// Rows above from neither moved nor changed
+	BRect dirty = Bounds();
+	if (from > 0 && from < (int32)fRows.size())
+		dirty.top = max_c(dirty.top, _RowTop(from) - kBubbleMargin);
+	Invalidate(dirty);
+}
+
+
+bool
+ChatView::_AtBottom() const
+{
+	return Bounds().top >= fContentHeight - _ViewportHeight() - 1;
+}
+
+
+ChatView::Anchor
+ChatView::_Anchor() const
+{
+	// The row at the top of the viewport, or the bottom while following;
+	// content added since the last scroll does not unstick the bottom
+	float top = Bounds().top;
+	Anchor anchor;
+	anchor.atBottom = fFollowing;
+	anchor.row = _RowAt(top);
+	anchor.offset = anchor.row >= 0 ? top - _RowTop(anchor.row) : 0;
+	return anchor;
+}
+
+
+void
+ChatView::_Reposition(int32 from, const Anchor& anchor)
+{
+	_PositionRows(from);
+
+	float y = 0;
+	if (anchor.atBottom)
+		y = fContentHeight - _ViewportHeight();
+	else if (anchor.row >= 0 && anchor.row < (int32)fRows.size())
+		y = _RowTop(anchor.row) + anchor.offset;
+	_SetScroll(y);
+}
+
+
+void
+ChatView::_UpdateVisible()
+{
+	if (fUpdatingVisible)
+		return;
+	fUpdatingVisible = true;
+
+	float viewportHeight = _ViewportHeight();
+	for (int32 pass = 0; pass < kMaxVisiblePasses; pass++) {
+		float top = Bounds().top;
+		int32 first = _RowAt(top - kOverscan);
+		int32 last = _RowAt(top + viewportHeight + kOverscan);
+
+		for (int32 i = fFirstShown; i >= 0 && i <= fLastShown; i++) {
+			if (i < first || i > last)
+				_HideRow(i);
+		}
+		fFirstShown = first;
+		fLastShown = last;
+
+		// New bubbles replace estimates with measured heights, and
+		// bubbles scrolled into view after a resize are rewrapped
+		Anchor anchor = _Anchor();
+		int32 firstVisible, lastVisible;
+		_VisibleRows(&firstVisible, &lastVisible);
+		int32 changed = -1;
+		for (int32 i = first; i >= 0 && i <= last; i++) {
+			bool resized;
+			if (fRows[i].bubble == NULL)
+				resized = _ShowRow(i);
+			else {
+				resized = fRows[i].stale && i >= firstVisible
+					&& i <= lastVisible && _MeasureRow(i);
+			}
+			if (resized && changed < 0)
+				changed = i;
+		}
+		if (changed < 0)
+			break;
+		_Reposition(changed, anchor);
+	}
+
+	fUpdatingVisible = false;
+}
+
+
+bool
+ChatView::_ShowRow(int32 index)
+{
+	Row& row = fRows[index];
+	ChatMessage* message = row.message;
+	bool styleLater = !message->HasCurrentRuns()
+		&& (int32)strlen(message->Content()) > kInlineStyleLength;
+
+	MessageBubble* bubble = NULL;
+	if (!fRecycled.IsEmpty())
+		bubble = fRecycled.RemoveItemAt(fRecycled.CountItems() - 1);
+	if (bubble != NULL)
+		bubble->SetMessage(message, styleLater);
+	else {
+		bubble = new MessageBubble(message, styleLater);
+		bubble->SetBitmapCache(&fBitmapCache);
 	}
+	bubble->SetStreaming(fLastStreaming
+		&& index == (int32)fRows.size() - 1);
+	AddChild(bubble);
+	row.bubble = bubble;
+
+	bool changed = _MeasureRow(index);
+	bubble->MoveTo(kBubbleMargin, _RowTop(index));
+
+	if (bubble->StylePending() && !row.styling)
+		_SubmitStyles(index, 0);
+	return changed;
+}
+
+
+void
+ChatView::_HideRow(int32 index)
+{
+	Row& row = fRows[index];
+	if (row.bubble == NULL)
+		return;
+
+	RemoveChild(row.bubble);
+	if (fRecycled.CountItems() < kMaxRecycled)
+		fRecycled.AddItem(row.bubble);
+	else
+		delete row.bubble;
+	row.bubble = NULL;
+}
+
+
+void
+ChatView::_ExpandMessage(ChatMessage* message)
+{
+	for (int32 i = fFirstShown; i >= 0 && i <= fLastShown; i++) {
+		if (fRows[i].message != message)
+			continue;
+
+		// A new bubble lays out the whole text, styled by the pool if it
+		// is big; the rows below move down
+		Anchor anchor = _Anchor();
+		message->SetExpanded(true);
+		_HideRow(i);
+		_ShowRow(i);
+		_Reposition(i, anchor);
+		_UpdateVisible();
+		return;
+	}
+}
+
+
+int32
+ChatView::_RowAt(float y) const
+{
+	return fHeights.IndexAt(y - kBubbleMargin);
+}
+
+
+bool
+ChatView::_CachedHeight(const ChatMessage* message, float* height) const
+{
+	// Exact if a bubble measured the message at this width before
+	int32 wrapWidth = MessageBubble::WrapWidth(fViewWidth
+		* kBubbleMaxWidthRatio);
+	float textHeight, lineWidth;
+	if (!message->GetTextSize(wrapWidth, fFontKey, &textHeight, &lineWidth))
+		return false;
+
+	*height = textHeight + 2 * kBubblePadding;
+	if (*height < 40)
+		*height = 40;
+	return true;
+}
+
+
+float
+ChatView::_EstimateHeight(const ChatMessage* message) const
+{
+	float height;
+	if (_CachedHeight(message, &height))
+		return height;
+
+	// Collapsed messages show their preview
+	BString preview;
+	const char* text = message->Content();
+	if (MessageBubble::BuildPreview(message, preview))
+		text = preview.String();
 
-	// Update scroll bar
+	int32 wrapWidth = MessageBubble::WrapWidth(fViewWidth
+		* kBubbleMaxWidthRatio);
+	int32 perLine = (int32)(wrapWidth / fCharWidth);
+	if (perLine < 1)
+		perLine = 1;
+
+	// Every paragraph wraps on its own
+	int32 lines = 0;
+	while (true) {
+		const char* end = strchr(text, '\n');
+		int32 length = end != NULL ? end - text : strlen(text);
+		lines += 1 + (length > 0 ? (length - 1) / perLine : 0);
+		if (end == NULL)
+			break;
+		text = end + 1;
+	}
+
+	height = lines * fLineHeight + 2 * kBubblePadding;
+	return height < 40 ? 40 : height;
+}
+
+
+float
+ChatView::_ViewportHeight() const
+{
+	return Parent() != NULL ? Parent()->Bounds().Height() : 400;
+}
+
+
+void
+ChatView::_RequestStyles(int32 from, int32 to)
+{
+	// Big messages out of view get their runs ready for when they scroll
+	// in, newest first. Shown rows were queued ahead of these.
+	for (int32 i = to - 1; i >= from; i--) {
+		const Row& row = fRows[i];
+		if (row.bubble == NULL && !row.styling
+			&& !row.message->HasCurrentRuns()
+			&& (int32)strlen(row.message->Content()) > kInlineStyleLength
+			&& !MessageBubble::Collapses(row.message))
+			_SubmitStyles(i, 1);
+	}
+}
+
+
+void
+ChatView::_SubmitStyles(int32 index, int32 priority)
+{
+	Row& row = fRows[index];
+	ChatMessage* message = row.message;
+	MarkdownJob* job = new MarkdownJob;
+	job->target = BMessenger(this);
+	job->message = message;
+	job->version = message->Version();
+	job->generation = fGeneration;
+	job->index = fOlderMessages.size() + index;
+	job->priority = priority;
+	job->text = message->Content();
+	job->cached = message->HasCurrentRuns();
+	job->timedOut = false;
+	if (job->cached)
+		job->runs = message->MarkdownRuns();
+	fPool.Submit(job);
+	row.styling = true;
+}
+
+
+void
+ChatView::_StylesReady(BMessage* message)
+{
+	MarkdownJob* job;
+	if (message->FindPointer("job", (void**)&job) != B_OK)
+		return;
+
+	int32 index = job->index - (int32)fOlderMessages.size();
+	if (job->generation != fGeneration || index < 0
+		|| index >= (int32)fRows.size()
+		|| fRows[index].message != job->message) {
+		delete job;
+		return;
+	}
+
+	Row& row = fRows[index];
+	row.styling = false;
+	ChatMessage* chatMessage = row.message;
+	if (job->version != chatMessage->Version()) {
+		delete job;
+		return;
+	}
+
+	// Fresh runs go to the message so its next bubble skips lexing
+	if (!job->cached && !job->timedOut) {
+		chatMessage->MarkdownRuns().swap(job->runs);
+		chatMessage->SetRunsCurrent();
+		job->cached = true;
+	}
+
+	if (row.bubble != NULL && row.bubble->ApplyStyles(job)
+		&& !fLayoutPending) {
+		// Batch the relayout with other results already queued
+		fLayoutPending = true;
+		Looper()->PostMessage(kMsgChatLayout, this);
+	}
+	delete job;
+}
+
+
+void
+ChatView::_ContentAdded()
+{
+	// Following scrolls once per frame however much arrived; otherwise
+	// the rows in view stay put and the reader is told there is more
+	if (fFollowing) {
+		fScrollPending = true;
+		_StartTick();
+	} else
+		_SetNewContent(true);
+}
+
+
+void
+ChatView::_SetFollowing(bool following)
+{
+	fFollowing = following;
+	if (following)
+		_SetNewContent(false);
+}
+
+
+void
+ChatView::_SetNewContent(bool pending)
+{
+	if (pending == fNewContent)
+		return;
+	fNewContent = pending;
+
+	if (Window() != NULL) {
+		BMessage notice(kMsgNewContent);
+		notice.AddBool("pending", pending);
+		Window()->PostMessage(&notice);
+	}
+}
+
+
+void
+ChatView::_StartTick()
+{
+	if (fTickRunner != NULL)
+		return;
+
+	BMessage tick(kMsgRenderTick);
+	fTickRunner = new BMessageRunner(BMessenger(this), &tick,
+		kFrameInterval);
+}
+
+
+void
+ChatView::_RenderTick()
+{
+	if (!fLastDirty && !fScrollPending) {
+		// Nothing arrived for a whole frame; stop ticking until it does
+		delete fTickRunner;
+		fTickRunner = NULL;
+		if (fFrames > 0) {
+			LOG("Streamed %ld frames, worst %lld us, %ld over the %lld us "
+				"budget", (long)fFrames, (long long)fWorstFrame,
+				(long)fSlowFrames, (long long)kFrameInterval);
+		}
+		fFrames = 0;
+		fSlowFrames = 0;
+		fWorstFrame = 0;
+		return;
+	}
+
+	bigtime_t start = system_time();
+	if (fLastDirty) {
+		fLastDirty = false;
+		UpdateLastMessage();
+	}
+	if (fScrollPending) {
+		fScrollPending = false;
+		if (fFollowing)
+			ScrollToBottom();
+	}
+	bigtime_t frameTime = system_time() - start;
+
+	fFrames++;
+	if (frameTime > kFrameInterval)
+		fSlowFrames++;
+	if (frameTime > fWorstFrame)
+		fWorstFrame = frameTime;
+}
+
+
+float
+ChatView::_BubbleHeight(MessageBubble* bubble) const
+{
+	float prefWidth, prefHeight;
+	bubble->GetPreferredSize(&prefWidth, &prefHeight);
+
+	// Bubble height is text height plus padding
+	float bubbleHeight = prefHeight + 2 * kBubblePadding;
+
+	// Ensure minimum height
+	if (bubbleHeight < 40)
+		bubbleHeight = 40;
+	return bubbleHeight;
+}
+
+
+void
+ChatView::_UpdateScrollBar(float viewportHeight)
+{
 	BScrollBar* scrollBar = ScrollBar(B_VERTICAL);
 	if (scrollBar != NULL) {
 		if (fContentHeight > viewportHeight) {
@@ -195,9 +1193,6 @@ ChatView::_LayoutMessages()
 			scrollBar->SetProportion(1.0);
 		}
 	}
-
-	Invalidate();
-	fLayoutInProgress = false;
 }
 
 
@@ -1,13 +1,47 @@
 #ifndef CHAT_VIEW_H
 #define CHAT_VIEW_H
 
+#include <MessageRunner.h>
 #include <ObjectList.h>
 #include <ScrollView.h>
 #include <View.h>
 
+#include <vector>
+
+#include "BubbleCache.h"
 #include "ChatMessage.h"
+#include "HeightIndex.h"
+#include "MarkdownPool.h"
 #include "MessageBubble.h"
 
+// What a chat view needs to show a session again without measuring it:
+// the row heights at one wrap width, and where it was scrolled to
+struct ChatViewState {
+	struct Row {
+		const ChatMessage* message;
+		uint32			version;
+		float			height;		// -1 if not known at this width
+	};
+
+	size_t				Bytes() const
+							{ return sizeof(*this)
+								+ rows.capacity() * sizeof(Row); }
+
+	std::vector<Row>	rows;
+	int32				wrapWidth;
+	uint32				fontKey;
+	int32				anchorRow;
+	float				anchorOffset;
+	bool				atBottom;
+};
+
+
+// Lays out a chat as rows of cached heights and creates bubbles only for
+// the rows in or near the viewport. Bubbles scrolled away are kept for
+// reuse by the rows scrolled in. Sessions load newest first; older rows
+// are added above in the background, or right away when scrolled to.
+// New content is followed only while the view is scrolled to the bottom;
+// otherwise the window is sent kMsgNewContent with "pending" set.
 class ChatView : public BView {
 public:
 						ChatView();
@@ -16,21 +50,130 @@ public:
 	virtual void		AttachedToWindow();
 	virtual void		FrameResized(float newWidth, float newHeight);
 	virtual void		Draw(BRect updateRect);
+	virtual void		MessageReceived(BMessage* message);
+	virtual void		ScrollTo(BPoint where);
+	using BView::ScrollTo;
 
-	void				AddMessage(ChatMessage* message);
+	// A streaming message is drawn live until FinishLastMessage()
+	void				AddMessage(ChatMessage* message,
+							bool streaming = false);
+	void				FinishLastMessage();
+	// Shows a whole session; markdown is styled by workers, visible
+	// messages first. Only the rows needed for the first screen are built
+	// before returning. A state saved for the same messages restores their
+	// heights and the scroll position.
+	void				SetMessages(const BObjectList<ChatMessage>& messages,
+							const ChatViewState* state = NULL);
+	ChatViewState*		SaveState() const;
+	// Shows the last message's new content on the next frame tick, so
+	// any number of streamed chunks cost one relayout per frame
+	void				InvalidateLastMessage();
 	void				UpdateLastMessage();
 	void				ClearMessages();
+	// Recolors the shown bubbles for the current theme
+	void				RefreshColors();
+	// Scrolls to the end and follows new content again
 	void				ScrollToBottom();
+	void				ScrollToMessage(int32 index);
 
+	// NULL while the last message is scrolled out of view
 	MessageBubble*		LastBubble() const;
 
 private:
+	struct Row {
+		ChatMessage*	message;
+		float			height;		// measured if it had a bubble
+		MessageBubble*	bubble;
+		bool			styling;	// a worker has the message
+		bool			stale;		// height scaled from another width
+	};
+
+	// What to keep in view while heights change
+	struct Anchor {
+		int32			row;
+		float			offset;		// of the viewport top into the row
+		bool			atBottom;	// following new content
+	};
+
 	void				_LayoutMessages();
+	void				_VisibleRows(int32* first, int32* last) const;
+	bool				_MeasureRow(int32 index);
+	void				_PostRefine();
+	void				_RefineHeights(bigtime_t budget);
+	float				_InitialHeight(ChatMessage* message,
+							const ChatViewState* state, bool warm,
+							int32 index) const;
+	void				_PostLoadHistory();
+	void				_LoadHistory(int32 minRows, bigtime_t budget);
+	void				_UpdateViewWidth();
+	void				_SetScroll(float y);
+	void				_BuildHeights();
+	void				_SetRowHeight(int32 index, float height);
+	float				_RowTop(int32 index) const;
+	void				_PositionRows(int32 from);
+	bool				_AtBottom() const;
+	Anchor				_Anchor() const;
+	void				_Reposition(int32 from, const Anchor& anchor);
+	void				_UpdateVisible();
+	bool				_ShowRow(int32 index);
+	void				_HideRow(int32 index);
+	void				_ExpandMessage(ChatMessage* message);
+	int32				_RowAt(float y) const;
+	bool				_CachedHeight(const ChatMessage* message,
+							float* height) const;
+	float				_EstimateHeight(const ChatMessage* message) const;
+	float				_ViewportHeight() const;
+	float				_BubbleHeight(MessageBubble* bubble) const;
+	void				_UpdateScrollBar(float viewportHeight);
+	void				_RequestStyles(int32 from, int32 to);
+	void				_SubmitStyles(int32 index, int32 priority);
+	void				_StylesReady(BMessage* message);
+	void				_ContentAdded();
+	void				_SetFollowing(bool following);
+	void				_SetNewContent(bool pending);
+	void				_StartTick();
+	void				_RenderTick();
+
+	std::vector<Row>	fRows;
+	// Messages above fRows not loaded yet, oldest first, with the heights
+	// a saved state had for them or -1. Row i is message i + their count.
+	std::vector<ChatMessage*> fOlderMessages;
+	std::vector<float>	fOlderHeights;
+	bool				fHistoryPosted;
+	HeightIndex			fHeights;		// row heights plus margins
+	int32				fFirstShown;	// rows with bubbles, or -1
+	int32				fLastShown;
+	BObjectList<MessageBubble> fRecycled;
+	BubbleCache			fBitmapCache;
+	bool				fLastStreaming;
 
-	BObjectList<MessageBubble> fBubbles;
 	float				fContentHeight;
 	float				fViewWidth;
+	int32				fWrapWidth;		// the row heights are for
+	bool				fRefinePosted;
+	bigtime_t			fHeightsBuildTime;	// of the last _BuildHeights()
+	float				fLineHeight;	// for height estimates
+	float				fCharWidth;
+	uint32				fFontKey;
 	bool				fLayoutInProgress;
+	bool				fUpdatingVisible;
+
+	// Whether the viewport sticks to the bottom as content arrives; set
+	// by where each scroll ends, not by the content growing
+	bool				fFollowing;
+	bool				fNewContent;	// arrived below while not following
+	bool				fScrollPending;	// to the bottom on the next tick
+
+	// Frame tick, only running while there is something to show
+	BMessageRunner*		fTickRunner;
+	bool				fLastDirty;
+	int32				fFrames;
+	int32				fSlowFrames;	// over the frame budget
+	bigtime_t			fWorstFrame;
+
+	MarkdownPool		fPool;
+	uint32				fGeneration;	// bumped when the rows go
+	bool				fLayoutPending;
 };
 
 
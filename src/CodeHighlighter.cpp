@@ -0,0 +1,586 @@
+#include "CodeHighlighter.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+
+enum {
+	kFeaturePreprocessor	= 1 << 0,	// # at line start is a directive
+	kFeatureTripleQuotes	= 1 << 1,	// """ and ''' span lines
+	kFeatureTemplates		= 1 << 2,	// ` strings span lines
+	kFeatureWordComment		= 1 << 3,	// comment only at a word start
+	kFeatureVariables		= 1 << 4,	// $name and ${name}
+	kFeatureKeys			= 1 << 5,	// "string": is a key
+	kFeatureDiff			= 1 << 6	// lines styled by first column
+};
+
+enum {
+	kModeCode = 0,
+	kModeBlockComment,
+	kModeString
+};
+
+enum {
+	kClassSpace			= 1 << 0,
+	kClassDigit			= 1 << 1,
+	kClassIdentStart	= 1 << 2,
+	kClassIdentPart		= 1 << 3
+};
+
+
+struct LanguageSpec {
+	const char*			tags;
+	const char*			keywords;
+	const char*			types;
+	const char*			lineComment;
+	bool				blockComment;
+	const char*			quotes;
+	uint32_t			features;
+};
+
+
+static const LanguageSpec kLanguageSpecs[] = {
+	{
+		"c cpp c++ cc cxx h hpp hh hxx objc objective-c cuda ino",
+		"alignas alignof asm auto break case catch class const constexpr "
+		"const_cast continue co_await co_return co_yield decltype default "
+		"delete do dynamic_cast else enum explicit export extern false final "
+		"for friend goto if inline mutable namespace new noexcept nullptr "
+		"operator override private protected public register "
+		"reinterpret_cast return sizeof static static_assert static_cast "
+		"struct switch template this thread_local throw true try typedef "
+		"typeid typename union using virtual volatile while NULL",
+		"bool char char16_t char32_t double float int long short signed "
+		"unsigned void wchar_t size_t ssize_t off_t int8_t int16_t int32_t "
+		"int64_t uint8_t uint16_t uint32_t uint64_t intptr_t uintptr_t "
+		"int8 int16 int32 int64 uint8 uint16 uint32 uint64 status_t "
+		"bigtime_t std string vector",
+		"//", true, "\"'", kFeaturePreprocessor
+	},
+	{
+		"py python python3 py3 gyp",
+		"and as assert async await break class continue def del elif else "
+		"except finally for from global if import in is lambda match "
+		"nonlocal not or pass raise return try while with yield",
+		"True False None self cls int float str bytes bool list dict set "
+		"tuple object type len range print isinstance super Exception",
+		"#", false, "\"'", kFeatureTripleQuotes
+	},
+	{
+		"js javascript jsx mjs cjs ts typescript tsx node",
+		"abstract as async await break case catch class const continue "
+		"debugger default delete do else enum export extends finally for "
+		"from function if implements import in instanceof interface let new "
+		"of private protected public readonly return static super switch "
+		"this throw try type typeof var void while with yield",
+		"true false null undefined NaN Infinity any boolean never number "
+		"object string unknown Array Object Promise Map Set JSON console",
+		"//", true, "\"'`", kFeatureTemplates
+	},
+	{
+		"sh bash shell zsh ksh console shellsession",
+		"if then else elif fi case esac for select while until do done in "
+		"function return exit break continue local export readonly declare "
+		"unset set shift source alias",
+		"echo printf read cd pwd ls cat grep sed awk find xargs make sudo "
+		"git rm cp mv mkdir chmod chown curl tar test",
+		"#", false, "\"'", kFeatureWordComment | kFeatureVariables
+	},
+	{
+		"json json5 jsonc geojson",
+		"true false null",
+		"",
+		"//", true, "\"", kFeatureKeys
+	},
+	{
+		"diff patch udiff",
+		"", "", NULL, false, "", kFeatureDiff
+	}
+};
+
+static const size_t kLanguageCount
+	= sizeof(kLanguageSpecs) / sizeof(kLanguageSpecs[0]);
+
+
+// Keywords live in a trie flattened into two arrays: each node lists its
+// children as a contiguous run of edges
+struct TrieNode {
+	uint16_t			firstEdge;
+	uint16_t			edgeCount;
+	uint8_t				kind;
+};
+
+struct TrieEdge {
+	char				c;
+	uint16_t			child;
+};
+
+struct CodeLanguage {
+	const LanguageSpec*	spec;
+	std::vector<TrieNode> nodes;
+	std::vector<TrieEdge> edges;
+
+	uint8_t				Lookup(const char* word, int32_t length) const;
+};
+
+
+uint8_t
+CodeLanguage::Lookup(const char* word, int32_t length) const
+{
+	if (nodes.empty())
+		return kCodeText;
+
+	const TrieNode* node = &nodes[0];
+	for (int32_t i = 0; i < length; i++) {
+		const TrieEdge* edge = &edges[node->firstEdge];
+		const TrieEdge* last = edge + node->edgeCount;
+		while (edge < last && edge->c != word[i])
+			edge++;
+		if (edge == last)
+			return kCodeText;
+		node = &nodes[edge->child];
+	}
+	return node->kind;
+}
+
+
+// Build-time trie with child lists, flattened breadth first
+struct BuildNode {
+	std::vector<std::pair<char, int> > children;
+	uint8_t				kind;
+};
+
+
+static void
+AddWords(std::vector<BuildNode>& trie, const char* words, uint8_t kind)
+{
+	const char* word = words;
+	while (*word != '\0') {
+		const char* end = word;
+		while (*end != '\0' && *end != ' ')
+			end++;
+
+		int node = 0;
+		for (const char* c = word; c < end; c++) {
+			int next = -1;
+			for (size_t i = 0; i < trie[node].children.size(); i++) {
+				if (trie[node].children[i].first == *c) {
+					next = trie[node].children[i].second;
+					break;
+				}
+			}
+			if (next < 0) {
+				next = trie.size();
+				trie[node].children.push_back(std::make_pair(*c, next));
+				BuildNode child;
+				child.kind = kCodeText;
+				trie.push_back(child);
+			}
+			node = next;
+		}
+		if (end > word)
+			trie[node].kind = kind;
+
+		word = *end == ' ' ? end + 1 : end;
+	}
+}
+
+
+static void
+BuildTrie(CodeLanguage& language)
+{
+	std::vector<BuildNode> trie(1);
+	trie[0].kind = kCodeText;
+	AddWords(trie, language.spec->keywords, kCodeKeyword);
+	AddWords(trie, language.spec->types, kCodeType);
+	if (trie.size() == 1)
+		return;
+
+	// Breadth-first order keeps every node's edges contiguous
+	std::vector<int> order(1, 0);
+	std::vector<int> index(trie.size(), 0);
+	for (size_t i = 0; i < order.size(); i++) {
+		const BuildNode& node = trie[order[i]];
+		for (size_t j = 0; j < node.children.size(); j++) {
+			index[node.children[j].second] = order.size();
+			order.push_back(node.children[j].second);
+		}
+	}
+
+	language.nodes.resize(order.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		const BuildNode& node = trie[order[i]];
+		TrieNode& flat = language.nodes[i];
+		flat.firstEdge = language.edges.size();
+		flat.edgeCount = node.children.size();
+		flat.kind = node.kind;
+		for (size_t j = 0; j < node.children.size(); j++) {
+			TrieEdge edge;
+			edge.c = node.children[j].first;
+			edge.child = index[node.children[j].second];
+			language.edges.push_back(edge);
+		}
+	}
+}
+
+
+struct LanguageTable {
+	CodeLanguage		languages[kLanguageCount];
+	uint8_t				charClass[256];
+
+	LanguageTable()
+	{
+		for (size_t i = 0; i < kLanguageCount; i++) {
+			languages[i].spec = &kLanguageSpecs[i];
+			BuildTrie(languages[i]);
+		}
+
+		for (int c = 0; c < 256; c++) {
+			uint8_t bits = 0;
+			if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+				bits |= kClassSpace;
+			if (c >= '0' && c <= '9')
+				bits |= kClassDigit | kClassIdentPart;
+			if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'
+				|| c >= 0x80)
+				bits |= kClassIdentStart | kClassIdentPart;
+			charClass[c] = bits;
+		}
+	}
+};
+
+
+static const LanguageTable&
+Table()
+{
+	// Built once, thread-safe as a function local static
+	static const LanguageTable sTable;
+	return sTable;
+}
+
+
+static inline bool
+HasClass(const LanguageTable& table, char c, uint8_t bits)
+{
+	return (table.charClass[(unsigned char)c] & bits) != 0;
+}
+
+
+static inline void
+Emit(std::vector<CodeToken>& tokens, int32_t start, int32_t end,
+	uint8_t kind)
+{
+	if (end <= start)
+		return;
+
+	CodeToken token;
+	token.offset = start;
+	token.length = end - start;
+	token.kind = kind;
+	tokens.push_back(token);
+}
+
+
+static int32_t
+FindPair(const char* code, int32_t pos, int32_t end, char first, char second)
+{
+	while (pos + 1 < end) {
+		const char* hit = static_cast<const char*>(
+			memchr(code + pos, first, end - pos - 1));
+		if (hit == NULL)
+			break;
+		if (hit[1] == second)
+			return hit - code;
+		pos = hit - code + 1;
+	}
+	return -1;
+}
+
+CodeHighlighter::CodeHighlighter()
+{
+}
+
+
+const CodeLanguage*
+CodeHighlighter::FindLanguage(const char* tag, int32_t length)
+{
+	if (tag == NULL || length <= 0)
+		return NULL;
+
+	std::string lower(tag, length);
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+	const LanguageTable& table = Table();
+	for (size_t i = 0; i < kLanguageCount; i++) {
+		const char* tags = kLanguageSpecs[i].tags;
+		const char* found = strstr(tags, lower.c_str());
+		while (found != NULL) {
+			char after = found[length];
+			if ((found == tags || found[-1] == ' ')
+				&& (after == '\0' || after == ' '))
+				return &table.languages[i];
+			found = strstr(found + 1, lower.c_str());
+		}
+	}
+	return NULL;
+}
+
+
+const std::vector<CodeToken>&
+CodeHighlighter::Highlight(int32_t blockStart, const CodeLanguage* language,
+	const char* code, int32_t length)
+{
+	if (language == NULL)
+		return fEmpty;
+
+	Block* block = NULL;
+	for (size_t i = 0; i < fBlocks.size(); i++) {
+		if (fBlocks[i].start == blockStart) {
+			block = &fBlocks[i];
+			break;
+		}
+	}
+	if (block == NULL) {
+		fBlocks.push_back(Block());
+		block = &fBlocks.back();
+		block->start = blockStart;
+		block->language = NULL;
+	}
+
+	if (block->language != language || length < block->stableLength) {
+		block->language = language;
+		block->stableLength = 0;
+		block->stableTokens = 0;
+		block->stableState.mode = kModeCode;
+		block->stableState.quote = 0;
+		block->stableState.triple = false;
+	}
+
+	// Resume after the last complete line; a partial one is lexed again
+	// on every call until its newline arrives
+	std::vector<CodeToken>& tokens = block->tokens;
+	tokens.resize(block->stableTokens);
+	State state = block->stableState;
+	bool diff = (language->spec->features & kFeatureDiff) != 0;
+
+	int32_t pos = block->stableLength;
+	while (pos < length) {
+		const char* newline = static_cast<const char*>(
+			memchr(code + pos, '\n', length - pos));
+		int32_t lineEnd = newline != NULL ? newline - code : length;
+		if (diff)
+			_LexDiffLine(code, pos, lineEnd, tokens);
+		else
+			_LexLine(language, code, pos, lineEnd, state, tokens);
+
+		if (newline == NULL)
+			break;
+
+		pos = lineEnd + 1;
+		block->stableLength = pos;
+		block->stableTokens = tokens.size();
+		block->stableState = state;
+	}
+
+	return tokens;
+}
+
+
+void
+CodeHighlighter::Clear()
+{
+	fBlocks.clear();
+}
+
+
+void
+CodeHighlighter::Tokenize(const CodeLanguage* language, const char* code,
+	int32_t length, std::vector<CodeToken>& tokens)
+{
+	tokens.clear();
+	if (language == NULL)
+		return;
+
+	State state = { kModeCode, 0, false };
+	bool diff = (language->spec->features & kFeatureDiff) != 0;
+	for (int32_t pos = 0; pos < length;) {
+		const char* newline = static_cast<const char*>(
+			memchr(code + pos, '\n', length - pos));
+		int32_t lineEnd = newline != NULL ? newline - code : length;
+		if (diff)
+			_LexDiffLine(code, pos, lineEnd, tokens);
+		else
+			_LexLine(language, code, pos, lineEnd, state, tokens);
+		pos = lineEnd + 1;
+	}
+}
+
+
+int32_t
+CodeHighlighter::_LexLine(const CodeLanguage* language, const char* code,
+	int32_t pos, int32_t end, State& state, std::vector<CodeToken>& tokens)
+{
+	const LanguageTable& table = Table();
+	const LanguageSpec& spec = *language->spec;
+	const char* lineComment = spec.lineComment;
+	size_t lineCommentLength = lineComment != NULL ? strlen(lineComment) : 0;
+	bool lineStart = true;
+
+	int32_t i = pos;
+	int32_t tokenStart = pos;
+	while (i < end) {
+		if (state.mode == kModeBlockComment) {
+			int32_t close = FindPair(code, i, end, '*', '/');
+			if (close < 0) {
+				Emit(tokens, tokenStart, end, kCodeComment);
+				return end;
+			}
+			i = close + 2;
+			Emit(tokens, tokenStart, i, kCodeComment);
+			state.mode = kModeCode;
+			continue;
+		}
+
+		if (state.mode == kModeString) {
+			bool closed = false;
+			while (i < end) {
+				char c = code[i];
+				if (c == '\\') {
+					i += 2;
+					continue;
+				}
+				if (c == state.quote && (!state.triple
+						|| (i + 2 < end && code[i + 1] == c
+							&& code[i + 2] == c))) {
+					i += state.triple ? 3 : 1;
+					closed = true;
+					break;
+				}
+				i++;
+			}
+			if (i > end)
+				i = end;
+			Emit(tokens, tokenStart, i, kCodeString);
+
+			// A plain string cannot continue on the next line
+			if (closed || (!state.triple && state.quote != '`'))
+				state.mode = kModeCode;
+
+			if (closed && (spec.features & kFeatureKeys) != 0) {
+				int32_t next = i;
+				while (next < end && HasClass(table, code[next], kClassSpace))
+					next++;
+				if (next < end && code[next] == ':')
+					tokens.back().kind = kCodeType;
+			}
+			continue;
+		}
+
+		char c = code[i];
+		if (HasClass(table, c, kClassSpace)) {
+			i++;
+			continue;
+		}
+
+		bool atLineStart = lineStart;
+		lineStart = false;
+		tokenStart = i;
+
+		if (c == '#' && atLineStart
+			&& (spec.features & kFeaturePreprocessor) != 0) {
+			Emit(tokens, i, end, kCodeMeta);
+			return end;
+		}
+
+		if (lineCommentLength > 0 && c == lineComment[0]
+			&& (lineCommentLength == 1 || (i + 1 < end
+				&& code[i + 1] == lineComment[1]))
+			&& ((spec.features & kFeatureWordComment) == 0 || i == pos
+				|| HasClass(table, code[i - 1], kClassSpace))) {
+			Emit(tokens, i, end, kCodeComment);
+			return end;
+		}
+
+		if (spec.blockComment && c == '/' && i + 1 < end
+			&& code[i + 1] == '*') {
+			state.mode = kModeBlockComment;
+			i += 2;
+			continue;
+		}
+
+		if (c != '\0' && strchr(spec.quotes, c) != NULL) {
+			state.mode = kModeString;
+			state.quote = c;
+			state.triple = (spec.features & kFeatureTripleQuotes) != 0
+				&& i + 2 < end && code[i + 1] == c && code[i + 2] == c;
+			i += state.triple ? 3 : 1;
+			continue;
+		}
+
+		if (HasClass(table, c, kClassDigit) || (c == '.' && i + 1 < end
+				&& HasClass(table, code[i + 1], kClassDigit))) {
+			i++;
+			while (i < end && (HasClass(table, code[i], kClassIdentPart)
+					|| code[i] == '.'))
+				i++;
+			Emit(tokens, tokenStart, i, kCodeNumber);
+			continue;
+		}
+
+		if (c == '$' && (spec.features & kFeatureVariables) != 0) {
+			i++;
+			if (i < end && code[i] == '{') {
+				while (i < end && code[i] != '}')
+					i++;
+				if (i < end)
+					i++;
+			} else if (i < end && HasClass(table, code[i], kClassIdentPart)) {
+				while (i < end && HasClass(table, code[i], kClassIdentPart))
+					i++;
+			} else if (i < end && strchr("@#?*!$-", code[i]) != NULL)
+				i++;
+			Emit(tokens, tokenStart, i, kCodeMeta);
+			continue;
+		}
+
+		if (HasClass(table, c, kClassIdentStart)) {
+			i++;
+			while (i < end && HasClass(table, code[i], kClassIdentPart))
+				i++;
+			uint8_t kind = language->Lookup(code + tokenStart, i - tokenStart);
+			if (kind != kCodeText)
+				Emit(tokens, tokenStart, i, kind);
+			continue;
+		}
+
+		i++;
+	}
+
+	return end;
+}
+
+
+int32_t
+CodeHighlighter::_LexDiffLine(const char* code, int32_t pos, int32_t end,
+	std::vector<CodeToken>& tokens)
+{
+	if (pos >= end)
+		return end;
+
+	const char* line = code + pos;
+	int32_t length = end - pos;
+	if ((length >= 3 && (strncmp(line, "+++", 3) == 0
+			|| strncmp(line, "---", 3) == 0))
+		|| (length >= 2 && strncmp(line, "@@", 2) == 0)
+		|| (length >= 5 && strncmp(line, "diff ", 5) == 0)
+		|| (length >= 6 && strncmp(line, "index ", 6) == 0))
+		Emit(tokens, pos, end, kCodeMeta);
+	else if (line[0] == '+')
+		Emit(tokens, pos, end, kCodeInserted);
+	else if (line[0] == '-')
+		Emit(tokens, pos, end, kCodeDeleted);
+	return end;
+}
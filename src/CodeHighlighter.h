@@ -0,0 +1,86 @@
+#ifndef CODE_HIGHLIGHTER_H
+#define CODE_HIGHLIGHTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Table-driven syntax highlighter for fenced code blocks. Like
+// MarkdownLexer it is plain C++ so it can be benchmarked anywhere.
+
+enum {
+	kCodeText = 0,
+	kCodeKeyword,
+	kCodeType,			// types, builtins and JSON keys
+	kCodeString,
+	kCodeNumber,
+	kCodeComment,
+	kCodeMeta,			// preprocessor, shell variables, diff headers
+	kCodeInserted,
+	kCodeDeleted,
+	kCodeTokenKinds
+};
+
+
+// A highlighted stretch of a block, relative to the start of its code.
+// Gaps between tokens are plain text.
+struct CodeToken {
+	int32_t				offset;
+	int32_t				length;
+	uint8_t				kind;
+};
+
+
+struct CodeLanguage;
+
+
+class CodeHighlighter {
+public:
+							CodeHighlighter();
+
+	// Language for a fence tag such as "cpp" or "python", or NULL
+	static const CodeLanguage* FindLanguage(const char* tag, int32_t length);
+
+	// Tokens for the code of the block starting at blockStart. Results
+	// are cached per block: an unchanged block is not lexed again and a
+	// growing one only from its last complete line.
+	const std::vector<CodeToken>& Highlight(int32_t blockStart,
+								const CodeLanguage* language,
+								const char* code, int32_t length);
+
+	// Drops all cached blocks, for when the text was replaced
+	void					Clear();
+
+	// Lexes a whole block without caching
+	static void				Tokenize(const CodeLanguage* language,
+								const char* code, int32_t length,
+								std::vector<CodeToken>& tokens);
+
+private:
+	// Lexer state at a line start
+	struct State {
+		uint8_t				mode;
+		char				quote;
+		bool				triple;
+	};
+
+	struct Block {
+		int32_t				start;
+		const CodeLanguage*	language;
+		int32_t				stableLength;	// complete lines lexed
+		size_t				stableTokens;
+		State				stableState;
+		std::vector<CodeToken> tokens;
+	};
+
+	static int32_t			_LexLine(const CodeLanguage* language,
+								const char* code, int32_t pos, int32_t end,
+								State& state, std::vector<CodeToken>& tokens);
+	static int32_t			_LexDiffLine(const char* code, int32_t pos,
+								int32_t end, std::vector<CodeToken>& tokens);
+
+	std::vector<Block>		fBlocks;
+	std::vector<CodeToken>	fEmpty;
+};
+
+#endif // CODE_HIGHLIGHTER_H
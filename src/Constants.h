@@ -25,7 +25,28 @@ enum {
 	kMsgSelectChat = 'slch',
 	kMsgDeleteChat = 'dlch',
 	kMsgShowUser = 'shus',
-	kMsgThemeChanged = 'thch'
+	kMsgThemeChanged = 'thch',
+	kMsgHedgeTimer = 'hdgt',
+	kMsgHedgeChanged = 'hdch',
+	kMsgRouterProbe = 'rtpb',
+	kMsgBatchStart = 'btsr',
+	kMsgBatchStep = 'btst',
+	kMsgBatchPoll = 'btpl',
+	kMsgBatchResultLine = 'btrl',
+	kMsgBatchFinished = 'btfn',
+	kMsgBatchDone = 'btdn',
+	kMsgCompactionChanged = 'cmch',
+	kMsgCompactionStart = 'cmst',
+	kMsgCompactionDone = 'cmdn',
+	kMsgMarkdownReady = 'mdrd',
+	kMsgChatLayout = 'chly',
+	kMsgRenderTick = 'rtck',
+	kMsgCacheBubble = 'chbb',
+	kMsgLoadHistory = 'chhs',
+	kMsgRefineHeights = 'chrf',
+	kMsgExpandMessage = 'chex',
+	kMsgNewContent = 'chnc',
+	kMsgScrollToBottom = 'chsb'
 };
 
 // API Types
@@ -91,6 +112,8 @@ extern rgb_color kBorderColor;
 // Theme management
 void SetDarkTheme(bool dark);
 bool IsDarkTheme();
+// Identifies the fonts message text is laid out with
+uint32 TextFontKey();
 
 // Layout constants
 const float kBubbleMaxWidthRatio = 0.75f;
@@ -0,0 +1,277 @@
+#include "EndpointRouter.h"
+
+#include "Log.h"
+
+// Weight of the newest sample in each moving average
+static const float kEwmaAlpha = 0.3f;
+// Consecutive failures that open an endpoint's circuit
+static const int32 kFailureThreshold = 3;
+// How long an open circuit waits before the first probe, doubled on each
+// failed probe up to the maximum
+static const bigtime_t kInitialCooldown = 15000000;
+static const bigtime_t kMaxCooldown = 300000000;
+// Reply size used to turn throughput into an expected streaming time
+static const float kReferenceReplyBytes = 4096.0f;
+// Score multiplier per unit of error rate
+static const float kErrorPenalty = 4.0f;
+// Expected time to first token, in microseconds, of an endpoint that
+// has failed before ever streaming a token
+static const float kUnmeasuredScore = 2000000.0f;
+
+
+static float
+UpdateEwma(float average, float sample)
+{
+	if (average < 0)
+		return sample;
+	return kEwmaAlpha * sample + (1.0f - kEwmaAlpha) * average;
+}
+
+
+EndpointRouter::EndpointRouter()
+	:
+	fEndpoints(4, true)
+{
+}
+
+
+EndpointRouter::~EndpointRouter()
+{
+}
+
+
+void
+EndpointRouter::SetEndpoints(const BObjectList<BString>& urls)
+{
+	// Keep the health history of endpoints that are still configured
+	BObjectList<EndpointHealth> endpoints(4, true);
+	for (int32 i = 0; i < urls.CountItems(); i++) {
+		const BString& url = *urls.ItemAt(i);
+		if (url.Length() == 0)
+			continue;
+
+		EndpointHealth* health = NULL;
+		for (int32 j = 0; j < fEndpoints.CountItems(); j++) {
+			if (fEndpoints.ItemAt(j)->url == url) {
+				health = fEndpoints.RemoveItemAt(j);
+				break;
+			}
+		}
+
+		if (health == NULL) {
+			health = new EndpointHealth;
+			health->url = url;
+			health->ttftEwma = -1;
+			health->throughputEwma = -1;
+			health->errorEwma = 0;
+			health->consecutiveFailures = 0;
+			health->circuit = kCircuitClosed;
+			health->openedAt = 0;
+			health->cooldown = kInitialCooldown;
+		}
+		endpoints.AddItem(health);
+	}
+
+	fEndpoints.MakeEmpty();
+	for (int32 i = 0; i < endpoints.CountItems(); i++)
+		fEndpoints.AddItem(endpoints.ItemAt(i));
+	endpoints.MakeEmpty(false);
+}
+
+
+int32
+EndpointRouter::CountEndpoints() const
+{
+	return fEndpoints.CountItems();
+}
+
+
+const char*
+EndpointRouter::EndpointAt(int32 index) const
+{
+	EndpointHealth* health = fEndpoints.ItemAt(index);
+	if (health == NULL)
+		return "";
+	return health->url.String();
+}
+
+
+int32
+EndpointRouter::Select() const
+{
+	int32 best = -1;
+	float bestScore = 0;
+
+	for (int32 i = 0; i < fEndpoints.CountItems(); i++) {
+		EndpointHealth* health = fEndpoints.ItemAt(i);
+		if (health->circuit != kCircuitClosed)
+			continue;
+
+		float score = _Score(health);
+		if (best < 0 || score < bestScore) {
+			best = i;
+			bestScore = score;
+		}
+	}
+
+	if (best >= 0) {
+		LOG_DEBUG("EndpointRouter::Select - %s (score %.0f)",
+			EndpointAt(best), bestScore);
+		return best;
+	}
+
+	// Every circuit is open - use the one that has been resting longest
+	// rather than failing the request outright
+	for (int32 i = 0; i < fEndpoints.CountItems(); i++) {
+		EndpointHealth* health = fEndpoints.ItemAt(i);
+		if (best < 0 || health->openedAt < fEndpoints.ItemAt(best)->openedAt)
+			best = i;
+	}
+
+	if (best >= 0) {
+		LOG("EndpointRouter::Select - No healthy endpoint, trying %s",
+			EndpointAt(best));
+	}
+	return best;
+}
+
+
+void
+EndpointRouter::ReportFirstToken(int32 index, bigtime_t ttft)
+{
+	EndpointHealth* health = fEndpoints.ItemAt(index);
+	if (health == NULL)
+		return;
+
+	health->ttftEwma = UpdateEwma(health->ttftEwma, (float)ttft);
+}
+
+
+void
+EndpointRouter::ReportSuccess(int32 index, int64 bytes, bigtime_t streamTime)
+{
+	EndpointHealth* health = fEndpoints.ItemAt(index);
+	if (health == NULL)
+		return;
+
+	if (bytes > 0 && streamTime > 0) {
+		health->throughputEwma = UpdateEwma(health->throughputEwma,
+			bytes * 1000000.0f / streamTime);
+	}
+	health->errorEwma = UpdateEwma(health->errorEwma, 0.0f);
+	health->consecutiveFailures = 0;
+
+	if (health->circuit != kCircuitClosed)
+		_Close(health);
+}
+
+
+void
+EndpointRouter::ReportFailure(int32 index)
+{
+	EndpointHealth* health = fEndpoints.ItemAt(index);
+	if (health == NULL)
+		return;
+
+	health->errorEwma = UpdateEwma(health->errorEwma, 1.0f);
+	health->consecutiveFailures++;
+
+	if (health->circuit != kCircuitClosed
+		|| health->consecutiveFailures >= kFailureThreshold)
+		_Open(health);
+}
+
+
+bool
+EndpointRouter::HasOpenCircuits() const
+{
+	for (int32 i = 0; i < fEndpoints.CountItems(); i++) {
+		if (fEndpoints.ItemAt(i)->circuit != kCircuitClosed)
+			return true;
+	}
+	return false;
+}
+
+
+int32
+EndpointRouter::NextProbe()
+{
+	bigtime_t now = system_time();
+	for (int32 i = 0; i < fEndpoints.CountItems(); i++) {
+		EndpointHealth* health = fEndpoints.ItemAt(i);
+		if (health->circuit == kCircuitOpen
+			&& now - health->openedAt >= health->cooldown) {
+			health->circuit = kCircuitHalfOpen;
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+void
+EndpointRouter::ReportProbe(int32 index, bool success)
+{
+	EndpointHealth* health = fEndpoints.ItemAt(index);
+	if (health == NULL)
+		return;
+
+	LOG("EndpointRouter - Probe of %s %s", health->url.String(),
+		success ? "succeeded" : "failed");
+
+	if (success) {
+		// Give the endpoint a fresh start, live traffic refines the rest
+		health->errorEwma /= 2;
+		health->consecutiveFailures = 0;
+		_Close(health);
+	} else
+		_Open(health);
+}
+
+
+float
+EndpointRouter::_Score(const EndpointHealth* health) const
+{
+	// Unmeasured endpoints score best so each one gets tried, unless
+	// they failed before streaming anything
+	float score;
+	if (health->ttftEwma < 0) {
+		if (health->errorEwma <= 0)
+			return 0;
+		score = kUnmeasuredScore;
+	} else {
+		score = health->ttftEwma;
+		if (health->throughputEwma > 0) {
+			score += kReferenceReplyBytes / health->throughputEwma
+				* 1000000.0f;
+		}
+	}
+
+	return score * (1.0f + kErrorPenalty * health->errorEwma);
+}
+
+
+void
+EndpointRouter::_Open(EndpointHealth* health)
+{
+	if (health->circuit == kCircuitClosed)
+		health->cooldown = kInitialCooldown;
+	else if (health->cooldown < kMaxCooldown)
+		health->cooldown = min_c(health->cooldown * 2, kMaxCooldown);
+
+	health->circuit = kCircuitOpen;
+	health->openedAt = system_time();
+
+	LOG("EndpointRouter - Circuit opened for %s, probing in %ds",
+		health->url.String(), (int)(health->cooldown / 1000000));
+}
+
+
+void
+EndpointRouter::_Close(EndpointHealth* health)
+{
+	health->circuit = kCircuitClosed;
+	health->cooldown = kInitialCooldown;
+
+	LOG("EndpointRouter - Circuit closed for %s", health->url.String());
+}
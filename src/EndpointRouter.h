@@ -0,0 +1,61 @@
+#ifndef ENDPOINT_ROUTER_H
+#define ENDPOINT_ROUTER_H
+
+#include <ObjectList.h>
+#include <OS.h>
+#include <String.h>
+
+enum CircuitState {
+	kCircuitClosed = 0,
+	kCircuitOpen = 1,
+	kCircuitHalfOpen = 2
+};
+
+
+// Health record for one endpoint serving the same model family
+struct EndpointHealth {
+	BString				url;
+	float				ttftEwma;		// microseconds, < 0 until measured
+	float				throughputEwma;	// bytes per second, < 0 until measured
+	float				errorEwma;		// 0 (healthy) .. 1 (always failing)
+	int32				consecutiveFailures;
+	CircuitState		circuit;
+	bigtime_t			openedAt;
+	bigtime_t			cooldown;
+};
+
+
+// Picks the best healthy endpoint for each new request. Health is an
+// exponentially weighted moving average of time-to-first-token, streaming
+// throughput and error rate; repeated failures open a circuit breaker that
+// is only closed again by a successful probe. Not thread safe - the owner
+// serializes access.
+class EndpointRouter {
+public:
+						EndpointRouter();
+						~EndpointRouter();
+
+	void				SetEndpoints(const BObjectList<BString>& urls);
+	int32				CountEndpoints() const;
+	const char*			EndpointAt(int32 index) const;
+
+	int32				Select() const;
+
+	void				ReportFirstToken(int32 index, bigtime_t ttft);
+	void				ReportSuccess(int32 index, int64 bytes,
+							bigtime_t streamTime);
+	void				ReportFailure(int32 index);
+
+	bool				HasOpenCircuits() const;
+	int32				NextProbe();
+	void				ReportProbe(int32 index, bool success);
+
+private:
+	float				_Score(const EndpointHealth* health) const;
+	void				_Open(EndpointHealth* health);
+	void				_Close(EndpointHealth* health);
+
+	BObjectList<EndpointHealth> fEndpoints;
+};
+
+#endif // ENDPOINT_ROUTER_H
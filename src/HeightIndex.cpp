@@ -0,0 +1,104 @@
+#include "HeightIndex.h"
+
+
+HeightIndex::HeightIndex()
+	:
+	fTree(1, 0.0),
+	fTopBit(0)
+{
+}
+
+
+void
+HeightIndex::Clear()
+{
+	fHeights.clear();
+	fTree.assign(1, 0.0);
+	fTopBit = 0;
+}
+
+
+void
+HeightIndex::Assign(const std::vector<float>& heights)
+{
+	int32_t count = static_cast<int32_t>(heights.size());
+	fHeights.assign(heights.begin(), heights.end());
+
+	// Each node passes its sum on to its parent, the next node covering it
+	fTree.assign(count + 1, 0.0);
+	for (int32_t node = 1; node <= count; node++) {
+		fTree[node] += fHeights[node - 1];
+		int32_t parent = node + (node & -node);
+		if (parent <= count)
+			fTree[parent] += fTree[node];
+	}
+
+	fTopBit = 0;
+	if (count > 0) {
+		fTopBit = 1;
+		while (fTopBit * 2 <= count)
+			fTopBit *= 2;
+	}
+}
+
+
+void
+HeightIndex::Append(float height)
+{
+	// The new node covers the rows from its lowest set bit on; collect
+	// the nodes below it that cover those rows
+	int32_t node = Count() + 1;
+	double sum = height;
+	for (int32_t child = node - 1; child > node - (node & -node);
+			child -= child & -child)
+		sum += fTree[child];
+
+	fHeights.push_back(height);
+	fTree.push_back(sum);
+	if (fTopBit * 2 <= node)
+		fTopBit = fTopBit == 0 ? 1 : fTopBit * 2;
+}
+
+
+void
+HeightIndex::Set(int32_t index, float height)
+{
+	double delta = height - fHeights[index];
+	if (delta == 0)
+		return;
+
+	fHeights[index] = height;
+	for (int32_t node = index + 1; node <= Count(); node += node & -node)
+		fTree[node] += delta;
+}
+
+
+float
+HeightIndex::Offset(int32_t index) const
+{
+	double sum = 0;
+	for (int32_t node = index; node > 0; node -= node & -node)
+		sum += fTree[node];
+	return static_cast<float>(sum);
+}
+
+
+int32_t
+HeightIndex::IndexAt(float offset) const
+{
+	if (fHeights.empty())
+		return -1;
+
+	// Walk down from the top node, skipping whole subtrees that end at or
+	// before offset. What is left is the count of rows ending there.
+	int32_t rows = 0;
+	double remaining = offset;
+	for (int32_t step = fTopBit; step > 0; step /= 2) {
+		int32_t node = rows + step;
+		if (node <= Count() && fTree[node] <= remaining) {
+			rows = node;
+			remaining -= fTree[node];
+		}
+	}
+	return rows < Count() ? rows : Count() - 1;
+}
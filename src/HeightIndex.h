@@ -0,0 +1,40 @@
+#ifndef HEIGHT_INDEX_H
+#define HEIGHT_INDEX_H
+
+#include <stdint.h>
+#include <vector>
+
+// Heights of a column of rows kept as a Fenwick tree, so changing one
+// height, finding where a row starts and finding the row at an offset are
+// all O(log n). Plain C++ like MarkdownLexer, checked by
+// bench/HeightIndexCheck.
+
+class HeightIndex {
+public:
+						HeightIndex();
+
+	void				Clear();
+	// Replaces all rows, in O(n) rather than appending each
+	void				Assign(const std::vector<float>& heights);
+	void				Append(float height);
+	void				Set(int32_t index, float height);
+
+	int32_t				Count() const
+							{ return static_cast<int32_t>(fHeights.size()); }
+	float				Height(int32_t index) const
+							{ return static_cast<float>(fHeights[index]); }
+	// Sum of the heights of the rows before index
+	float				Offset(int32_t index) const;
+	float				Total() const { return Offset(Count()); }
+
+	// Row covering offset, clamped to the first and last row; -1 when
+	// there are none
+	int32_t				IndexAt(float offset) const;
+
+private:
+	std::vector<double>	fHeights;
+	std::vector<double>	fTree;		// 1-based partial sums
+	int32_t				fTopBit;	// highest power of two <= Count()
+};
+
+#endif // HEIGHT_INDEX_H
@@ -0,0 +1,276 @@
+#include "JsonUtils.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+
+static int32
+FindValueStart(const BString& json, const char* key, int32 from)
+{
+	BString quotedKey("\"");
+	quotedKey << key << "\"";
+
+	int32 pos = from;
+	while ((pos = json.FindFirst(quotedKey.String(), pos)) >= 0) {
+		int32 i = pos + quotedKey.Length();
+		while (i < json.Length() && (json[i] == ' ' || json[i] == '\t'
+				|| json[i] == '\n' || json[i] == '\r'))
+			i++;
+
+		// A string value that happens to equal the key has no colon
+		if (i < json.Length() && json[i] == ':') {
+			i++;
+			while (i < json.Length() && (json[i] == ' ' || json[i] == '\t'
+					|| json[i] == '\n' || json[i] == '\r'))
+				i++;
+			return i;
+		}
+		pos = i;
+	}
+	return -1;
+}
+
+
+static int32
+SkipString(const BString& json, int32 quote)
+{
+	// Returns the offset of the closing quote
+	int32 i = quote + 1;
+	while (i < json.Length()) {
+		if (json[i] == '\\') {
+			i += 2;
+			continue;
+		}
+		if (json[i] == '"')
+			return i;
+		i++;
+	}
+	return -1;
+}
+
+
+static int32
+ValueEnd(const BString& json, int32 start)
+{
+	// Returns the offset just past the value starting at start, or -1
+	int32 i = start;
+	if (json[i] == '{' || json[i] == '[') {
+		int32 depth = 0;
+		for (; i < json.Length(); i++) {
+			char c = json[i];
+			if (c == '"') {
+				i = SkipString(json, i);
+				if (i < 0)
+					return -1;
+			} else if (c == '{' || c == '[')
+				depth++;
+			else if (c == '}' || c == ']') {
+				if (--depth == 0) {
+					i++;
+					break;
+				}
+			}
+		}
+		if (depth != 0)
+			return -1;
+	} else if (json[i] == '"') {
+		i = SkipString(json, i);
+		if (i < 0)
+			return -1;
+		i++;
+	} else {
+		while (i < json.Length() && json[i] != ',' && json[i] != '}'
+			&& json[i] != ']' && json[i] != '\n')
+			i++;
+	}
+	return i;
+}
+
+
+static void
+AppendUtf8(BString& out, uint32 codePoint)
+{
+	char buffer[4];
+	int32 length;
+	if (codePoint < 0x80) {
+		buffer[0] = (char)codePoint;
+		length = 1;
+	} else if (codePoint < 0x800) {
+		buffer[0] = (char)(0xc0 | (codePoint >> 6));
+		buffer[1] = (char)(0x80 | (codePoint & 0x3f));
+		length = 2;
+	} else if (codePoint < 0x10000) {
+		buffer[0] = (char)(0xe0 | (codePoint >> 12));
+		buffer[1] = (char)(0x80 | ((codePoint >> 6) & 0x3f));
+		buffer[2] = (char)(0x80 | (codePoint & 0x3f));
+		length = 3;
+	} else {
+		buffer[0] = (char)(0xf0 | (codePoint >> 18));
+		buffer[1] = (char)(0x80 | ((codePoint >> 12) & 0x3f));
+		buffer[2] = (char)(0x80 | ((codePoint >> 6) & 0x3f));
+		buffer[3] = (char)(0x80 | (codePoint & 0x3f));
+		length = 4;
+	}
+	out.Append(buffer, length);
+}
+
+
+BString
+EscapeJson(const char* text)
+{
+	BString escaped;
+	for (const char* c = text; *c != '\0'; c++) {
+		switch (*c) {
+			case '\\':
+				escaped.Append("\\\\");
+				break;
+			case '"':
+				escaped.Append("\\\"");
+				break;
+			case '\n':
+				escaped.Append("\\n");
+				break;
+			case '\r':
+				escaped.Append("\\r");
+				break;
+			case '\t':
+				escaped.Append("\\t");
+				break;
+			default:
+				if ((unsigned char)*c < 0x20) {
+					char code[8];
+					snprintf(code, sizeof(code), "\\u%04x", *c);
+					escaped.Append(code);
+				} else
+					escaped.Append(c, 1);
+				break;
+		}
+	}
+	return escaped;
+}
+
+
+BString
+UnescapeJson(const char* text, int32 length)
+{
+	BString out;
+	int32 runStart = 0;
+	for (int32 i = 0; i < length; i++) {
+		if (text[i] != '\\' || i + 1 >= length)
+			continue;
+
+		out.Append(text + runStart, i - runStart);
+		char escape = text[++i];
+		switch (escape) {
+			case 'n':
+				out.Append("\n");
+				break;
+			case 't':
+				out.Append("\t");
+				break;
+			case 'r':
+				out.Append("\r");
+				break;
+			case 'b':
+				out.Append("\b");
+				break;
+			case 'f':
+				out.Append("\f");
+				break;
+			case 'u':
+				if (i + 4 < length) {
+					char hex[5] = { text[i + 1], text[i + 2], text[i + 3],
+						text[i + 4], '\0' };
+					uint32 codePoint = strtoul(hex, NULL, 16);
+					i += 4;
+					// Combine UTF-16 surrogate pairs
+					if (codePoint >= 0xd800 && codePoint < 0xdc00
+						&& i + 6 < length && text[i + 1] == '\\'
+						&& text[i + 2] == 'u') {
+						char low[5] = { text[i + 3], text[i + 4], text[i + 5],
+							text[i + 6], '\0' };
+						uint32 lowPoint = strtoul(low, NULL, 16);
+						if (lowPoint >= 0xdc00 && lowPoint < 0xe000) {
+							codePoint = 0x10000 + ((codePoint - 0xd800) << 10)
+								+ (lowPoint - 0xdc00);
+							i += 6;
+						}
+					}
+					AppendUtf8(out, codePoint);
+				}
+				break;
+			default:
+				// \" \\ \/ decode to the character itself
+				out.Append(&escape, 1);
+				break;
+		}
+		runStart = i + 1;
+	}
+	out.Append(text + runStart, length - runStart);
+	return out;
+}
+
+
+bool
+FindJsonString(const BString& json, const char* key, BString& value,
+	int32 from, int32* end)
+{
+	int32 start = FindValueStart(json, key, from);
+	if (start < 0 || start >= json.Length() || json[start] != '"')
+		return false;
+
+	int32 close = SkipString(json, start);
+	if (close < 0)
+		return false;
+
+	value = UnescapeJson(json.String() + start + 1, close - start - 1);
+	if (end != NULL)
+		*end = close + 1;
+	return true;
+}
+
+
+bool
+FindJsonRaw(const BString& json, const char* key, BString& value,
+	int32 from, int32* end)
+{
+	int32 start = FindValueStart(json, key, from);
+	if (start < 0 || start >= json.Length())
+		return false;
+
+	int32 i = ValueEnd(json, start);
+	if (i < 0)
+		return false;
+
+	json.CopyInto(value, start, i - start);
+	value.Trim();
+	if (end != NULL)
+		*end = i;
+	return true;
+}
+
+
+bool
+FindJsonObject(const BString& json, BString& value, int32 from, int32* end)
+{
+	int32 start = from;
+	while (start < json.Length() && json[start] != '{') {
+		if (json[start] == '"') {
+			start = SkipString(json, start);
+			if (start < 0)
+				return false;
+		}
+		start++;
+	}
+	if (start >= json.Length())
+		return false;
+
+	int32 i = ValueEnd(json, start);
+	if (i < 0)
+		return false;
+
+	json.CopyInto(value, start, i - start);
+	if (end != NULL)
+		*end = i;
+	return true;
+}
@@ -0,0 +1,30 @@
+#ifndef JSON_UTILS_H
+#define JSON_UTILS_H
+
+#include <String.h>
+
+// Minimal helpers for the flat JSON the provider APIs exchange. They scan
+// for a quoted key and do not validate the document.
+
+// Escapes text for use inside a JSON string literal
+BString				EscapeJson(const char* text);
+
+// Decodes the escapes of a JSON string literal's contents
+BString				UnescapeJson(const char* text, int32 length);
+
+// Finds "key" at or after from and returns its string value, unescaped.
+// end, if given, receives the offset just past the closing quote.
+bool				FindJsonString(const BString& json, const char* key,
+						BString& value, int32 from = 0, int32* end = NULL);
+
+// Finds "key" at or after from and returns its raw value text - a whole
+// object or array, or a bare number/literal.
+bool				FindJsonRaw(const BString& json, const char* key,
+						BString& value, int32 from = 0, int32* end = NULL);
+
+// Returns the next whole object at or after from, skipping any nested in
+// it, so repeated calls walk the objects of an array
+bool				FindJsonObject(const BString& json, BString& value,
+						int32 from = 0, int32* end = NULL);
+
+#endif // JSON_UTILS_H
@@ -2,20 +2,66 @@
 
 #include <HttpHeaders.h>
 #include <HttpRequest.h>
+#include <HttpResult.h>
 #include <UrlProtocolRoster.h>
 
+#include <Autolock.h>
+
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
+#include "JsonUtils.h"
 #include "Log.h"
 
 using namespace BPrivate::Network;
 
+// Hedge delay used until enough time-to-first-token samples are collected
+static const bigtime_t kDefaultHedgeDelay = 8000000;
+// Never hedge sooner than this, however fast the history says we are
+static const bigtime_t kMinHedgeDelay = 1000000;
+// Samples needed before the learned percentile replaces the default delay
+static const int32 kMinTtftSamples = 10;
+
+// How often open circuits are checked for a due probe
+static const bigtime_t kProbeInterval = 5000000;
+
+static const char* kApiNames[] = {"OpenAI", "Claude", "Gemini"};
+
+
+// Splits a leading system message off a messages array, for providers that
+// take the system prompt as a separate field
+static bool
+SplitSystemMessage(const BString& messagesJson, BString& system,
+	BString& rest)
+{
+	if (!messagesJson.StartsWith("[{\"role\":\"system\""))
+		return false;
+
+	int32 end;
+	if (!FindJsonString(messagesJson, "content", system, 0, &end))
+		return false;
+
+	int32 close = messagesJson.FindFirst('}', end);
+	if (close < 0)
+		return false;
+
+	BString tail;
+	messagesJson.CopyInto(tail, close + 1, messagesJson.Length() - close - 1);
+	if (tail.StartsWith(","))
+		tail.Remove(0, 1);
+	rest = "[";
+	rest << tail;
+	return true;
+}
+
 // StreamingOutput implementation
 
-StreamingOutput::StreamingOutput(LLMClient* client)
+StreamingOutput::StreamingOutput(LLMClient* client, int32 slot)
 	:
-	fClient(client)
+	fClient(client),
+	fSlot(slot)
 {
 }
 
@@ -29,7 +75,8 @@ ssize_t
 StreamingOutput::Write(const void* buffer, size_t size)
 {
 	if (fClient != NULL)
-		fClient->HandleDataReceived(static_cast<const char*>(buffer), size);
+		fClient->HandleDataReceived(fSlot, static_cast<const char*>(buffer),
+			size);
 	return size;
 }
 
@@ -56,9 +103,10 @@ CollectingOutput::Write(const void* buffer, size_t size)
 
 // LLMProtocolListener implementation
 
-LLMProtocolListener::LLMProtocolListener(LLMClient* client)
+LLMProtocolListener::LLMProtocolListener(LLMClient* client, int32 slot)
 	:
-	fClient(client)
+	fClient(client),
+	fSlot(slot)
 {
 }
 
@@ -72,7 +120,7 @@ void
 LLMProtocolListener::RequestCompleted(BUrlRequest* caller, bool success)
 {
 	if (fClient != NULL)
-		fClient->HandleRequestCompleted(success);
+		fClient->HandleRequestCompleted(fSlot, success);
 }
 
 
@@ -98,25 +146,80 @@ ModelsProtocolListener::RequestCompleted(BUrlRequest* caller, bool success)
 }
 
 
+// ProbeProtocolListener implementation
+
+ProbeProtocolListener::ProbeProtocolListener(LLMClient* client)
+	:
+	fClient(client)
+{
+}
+
+
+ProbeProtocolListener::~ProbeProtocolListener()
+{
+}
+
+
+void
+ProbeProtocolListener::RequestCompleted(BUrlRequest* caller, bool success)
+{
+	if (fClient != NULL)
+		fClient->HandleProbeCompleted(caller, success);
+}
+
+
 // LLMClient implementation
 
 LLMClient::LLMClient(BMessenger target)
 	:
 	BLooper("LLMClient"),
 	fTarget(target),
-	fRequest(NULL),
+	fStreamLock("LLMClient streams"),
+	fWinner(-1),
+	fGeneration(0),
 	fModelsRequest(NULL),
-	fListener(NULL),
 	fModelsListener(NULL),
-	fOutput(NULL),
 	fModelsOutput(NULL),
 	fCurrentApiType(kApiTypeOpenAI),
-	fCancelled(false)
+	fCancelled(false),
+	fHedgeEnabled(false),
+	fHedgeApiType(kApiTypeOpenAI),
+	fHedgePercentile(0.95f),
+	fHedgeMaxRate(0.1f),
+	fHedgeRunner(NULL),
+	fTtftSampleCount(0),
+	fTtftNext(0),
+	fRecentCount(0),
+	fRecentNext(0),
+	fRouteApiType(kApiTypeOpenAI),
+	fProbeRequest(NULL),
+	fProbeRoute(-1),
+	fProbeListener(NULL),
+	fProbeOutput(NULL),
+	fProbeRunner(NULL),
+	fResponsesApi(false),
+	fBytesSent(0),
+	fFullHistoryBytes(0)
 {
-	fListener = new LLMProtocolListener(this);
+	for (int32 i = 0; i < kStreamSlotCount; i++) {
+		StreamSlot& stream = fSlots[i];
+		stream.request = NULL;
+		stream.output = new StreamingOutput(this, i);
+		stream.listener = new LLMProtocolListener(this, i);
+		stream.apiType = kApiTypeOpenAI;
+		stream.startTime = 0;
+		stream.firstTokenTime = 0;
+		stream.bytes = 0;
+		stream.route = -1;
+		stream.active = false;
+		stream.failed = false;
+		stream.responsesApi = false;
+		stream.retryFullHistory = false;
+	}
 	fModelsListener = new ModelsProtocolListener(this);
-	fOutput = new StreamingOutput(this);
 	fModelsOutput = new CollectingOutput();
+	fProbeListener = new ProbeProtocolListener(this);
+	fProbeOutput = new CollectingOutput();
 	Run();
 }
 
@@ -124,41 +227,242 @@ LLMClient::LLMClient(BMessenger target)
 LLMClient::~LLMClient()
 {
 	Cancel();
-	delete fListener;
+
+	fStreamLock.Lock();
+	BUrlRequest* probe = fProbeRequest;
+	fProbeRequest = NULL;
+	delete fProbeRunner;
+	fProbeRunner = NULL;
+	fStreamLock.Unlock();
+
+	if (probe != NULL) {
+		probe->Stop();
+		delete probe;
+	}
+
+	for (int32 i = 0; i < kStreamSlotCount; i++) {
+		delete fSlots[i].listener;
+		delete fSlots[i].output;
+	}
 	delete fModelsListener;
-	delete fOutput;
 	delete fModelsOutput;
+	delete fProbeListener;
+	delete fProbeOutput;
 }
 
 
 void
 LLMClient::MessageReceived(BMessage* message)
 {
-	BLooper::MessageReceived(message);
+	switch (message->what) {
+		case kMsgHedgeTimer:
+		{
+			BAutolock lock(fStreamLock);
+			int32 generation;
+			if (message->FindInt32("generation", &generation) == B_OK
+				&& static_cast<uint32>(generation) == fGeneration
+				&& fSlots[kPrimarySlot].active && fWinner < 0) {
+				_FireHedge();
+			}
+			break;
+		}
+
+		case kMsgRouterProbe:
+		{
+			BAutolock lock(fStreamLock);
+			if (!fRouter.HasOpenCircuits()) {
+				delete fProbeRunner;
+				fProbeRunner = NULL;
+				break;
+			}
+			if (fProbeRequest == NULL) {
+				int32 route = fRouter.NextProbe();
+				if (route >= 0)
+					_StartProbe(route);
+			}
+			break;
+		}
+
+		default:
+			BLooper::MessageReceived(message);
+			break;
+	}
 }
 
 
-void
+status_t
 LLMClient::SendChatRequest(const char* messagesJson, ApiType apiType,
 	const char* endpoint, const char* apiKey, const char* model)
 {
-	const char* apiNames[] = {"OpenAI", "Claude", "Gemini"};
 	LOG("LLMClient::SendChatRequest - API: %s, Model: %s, Endpoint: %s",
-		apiNames[apiType], model, endpoint);
+		kApiNames[apiType], model, endpoint);
 
 	// Cancel any existing request
 	Cancel();
 
+	BAutolock lock(fStreamLock);
 	fCurrentApiType = apiType;
 	fCancelled = false;
-	fBuffer = "";
-	fEventType = "";
-	fGeminiBuffer = "";
+	fWinner = -1;
+	fGeneration++;
+	fPendingMessagesJson = messagesJson;
+	_RecordRequest(false);
+
+	// A stored response lives on the server that created it, so a
+	// continued conversation stays on that endpoint
+	bool responsesApi = fResponsesApi && apiType == kApiTypeOpenAI;
+	bool continued = responsesApi && fPreviousResponseId.Length() > 0;
+	const char* input = continued ? fNewMessagesJson.String() : messagesJson;
+
+	// Send to the healthiest mirror when several serve this provider
+	int32 route = -1;
+	BString routedEndpoint(endpoint);
+	if (continued) {
+		routedEndpoint = fPreviousEndpoint;
+		for (int32 i = 0; i < fRouter.CountEndpoints(); i++) {
+			if (routedEndpoint == fRouter.EndpointAt(i))
+				route = i;
+		}
+	} else if (apiType == fRouteApiType && fRouter.CountEndpoints() > 1) {
+		route = fRouter.Select();
+		if (route >= 0)
+			routedEndpoint = fRouter.EndpointAt(route);
+	}
+
+	status_t status = _StartRequest(kPrimarySlot, input, apiType,
+		routedEndpoint.String(), apiKey, model, route, responsesApi,
+		continued ? fPreviousResponseId.String() : NULL);
+	ClearPreviousResponse();
+
+	if (status == B_OK) {
+		// What this turn uploaded against what resending the whole
+		// history would have cost
+		int32 sent = strlen(input);
+		int32 full = strlen(messagesJson);
+		fBytesSent += sent;
+		fFullHistoryBytes += full;
+		LOG("LLMClient - Uploaded %d bytes of messages (full history %d), "
+			"%lld of %lld bytes this session (%.0f%% saved)", (int)sent,
+			(int)full, (long long)fBytesSent, (long long)fFullHistoryBytes,
+			fFullHistoryBytes > 0
+				? 100.0 * (fFullHistoryBytes - fBytesSent) / fFullHistoryBytes
+				: 0.0);
+	}
+
+	if (status == B_NO_MEMORY) {
+		_SendError("Failed to create HTTP request");
+		return status;
+	}
+	if (status != B_OK) {
+		_SendError("Invalid HTTP request");
+		return status;
+	}
+
+	_ScheduleHedge();
+	return B_OK;
+}
+
+
+void
+LLMClient::SetRoutes(ApiType apiType, const char* apiKey,
+	const BObjectList<BString>& endpoints)
+{
+	BAutolock lock(fStreamLock);
+	fRouteApiType = apiType;
+	fRouteApiKey = apiKey;
+	fRouter.SetEndpoints(endpoints);
+}
+
+
+void
+LLMClient::SetResponsesApi(bool enabled)
+{
+	BAutolock lock(fStreamLock);
+	fResponsesApi = enabled;
+}
 
+
+void
+LLMClient::SetPreviousResponse(const char* responseId, const char* endpoint,
+	const char* newMessagesJson)
+{
+	BAutolock lock(fStreamLock);
+	fPreviousResponseId = responseId;
+	fPreviousEndpoint = endpoint;
+	fNewMessagesJson = newMessagesJson;
+}
+
+
+void
+LLMClient::ClearPreviousResponse()
+{
+	BAutolock lock(fStreamLock);
+	fPreviousResponseId = "";
+	fPreviousEndpoint = "";
+	fNewMessagesJson = "";
+}
+
+
+void
+LLMClient::SetHedgeTarget(ApiType apiType, const char* endpoint,
+	const char* apiKey, const char* model)
+{
+	BAutolock lock(fStreamLock);
+	fHedgeEnabled = true;
+	fHedgeApiType = apiType;
+	fHedgeEndpoint = endpoint;
+	fHedgeApiKey = apiKey;
+	fHedgeModel = model;
+}
+
+
+void
+LLMClient::ClearHedgeTarget()
+{
+	BAutolock lock(fStreamLock);
+	fHedgeEnabled = false;
+}
+
+
+void
+LLMClient::SetHedgePolicy(float percentile, float maxRate)
+{
+	BAutolock lock(fStreamLock);
+	fHedgePercentile = std::min(std::max(percentile, 0.5f), 0.999f);
+	fHedgeMaxRate = std::min(std::max(maxRate, 0.0f), 1.0f);
+}
+
+
+status_t
+LLMClient::_StartRequest(int32 slot, const char* messagesJson,
+	ApiType apiType, const char* endpoint, const char* apiKey,
+	const char* model, int32 route, bool responsesApi,
+	const char* previousResponseId)
+{
 	BString url(endpoint);
 	BString body;
 
-	if (apiType == kApiTypeOpenAI) {
+	if (apiType == kApiTypeOpenAI && responsesApi) {
+		if (!url.EndsWith("/"))
+			url.Append("/");
+		url.Append("responses");
+
+		BString previous;
+		if (previousResponseId != NULL && previousResponseId[0] != '\0') {
+			previous.SetToFormat("\"previous_response_id\": \"%s\",",
+				EscapeJson(previousResponseId).String());
+		}
+
+		body.SetToFormat(
+			"{"
+			"\"model\": \"%s\","
+			"\"input\": %s,"
+			"%s"
+			"\"store\": true,"
+			"\"stream\": true"
+			"}",
+			model, messagesJson, previous.String());
+	} else if (apiType == kApiTypeOpenAI) {
 		if (!url.EndsWith("/"))
 			url.Append("/");
 		url.Append("chat/completions");
@@ -175,14 +479,25 @@ LLMClient::SendChatRequest(const char* messagesJson, ApiType apiType,
 			url.Append("/");
 		url.Append("messages");
 
+		// Claude takes the system prompt outside the messages
+		BString system;
+		BString messages;
+		BString systemField;
+		if (SplitSystemMessage(messagesJson, system, messages)) {
+			systemField.SetToFormat("\"system\": \"%s\",",
+				EscapeJson(system.String()).String());
+		} else
+			messages = messagesJson;
+
 		body.SetToFormat(
 			"{"
 			"\"model\": \"%s\","
 			"\"max_tokens\": 4096,"
+			"%s"
 			"\"messages\": %s,"
 			"\"stream\": true"
 			"}",
-			model, messagesJson);
+			model, systemField.String(), messages.String());
 	} else if (apiType == kApiTypeGemini) {
 		// Gemini uses a different URL structure
 		// https://generativelanguage.googleapis.com/v1beta/models/{model}:streamGenerateContent?key=API_KEY
@@ -194,12 +509,20 @@ LLMClient::SendChatRequest(const char* messagesJson, ApiType apiType,
 		url.Append(apiKey);
 
 		// Convert messages to Gemini format
-		// Gemini uses "contents" with "parts" instead of "messages"
-		body = "{\"contents\": [";
+		// Gemini uses "contents" with "parts" instead of "messages", and
+		// a separate systemInstruction
+		BString system;
+		BString msgJson;
+		body = "{";
+		if (SplitSystemMessage(messagesJson, system, msgJson)) {
+			body << "\"systemInstruction\": {\"parts\":[{\"text\":\""
+				<< EscapeJson(system.String()) << "\"}]},";
+		} else
+			msgJson = messagesJson;
+		body << "\"contents\": [";
 
 		// Parse messagesJson to convert format
 		// Simple approach: just wrap the content
-		BString msgJson(messagesJson);
 		int32 pos = 0;
 		bool first = true;
 
@@ -249,22 +572,23 @@ LLMClient::SendChatRequest(const char* messagesJson, ApiType apiType,
 		body.Append("]}");
 	}
 
+	StreamSlot& stream = fSlots[slot];
+
 	// Create request using BUrlProtocolRoster with streaming output
-	fRequest = BUrlProtocolRoster::MakeRequest(BUrl(url.String()),
-		fOutput, fListener, NULL);
+	BUrlRequest* request = BUrlProtocolRoster::MakeRequest(
+		BUrl(url.String()), stream.output, stream.listener, NULL);
 
-	if (fRequest == NULL) {
-		_SendError("Failed to create HTTP request");
-		return;
+	if (request == NULL) {
+		LOG_ERROR("Failed to create HTTP request for %s", url.String());
+		return B_NO_MEMORY;
 	}
 
 	// Cast to BHttpRequest to set HTTP-specific options
-	BHttpRequest* httpRequest = dynamic_cast<BHttpRequest*>(fRequest);
+	BHttpRequest* httpRequest = dynamic_cast<BHttpRequest*>(request);
 	if (httpRequest == NULL) {
-		delete fRequest;
-		fRequest = NULL;
-		_SendError("Invalid HTTP request");
-		return;
+		delete request;
+		LOG_ERROR("Invalid HTTP request for %s", url.String());
+		return B_BAD_TYPE;
 	}
 
 	httpRequest->SetMethod(B_HTTP_POST);
@@ -291,16 +615,256 @@ LLMClient::SendChatRequest(const char* messagesJson, ApiType apiType,
 	bodyData->Seek(0, SEEK_SET);
 	httpRequest->AdoptInputData(bodyData, body.Length());
 
+	BAutolock lock(fStreamLock);
+	stream.request = request;
+	stream.apiType = apiType;
+	stream.endpoint = endpoint;
+	stream.apiKey = apiKey;
+	stream.model = model;
+	stream.responsesApi = apiType == kApiTypeOpenAI && responsesApi;
+	stream.previousResponseId = previousResponseId != NULL
+		? previousResponseId : "";
+	stream.responseId = "";
+	stream.retryFullHistory = false;
+	stream.buffer = "";
+	stream.eventType = "";
+	stream.startTime = system_time();
+	stream.firstTokenTime = 0;
+	stream.bytes = 0;
+	stream.route = route;
+	stream.active = true;
+	stream.failed = false;
+
 	// Run request in background thread
-	fRequest->Run();
+	request->Run();
+	return B_OK;
+}
+
+
+void
+LLMClient::_StopSlot(int32 slot)
+{
+	// Called with fStreamLock held. The request is only stopped here; its
+	// completion callback deletes it.
+	StreamSlot& stream = fSlots[slot];
+	stream.active = false;
+	stream.buffer = "";
+	if (stream.request != NULL)
+		stream.request->Stop();
+}
+
+
+void
+LLMClient::_FailStream(int32 slot, const BString& error)
+{
+	// Called with fStreamLock held
+	StreamSlot& stream = fSlots[slot];
+	LOG_ERROR("API error response (%s): %s",
+		slot == kHedgeSlot ? "hedge" : "primary", error.String());
+	stream.buffer = "";
+	stream.active = false;
+
+	// The server no longer has the stored response - resend the whole
+	// history once this request has finished
+	if (stream.previousResponseId.Length() > 0 && fWinner < 0
+		&& (error.IFindFirst("previous response") >= 0
+			|| error.FindFirst("previous_response") >= 0)) {
+		LOG("LLMClient - Response %s expired, resending full history",
+			stream.previousResponseId.String());
+		stream.retryFullHistory = true;
+		return;
+	}
+
+	stream.failed = true;
+
+	// Let the other stream answer if it is still running, or fail over to
+	// the hedge target right away
+	int32 other = kStreamSlotCount - 1 - slot;
+	if (fWinner < 0 && fSlots[other].active)
+		return;
+	if (fWinner < 0 && slot == kPrimarySlot) {
+		_FireHedge();
+		if (fSlots[kHedgeSlot].active)
+			return;
+	}
+
+	_SendError(error.String());
+	fCancelled = true;
+}
+
+
+void
+LLMClient::_ReportRoute(int32 slot, bool success)
+{
+	// Called with fStreamLock held
+	StreamSlot& stream = fSlots[slot];
+	if (stream.route < 0)
+		return;
+
+	if (success) {
+		bigtime_t streamTime = 0;
+		if (stream.firstTokenTime > 0)
+			streamTime = system_time() - stream.firstTokenTime;
+		fRouter.ReportSuccess(stream.route, stream.bytes, streamTime);
+		return;
+	}
+
+	fRouter.ReportFailure(stream.route);
+	if (fRouter.HasOpenCircuits() && fProbeRunner == NULL) {
+		BMessage probe(kMsgRouterProbe);
+		fProbeRunner = new BMessageRunner(BMessenger(this), &probe,
+			kProbeInterval);
+	}
+}
+
+
+void
+LLMClient::_StartProbe(int32 route)
+{
+	// Called with fStreamLock held. A cheap authenticated GET of the model
+	// list tells whether the endpoint is serving again.
+	BString url(fRouter.EndpointAt(route));
+	if (!url.EndsWith("/"))
+		url.Append("/");
+	url.Append("models");
+	if (fRouteApiType == kApiTypeGemini) {
+		url.Append("?key=");
+		url.Append(fRouteApiKey);
+	}
+
+	fProbeOutput->Clear();
+	BUrlRequest* request = BUrlProtocolRoster::MakeRequest(
+		BUrl(url.String()), fProbeOutput, fProbeListener, NULL);
+	BHttpRequest* httpRequest = dynamic_cast<BHttpRequest*>(request);
+	if (httpRequest == NULL) {
+		delete request;
+		fRouter.ReportProbe(route, false);
+		return;
+	}
+
+	httpRequest->SetMethod(B_HTTP_GET);
+
+	BHttpHeaders* headers = new BHttpHeaders();
+	if (fRouteApiType == kApiTypeOpenAI) {
+		BString authHeader;
+		authHeader.SetToFormat("Bearer %s", fRouteApiKey.String());
+		headers->AddHeader("Authorization", authHeader.String());
+	} else if (fRouteApiType == kApiTypeClaude) {
+		headers->AddHeader("x-api-key", fRouteApiKey.String());
+		headers->AddHeader("anthropic-version", "2023-06-01");
+	}
+	httpRequest->AdoptHeaders(headers);
+
+	LOG("LLMClient - Probing %s", url.String());
+	fProbeRequest = request;
+	fProbeRoute = route;
+	fProbeRequest->Run();
+}
+
+
+void
+LLMClient::_ScheduleHedge()
+{
+	// Called with fStreamLock held
+	if (!fHedgeEnabled || !_HedgeBudgetAvailable())
+		return;
+
+	bigtime_t delay = _HedgeDelay();
+	LOG("LLMClient - Hedge armed, fires after %.2fs without a first token",
+		delay / 1000000.0);
+
+	BMessage timer(kMsgHedgeTimer);
+	timer.AddInt32("generation", static_cast<int32>(fGeneration));
+	fHedgeRunner = new BMessageRunner(BMessenger(this), &timer, delay, 1);
+}
+
+
+void
+LLMClient::_FireHedge()
+{
+	// Called with fStreamLock held
+	if (!fHedgeEnabled || fCancelled || fWinner >= 0
+		|| fSlots[kHedgeSlot].request != NULL) {
+		return;
+	}
+
+	if (!_HedgeBudgetAvailable()) {
+		LOG("LLMClient - Hedge budget exhausted, waiting on primary");
+		return;
+	}
+
+	LOG("LLMClient - No first token after %.2fs, hedging to %s (%s)",
+		(system_time() - fSlots[kPrimarySlot].startTime) / 1000000.0,
+		kApiNames[fHedgeApiType], fHedgeModel.String());
+
+	if (_StartRequest(kHedgeSlot, fPendingMessagesJson.String(),
+			fHedgeApiType, fHedgeEndpoint.String(), fHedgeApiKey.String(),
+			fHedgeModel.String()) != B_OK) {
+		return;
+	}
+
+	// Charge the hedge to the request that triggered it
+	int32 last = (fRecentNext + kHedgeWindowSize - 1) % kHedgeWindowSize;
+	fRecentHedged[last] = true;
+}
+
+
+bool
+LLMClient::_HedgeBudgetAvailable() const
+{
+	int32 hedged = 0;
+	for (int32 i = 0; i < fRecentCount; i++) {
+		if (fRecentHedged[i])
+			hedged++;
+	}
+	return hedged < fHedgeMaxRate * kHedgeWindowSize;
+}
+
+
+bigtime_t
+LLMClient::_HedgeDelay() const
+{
+	if (fTtftSampleCount < kMinTtftSamples)
+		return kDefaultHedgeDelay;
+
+	bigtime_t sorted[kTtftSampleCapacity];
+	memcpy(sorted, fTtftSamples, fTtftSampleCount * sizeof(bigtime_t));
+	std::sort(sorted, sorted + fTtftSampleCount);
+
+	int32 index = static_cast<int32>(
+		fHedgePercentile * (fTtftSampleCount - 1) + 0.5f);
+	if (index >= fTtftSampleCount)
+		index = fTtftSampleCount - 1;
+
+	return std::max(sorted[index], kMinHedgeDelay);
+}
+
+
+void
+LLMClient::_RecordTimeToFirstToken(bigtime_t ttft)
+{
+	fTtftSamples[fTtftNext] = ttft;
+	fTtftNext = (fTtftNext + 1) % kTtftSampleCapacity;
+	if (fTtftSampleCount < kTtftSampleCapacity)
+		fTtftSampleCount++;
+}
+
+
+void
+LLMClient::_RecordRequest(bool hedged)
+{
+	fRecentHedged[fRecentNext] = hedged;
+	fRecentNext = (fRecentNext + 1) % kHedgeWindowSize;
+	if (fRecentCount < kHedgeWindowSize)
+		fRecentCount++;
 }
 
 
 void
 LLMClient::FetchModels(ApiType apiType, const char* endpoint, const char* apiKey)
 {
-	const char* apiNames[] = {"OpenAI", "Claude", "Gemini"};
-	LOG("LLMClient::FetchModels - API: %s, Endpoint: %s", apiNames[apiType], endpoint);
+	LOG("LLMClient::FetchModels - API: %s, Endpoint: %s", kApiNames[apiType],
+		endpoint);
 
 	// Cancel any existing models request
 	if (fModelsRequest != NULL) {
@@ -366,41 +930,63 @@ LLMClient::FetchModels(ApiType apiType, const char* endpoint, const char* apiKey
 void
 LLMClient::Cancel()
 {
+	BUrlRequest* requests[kStreamSlotCount];
+
+	fStreamLock.Lock();
 	fCancelled = true;
-	if (fRequest != NULL) {
-		fRequest->Stop();
-		delete fRequest;
-		fRequest = NULL;
+	fGeneration++;
+	for (int32 i = 0; i < kStreamSlotCount; i++) {
+		requests[i] = fSlots[i].request;
+		fSlots[i].request = NULL;
+		fSlots[i].active = false;
+	}
+	delete fHedgeRunner;
+	fHedgeRunner = NULL;
+	fStreamLock.Unlock();
+
+	// Stop outside the lock so pending callbacks can drain
+	for (int32 i = 0; i < kStreamSlotCount; i++) {
+		if (requests[i] != NULL) {
+			requests[i]->Stop();
+			delete requests[i];
+		}
 	}
 }
 
 
 void
-LLMClient::HandleDataReceived(const char* data, ssize_t size)
+LLMClient::HandleDataReceived(int32 slot, const char* data, ssize_t size)
 {
-	if (fCancelled)
+	BAutolock lock(fStreamLock);
+
+	StreamSlot& stream = fSlots[slot];
+	if (fCancelled || !stream.active)
 		return;
 
-	BString chunk(data, size);
-	fBuffer.Append(chunk);
+	stream.buffer.Append(data, size);
 
-	// Check for error response early (before processing as stream)
-	if (fBuffer.FindFirst("\"error\"") >= 0 && fBuffer.FindFirst("\"message\"") >= 0) {
+	// Check for error response early (before processing as stream). Events
+	// of the Responses API carry "error" and "message" in normal output, so
+	// there only a plain JSON body counts as an error.
+	if ((!stream.responsesApi || stream.buffer.StartsWith("{"))
+		&& stream.buffer.FindFirst("\"error\"") >= 0
+		&& stream.buffer.FindFirst("\"message\"") >= 0) {
 		// Try to extract error message
-		int32 msgPos = fBuffer.FindFirst("\"message\"");
+		int32 msgPos = stream.buffer.FindFirst("\"message\"");
 		if (msgPos >= 0) {
-			int32 colonPos = fBuffer.FindFirst(":", msgPos);
-			int32 quoteStart = fBuffer.FindFirst("\"", colonPos);
+			int32 colonPos = stream.buffer.FindFirst(":", msgPos);
+			int32 quoteStart = stream.buffer.FindFirst("\"", colonPos);
 			int32 quoteEnd = quoteStart + 1;
-			while (quoteEnd < fBuffer.Length() && fBuffer[quoteEnd] != '"')
+			while (quoteEnd < stream.buffer.Length()
+				&& stream.buffer[quoteEnd] != '"')
 				quoteEnd++;
 			if (quoteStart >= 0 && quoteEnd > quoteStart) {
 				BString errorMsg;
-				fBuffer.CopyInto(errorMsg, quoteStart + 1, quoteEnd - quoteStart - 1);
-				LOG_ERROR("API error response: %s", errorMsg.String());
-				_SendError(errorMsg.String());
-				fBuffer = "";
-				fCancelled = true;
+				stream.buffer.CopyInto(errorMsg, quoteStart + 1,
+					quoteEnd - quoteStart - 1);
+				if (stream.buffer.FindFirst("previous_response") >= 0)
+					errorMsg.Append(" (previous_response)");
+				_FailStream(slot, errorMsg);
 				return;
 			}
 		}
@@ -408,40 +994,104 @@ LLMClient::HandleDataReceived(const char* data, ssize_t size)
 
 	// Process complete lines
 	int32 pos;
-	while ((pos = fBuffer.FindFirst('\n')) >= 0) {
+	while (stream.active && (pos = stream.buffer.FindFirst('\n')) >= 0) {
 		BString line;
-		fBuffer.MoveInto(line, 0, pos + 1);
+		stream.buffer.MoveInto(line, 0, pos + 1);
 		line.RemoveAll("\r");
 		line.RemoveAll("\n");
 
 		if (line.Length() == 0)
 			continue;
 
-		if (fCurrentApiType == kApiTypeOpenAI) {
-			_ProcessOpenAIChunk(line);
-		} else if (fCurrentApiType == kApiTypeClaude) {
-			_ProcessClaudeChunk(line);
-		} else if (fCurrentApiType == kApiTypeGemini) {
-			_ProcessGeminiChunk(line);
+		if (stream.responsesApi) {
+			_ProcessResponsesChunk(slot, line);
+		} else if (stream.apiType == kApiTypeOpenAI) {
+			_ProcessOpenAIChunk(slot, line);
+		} else if (stream.apiType == kApiTypeClaude) {
+			_ProcessClaudeChunk(slot, line);
+		} else if (stream.apiType == kApiTypeGemini) {
+			_ProcessGeminiChunk(slot, line);
 		}
 	}
 }
 
 
 void
-LLMClient::HandleRequestCompleted(bool success)
+LLMClient::HandleRequestCompleted(int32 slot, bool success)
 {
-	LOG("LLMClient::HandleRequestCompleted - success=%s, cancelled=%s",
-		success ? "true" : "false", fCancelled ? "true" : "false");
+	BUrlRequest* finished = NULL;
+
+	{
+		BAutolock lock(fStreamLock);
 
-	if (!success && !fCancelled) {
-		LOG_ERROR("Request failed");
-		_SendError("Request failed - check your API key and network connection");
+		StreamSlot& stream = fSlots[slot];
+		finished = stream.request;
+		stream.request = NULL;
+
+		// Already torn down by Cancel()
+		if (finished == NULL)
+			return;
+
+		LOG("LLMClient::HandleRequestCompleted - %s, success=%s, "
+			"cancelled=%s", slot == kHedgeSlot ? "hedge" : "primary",
+			success ? "true" : "false", fCancelled ? "true" : "false");
+
+		if (stream.retryFullHistory && !fCancelled && fWinner < 0) {
+			BString endpoint(stream.endpoint);
+			BString apiKey(stream.apiKey);
+			BString model(stream.model);
+			if (_StartRequest(slot, fPendingMessagesJson.String(),
+					stream.apiType, endpoint.String(), apiKey.String(),
+					model.String(), stream.route, true) == B_OK) {
+				fBytesSent += fPendingMessagesJson.Length();
+				lock.Unlock();
+				delete finished;
+				return;
+			}
+			_SendError("Failed to create HTTP request");
+			stream.failed = true;
+		}
+		stream.retryFullHistory = false;
+
+		bool wasActive = stream.active;
+		stream.active = false;
+		if (!success)
+			stream.failed = true;
+
+		int32 other = kStreamSlotCount - 1 - slot;
+		bool failedOver = false;
+		if (fWinner < 0 && slot == kPrimarySlot && !success && wasActive
+			&& !fCancelled && !fSlots[other].active) {
+			// Primary failed outright, let the hedge target take over
+			_FireHedge();
+			failedOver = fSlots[kHedgeSlot].active;
+		}
+
+		if (fWinner >= 0 && fWinner != slot) {
+			// Loser of a hedge race, nothing to report
+		} else if (fWinner < 0 && fSlots[other].active) {
+			// No first token yet, the other stream may still answer
+			if (stream.failed)
+				_ReportRoute(slot, false);
+			if (failedOver)
+				LOG("LLMClient - Primary failed, failed over to hedge");
+		} else {
+			if (stream.failed || success)
+				_ReportRoute(slot, !stream.failed);
+
+			if (!success && !fCancelled) {
+				LOG_ERROR("Request failed");
+				_SendError("Request failed - check your API key and "
+					"network connection");
+			}
+			_SendDone(slot);
+
+			delete fHedgeRunner;
+			fHedgeRunner = NULL;
+		}
 	}
-	_SendDone();
 
-	delete fRequest;
-	fRequest = NULL;
+	delete finished;
 }
 
 
@@ -499,7 +1149,30 @@ LLMClient::HandleModelsRequestCompleted(bool success)
 
 
 void
-LLMClient::_ProcessOpenAIChunk(const BString& line)
+LLMClient::HandleProbeCompleted(BUrlRequest* caller, bool success)
+{
+	BAutolock lock(fStreamLock);
+	if (caller != fProbeRequest)
+		return;
+
+	// Any 2xx answer means the endpoint is reachable and accepts our key
+	if (success) {
+		const BHttpResult* result
+			= dynamic_cast<const BHttpResult*>(&caller->Result());
+		if (result != NULL)
+			success = result->StatusCode() >= 200 && result->StatusCode() < 300;
+	}
+
+	fRouter.ReportProbe(fProbeRoute, success);
+
+	delete fProbeRequest;
+	fProbeRequest = NULL;
+	fProbeRoute = -1;
+}
+
+
+void
+LLMClient::_ProcessOpenAIChunk(int32 slot, const BString& line)
 {
 	if (!line.StartsWith("data: "))
 		return;
@@ -550,17 +1223,50 @@ LLMClient::_ProcessOpenAIChunk(const BString& line)
 	content.ReplaceAll("\\\\", "\\");
 
 	if (content.Length() > 0)
-		_SendChunk(content.String());
+		_DeliverChunk(slot, content.String());
 }
 
 
 void
-LLMClient::_ProcessClaudeChunk(const BString& line)
+LLMClient::_ProcessResponsesChunk(int32 slot, const BString& line)
+{
+	// Responses API events are typed; the event: lines repeat the type
+	if (!line.StartsWith("data: "))
+		return;
+
+	BString data = line;
+	data.Remove(0, 6);
+
+	BString type;
+	if (!FindJsonString(data, "type", type))
+		return;
+
+	if (type == "response.output_text.delta") {
+		BString text;
+		if (FindJsonString(data, "delta", text) && text.Length() > 0)
+			_DeliverChunk(slot, text.String());
+	} else if (type == "response.created") {
+		BString response;
+		if (FindJsonRaw(data, "response", response))
+			FindJsonString(response, "id", fSlots[slot].responseId);
+	} else if (type == "error" || type == "response.failed") {
+		BString error;
+		if (!FindJsonString(data, "message", error))
+			error = "The response failed";
+		if (data.FindFirst("previous_response") >= 0)
+			error.Append(" (previous_response)");
+		_FailStream(slot, error);
+	}
+}
+
+
+void
+LLMClient::_ProcessClaudeChunk(int32 slot, const BString& line)
 {
 	if (line.StartsWith("event: ")) {
 		BString event = line;
 		event.Remove(0, 7);
-		fEventType = event;
+		fSlots[slot].eventType = event;
 		return;
 	}
 
@@ -570,7 +1276,7 @@ LLMClient::_ProcessClaudeChunk(const BString& line)
 	BString data = line;
 	data.Remove(0, 6);
 
-	if (fEventType == "content_block_delta") {
+	if (fSlots[slot].eventType == "content_block_delta") {
 		int32 textPos = data.FindFirst("\"text\"");
 		if (textPos < 0)
 			return;
@@ -606,13 +1312,13 @@ LLMClient::_ProcessClaudeChunk(const BString& line)
 		content.ReplaceAll("\\\\", "\\");
 
 		if (content.Length() > 0)
-			_SendChunk(content.String());
+			_DeliverChunk(slot, content.String());
 	}
 }
 
 
 void
-LLMClient::_ProcessGeminiChunk(const BString& line)
+LLMClient::_ProcessGeminiChunk(int32 slot, const BString& line)
 {
 	// Gemini SSE format: data: {"candidates":[{"content":{"parts":[{"text":"..."}]}}]}
 	if (!line.StartsWith("data: "))
@@ -657,7 +1363,7 @@ LLMClient::_ProcessGeminiChunk(const BString& line)
 	content.ReplaceAll("\\\\", "\\");
 
 	if (content.Length() > 0)
-		_SendChunk(content.String());
+		_DeliverChunk(slot, content.String());
 }
 
 
@@ -776,6 +1482,45 @@ LLMClient::_ParseGeminiModels(const BString& json)
 }
 
 
+void
+LLMClient::_DeliverChunk(int32 slot, const char* text)
+{
+	// Called with fStreamLock held. The first stream to produce a delta
+	// wins the race and the other one is stopped.
+	StreamSlot& stream = fSlots[slot];
+	if (stream.firstTokenTime == 0) {
+		stream.firstTokenTime = system_time();
+		if (stream.route >= 0) {
+			fRouter.ReportFirstToken(stream.route,
+				stream.firstTokenTime - stream.startTime);
+		}
+	}
+
+	if (fWinner < 0) {
+		fWinner = slot;
+
+		bigtime_t ttft = system_time() - fSlots[kPrimarySlot].startTime;
+		_RecordTimeToFirstToken(ttft);
+
+		int32 other = kStreamSlotCount - 1 - slot;
+		if (fSlots[other].active) {
+			LOG("LLMClient - %s stream won after %.2fs, stopping the other",
+				slot == kHedgeSlot ? "Hedge" : "Primary", ttft / 1000000.0);
+			_StopSlot(other);
+		}
+
+		delete fHedgeRunner;
+		fHedgeRunner = NULL;
+	}
+
+	if (fWinner != slot)
+		return;
+
+	stream.bytes += strlen(text);
+	_SendChunk(text);
+}
+
+
 void
 LLMClient::_SendChunk(const char* text)
 {
@@ -795,9 +1540,16 @@ LLMClient::_SendError(const char* error)
 
 
 void
-LLMClient::_SendDone()
+LLMClient::_SendDone(int32 slot)
 {
 	BMessage msg(kMsgLLMDone);
+
+	// Let the caller continue the conversation from this response
+	const StreamSlot& stream = fSlots[slot];
+	if (!stream.failed && stream.responseId.Length() > 0) {
+		msg.AddString("response_id", stream.responseId.String());
+		msg.AddString("endpoint", stream.endpoint.String());
+	}
 	fTarget.SendMessage(&msg);
 }
 
@@ -3,7 +3,9 @@
 
 #include <DataIO.h>
 #include <Handler.h>
+#include <Locker.h>
 #include <Looper.h>
+#include <MessageRunner.h>
 #include <Messenger.h>
 #include <ObjectList.h>
 #include <String.h>
@@ -11,21 +13,36 @@
 #include <UrlRequest.h>
 
 #include "Constants.h"
+#include "EndpointRouter.h"
 
 using namespace BPrivate::Network;
 
 class LLMClient;
 
+// Stream slots - the primary request and an optional hedge request
+enum {
+	kPrimarySlot = 0,
+	kHedgeSlot = 1,
+	kStreamSlotCount = 2
+};
+
+// Number of time-to-first-token samples kept for the hedge percentile
+const int32 kTtftSampleCapacity = 64;
+// Number of recent requests the hedge budget is measured over
+const int32 kHedgeWindowSize = 50;
+
+
 // Custom output that forwards data to LLMClient as it arrives
 class StreamingOutput : public BDataIO {
 public:
-						StreamingOutput(LLMClient* client);
+						StreamingOutput(LLMClient* client, int32 slot);
 	virtual				~StreamingOutput();
 
 	virtual ssize_t		Write(const void* buffer, size_t size);
 
 private:
 	LLMClient*			fClient;
+	int32				fSlot;
 };
 
 
@@ -46,13 +63,14 @@ private:
 
 class LLMProtocolListener : public BUrlProtocolListener {
 public:
-						LLMProtocolListener(LLMClient* client);
+						LLMProtocolListener(LLMClient* client, int32 slot);
 	virtual				~LLMProtocolListener();
 
 	virtual void		RequestCompleted(BUrlRequest* caller, bool success);
 
 private:
 	LLMClient*			fClient;
+	int32				fSlot;
 };
 
 
@@ -68,6 +86,46 @@ private:
 };
 
 
+class ProbeProtocolListener : public BUrlProtocolListener {
+public:
+						ProbeProtocolListener(LLMClient* client);
+	virtual				~ProbeProtocolListener();
+
+	virtual void		RequestCompleted(BUrlRequest* caller, bool success);
+
+private:
+	LLMClient*			fClient;
+};
+
+
+// State of one in-flight streaming request
+struct StreamSlot {
+	BUrlRequest*		request;
+	StreamingOutput*	output;
+	LLMProtocolListener* listener;
+	ApiType				apiType;
+	BString				endpoint;
+	BString				apiKey;
+	BString				model;
+	BString				buffer;
+	BString				eventType;
+	bigtime_t			startTime;
+	bigtime_t			firstTokenTime;
+	int64				bytes;
+	int32				route;
+	bool				active;
+	bool				failed;
+
+	// Responses API state: the id this request continues from, the id the
+	// server assigned to it, and whether to resend the full history once
+	// the expired request has finished
+	bool				responsesApi;
+	BString				previousResponseId;
+	BString				responseId;
+	bool				retryFullHistory;
+};
+
+
 class LLMClient : public BLooper {
 public:
 						LLMClient(BMessenger target);
@@ -75,43 +133,120 @@ public:
 
 	virtual void		MessageReceived(BMessage* message);
 
-	void				SendChatRequest(const char* messagesJson,
+	// Fails without a kMsgLLMDone to follow the kMsgLLMError when the
+	// request could not be started
+	status_t			SendChatRequest(const char* messagesJson,
 							ApiType apiType, const char* endpoint,
 							const char* apiKey, const char* model);
 	void				FetchModels(ApiType apiType, const char* endpoint,
 							const char* apiKey);
 	void				Cancel();
 
-	void				HandleDataReceived(const char* data, ssize_t size);
-	void				HandleRequestCompleted(bool success);
+	// Hedged requests - race a backup when the first token is late
+	void				SetHedgeTarget(ApiType apiType, const char* endpoint,
+							const char* apiKey, const char* model);
+	void				ClearHedgeTarget();
+	void				SetHedgePolicy(float percentile, float maxRate);
+
+	// Latency-aware routing across mirrors of the same provider
+	void				SetRoutes(ApiType apiType, const char* apiKey,
+							const BObjectList<BString>& endpoints);
+
+	// Stateful OpenAI conversations - continue from a stored response and
+	// upload only the messages added since. Applies to the next request.
+	void				SetResponsesApi(bool enabled);
+	void				SetPreviousResponse(const char* responseId,
+							const char* endpoint,
+							const char* newMessagesJson);
+	void				ClearPreviousResponse();
+
+	void				HandleDataReceived(int32 slot, const char* data,
+							ssize_t size);
+	void				HandleRequestCompleted(int32 slot, bool success);
 	void				HandleModelsRequestCompleted(bool success);
+	void				HandleProbeCompleted(BUrlRequest* caller,
+							bool success);
 
 	CollectingOutput*	GetModelsOutput() { return fModelsOutput; }
 
 private:
-	void				_ProcessOpenAIChunk(const BString& line);
-	void				_ProcessClaudeChunk(const BString& line);
-	void				_ProcessGeminiChunk(const BString& line);
+	status_t			_StartRequest(int32 slot, const char* messagesJson,
+							ApiType apiType, const char* endpoint,
+							const char* apiKey, const char* model,
+							int32 route = -1, bool responsesApi = false,
+							const char* previousResponseId = NULL);
+	void				_StopSlot(int32 slot);
+	void				_FailStream(int32 slot, const BString& error);
+	void				_ReportRoute(int32 slot, bool success);
+	void				_StartProbe(int32 route);
+	void				_ScheduleHedge();
+	void				_FireHedge();
+	bool				_HedgeBudgetAvailable() const;
+	bigtime_t			_HedgeDelay() const;
+	void				_RecordTimeToFirstToken(bigtime_t ttft);
+	void				_RecordRequest(bool hedged);
+
+	void				_ProcessOpenAIChunk(int32 slot, const BString& line);
+	void				_ProcessClaudeChunk(int32 slot, const BString& line);
+	void				_ProcessGeminiChunk(int32 slot, const BString& line);
+	void				_ProcessResponsesChunk(int32 slot,
+							const BString& line);
 	void				_ParseOpenAIModels(const BString& json);
 	void				_ParseClaudeModels(const BString& json);
 	void				_ParseGeminiModels(const BString& json);
+	void				_DeliverChunk(int32 slot, const char* text);
 	void				_SendChunk(const char* text);
 	void				_SendError(const char* error);
-	void				_SendDone();
+	void				_SendDone(int32 slot);
 	void				_SendModels(const BObjectList<BString>& models);
 
 	BMessenger			fTarget;
-	BUrlRequest*		fRequest;
+	BLocker				fStreamLock;
+	StreamSlot			fSlots[kStreamSlotCount];
+	int32				fWinner;
+	uint32				fGeneration;
 	BUrlRequest*		fModelsRequest;
-	LLMProtocolListener* fListener;
 	ModelsProtocolListener* fModelsListener;
-	StreamingOutput*	fOutput;
 	CollectingOutput*	fModelsOutput;
 	ApiType				fCurrentApiType;
 	bool				fCancelled;
-	BString				fBuffer;
-	BString				fEventType;
-	BString				fGeminiBuffer;
+
+	// Hedge configuration
+	bool				fHedgeEnabled;
+	ApiType				fHedgeApiType;
+	BString				fHedgeEndpoint;
+	BString				fHedgeApiKey;
+	BString				fHedgeModel;
+	float				fHedgePercentile;
+	float				fHedgeMaxRate;
+	BString				fPendingMessagesJson;
+	BMessageRunner*		fHedgeRunner;
+
+	// Learned time-to-first-token and recent hedge history
+	bigtime_t			fTtftSamples[kTtftSampleCapacity];
+	int32				fTtftSampleCount;
+	int32				fTtftNext;
+	bool				fRecentHedged[kHedgeWindowSize];
+	int32				fRecentCount;
+	int32				fRecentNext;
+
+	// Endpoint routing and circuit breaker probes
+	EndpointRouter		fRouter;
+	ApiType				fRouteApiType;
+	BString				fRouteApiKey;
+	BUrlRequest*		fProbeRequest;
+	int32				fProbeRoute;
+	ProbeProtocolListener* fProbeListener;
+	CollectingOutput*	fProbeOutput;
+	BMessageRunner*		fProbeRunner;
+
+	// Responses API continuation and upload accounting
+	bool				fResponsesApi;
+	BString				fPreviousResponseId;
+	BString				fPreviousEndpoint;
+	BString				fNewMessagesJson;
+	int64				fBytesSent;
+	int64				fFullHistoryBytes;
 };
 
 #endif // LLM_CLIENT_H
@@ -8,9 +8,14 @@
 #include <SeparatorView.h>
 
 #include "Constants.h"
+#include "JsonUtils.h"
 #include "Log.h"
 #include "SettingsWindow.h"
 
+// Recently shown chats keep their layout for switching back
+static const int32 kMaxViewStates = 8;
+static const size_t kViewStateBudget = 1024 * 1024;
+
 MainWindow::MainWindow(Settings* settings)
 	:
 	BWindow(settings->GetWindowFrame(), "HaikuChat",
@@ -25,15 +30,20 @@ MainWindow::MainWindow(Settings* settings)
 	fMainView(NULL),
 	fChatScrollView(NULL),
 	fChatView(NULL),
+	fShownSession(NULL),
+	fViewStates(kMaxViewStates, kViewStateBudget),
 	fInputView(NULL),
 	fLLMClient(NULL),
 	fCurrentAssistantMessage(NULL),
-	fIsWaitingForResponse(false)
+	fIsWaitingForResponse(false),
+	fReplyMessageCount(0),
+	fCompactor(NULL)
 {
 	_BuildUI();
 
 	// Create LLM client
 	fLLMClient = new LLMClient(BMessenger(this));
+	fCompactor = new SessionCompactor(BMessenger(this));
 
 	// Load sessions into sidebar
 	_LoadSessions();
@@ -46,6 +56,10 @@ MainWindow::~MainWindow()
 		fLLMClient->Lock();
 		fLLMClient->Quit();
 	}
+	if (fCompactor != NULL) {
+		fCompactor->Lock();
+		fCompactor->Quit();
+	}
 }
 
 
@@ -89,6 +103,13 @@ MainWindow::_BuildUI()
 	fChatScrollView = new ChatScrollView(fChatView);
 	fChatScrollView->SetExplicitMinSize(BSize(200, 100));
 
+	// Shown while content arrives below a chat scrolled up to read
+	fNewContentButton = new BButton("New messages ↓",
+		new BMessage(kMsgScrollToBottom));
+	fNewContentButton->SetExplicitAlignment(
+		BAlignment(B_ALIGN_HORIZONTAL_CENTER, B_ALIGN_MIDDLE));
+	fNewContentButton->Hide();
+
 	fInputView = new InputView();
 	fInputView->SetExplicitMinSize(BSize(200, kInputMinHeight));
 	fInputView->SetExplicitPreferredSize(BSize(B_SIZE_UNSET, kInputMinHeight));
@@ -97,6 +118,7 @@ MainWindow::_BuildUI()
 	BGroupLayout* mainLayout = new BGroupLayout(B_VERTICAL, 0);
 	fMainView->SetLayout(mainLayout);
 	mainLayout->AddView(fChatScrollView, 1.0f);
+	mainLayout->AddView(fNewContentButton, 0.0f);
 	mainLayout->AddView(fInputView, 0.0f);
 
 	// === Split View (Sidebar + Main) ===
@@ -206,7 +228,7 @@ MainWindow::MessageReceived(BMessage* message)
 			if (message->FindString("text", &text) == B_OK) {
 				if (fCurrentAssistantMessage != NULL) {
 					fCurrentAssistantMessage->AppendContent(text);
-					fChatView->UpdateLastMessage();
+					fChatView->InvalidateLastMessage();
 				}
 			}
 			break;
@@ -214,13 +236,32 @@ MainWindow::MessageReceived(BMessage* message)
 
 		case kMsgLLMDone:
 		{
+			fChatView->FinishLastMessage();
 			fIsWaitingForResponse = false;
 			fInputView->SetEnabled(true);
 			fInputView->MakeFocus(true);
 
-			// Save session
-			ChatSession* session = fSettings->GetCurrentSession();
+			// The reply belongs to the chat it was sent from, which may
+			// have been deleted, cleared or switched away from since
+			ChatSession* session = _FindSession(fReplySessionId.String());
+			fReplySessionId = "";
 			if (session != NULL) {
+				// Remember the server-side state so the next turn only
+				// uploads what is new, if it still covers exactly the
+				// messages of the shown chat
+				bool intact = session == fSettings->GetCurrentSession()
+					&& session->CountMessages() == fReplyMessageCount;
+				const char* responseId;
+				if (intact && message->FindString("response_id",
+						&responseId) == B_OK) {
+					session->SetResponseState(responseId,
+						message->GetString("endpoint", ""),
+						fReplyMessageCount);
+				} else
+					session->ClearResponseState();
+
+				_MaybeCompact(session);
+
 				fSettings->SaveSession(session);
 				fSidebarView->UpdateSession(session);
 			}
@@ -262,12 +303,18 @@ MainWindow::MessageReceived(BMessage* message)
 					NULL, NULL, B_WIDTH_AS_USUAL, B_STOP_ALERT);
 				alert->Go();
 			}
+			fChatView->FinishLastMessage();
 			fIsWaitingForResponse = false;
+			fReplySessionId = "";
 			fInputView->SetEnabled(true);
 			fInputView->MakeFocus(true);
 			break;
 		}
 
+		case kMsgCompactionDone:
+			_ApplySummary(message);
+			break;
+
 		case kMsgInputChanged:
 			// Input height changed - just invalidate the main view layout
 			if (fMainView != NULL && fMainView->GetLayout() != NULL) {
@@ -279,6 +326,23 @@ MainWindow::MessageReceived(BMessage* message)
 			_RefreshTheme();
 			break;
 
+		case kMsgNewContent:
+		{
+			bool pending;
+			if (message->FindBool("pending", &pending) != B_OK)
+				break;
+			bool hidden = fNewContentButton->IsHidden(fNewContentButton);
+			if (pending && hidden)
+				fNewContentButton->Show();
+			else if (!pending && !hidden)
+				fNewContentButton->Hide();
+			break;
+		}
+
+		case kMsgScrollToBottom:
+			fChatView->ScrollToBottom();
+			break;
+
 		default:
 			BWindow::MessageReceived(message);
 			break;
@@ -322,6 +386,9 @@ MainWindow::_SendMessage()
 		fSidebarView->SelectSession(session);
 	}
 
+	// Sending brings the reader back to the end to follow the reply
+	fChatView->ScrollToBottom();
+
 	// Add user message
 	ChatMessage* userMsg = new ChatMessage(kRoleUser, text);
 	session->AddMessage(userMsg);
@@ -333,7 +400,11 @@ MainWindow::_SendMessage()
 	// Create placeholder for assistant response
 	fCurrentAssistantMessage = new ChatMessage(kRoleAssistant, "");
 	session->AddMessage(fCurrentAssistantMessage);
-	fChatView->AddMessage(fCurrentAssistantMessage);
+	fChatView->AddMessage(fCurrentAssistantMessage, true);
+
+	// Whatever chat is shown when the reply is done, its state is this one's
+	fReplySessionId = session->Id();
+	fReplyMessageCount = session->CountMessages();
 
 	// Disable input while waiting
 	fIsWaitingForResponse = true;
@@ -342,6 +413,47 @@ MainWindow::_SendMessage()
 	// Update sidebar with new title if needed
 	fSidebarView->UpdateSession(session);
 
+	// Route across the endpoint and its mirrors by latency and health
+	BObjectList<BString> routes(4, true);
+	routes.AddItem(new BString(fSettings->GetApiEndpoint()));
+	const BObjectList<BString>& mirrors
+		= fSettings->GetMirrorEndpoints(fSettings->GetApiType());
+	for (int32 i = 0; i < mirrors.CountItems(); i++)
+		routes.AddItem(new BString(*mirrors.ItemAt(i)));
+	fLLMClient->SetRoutes(fSettings->GetApiType(), fSettings->GetApiKey(),
+		routes);
+
+	// Race a backup provider if the first token is slow to arrive
+	if (fSettings->IsHedgingEnabled()) {
+		ApiType hedgeType = fSettings->GetHedgeApiType();
+		fLLMClient->SetHedgeTarget(hedgeType,
+			fSettings->GetApiEndpointFor(hedgeType),
+			fSettings->GetApiKeyFor(hedgeType),
+			fSettings->GetHedgeModel());
+		fLLMClient->SetHedgePolicy(fSettings->GetHedgePercentile(),
+			fSettings->GetHedgeMaxRate());
+	} else
+		fLLMClient->ClearHedgeTarget();
+
+	// Continue from the stored response when it came from an endpoint we
+	// still use, sending only the messages added since
+	bool responsesApi = fSettings->UsesResponsesApi()
+		&& fSettings->GetApiType() == kApiTypeOpenAI;
+	fLLMClient->SetResponsesApi(responsesApi);
+	fLLMClient->ClearPreviousResponse();
+	if (responsesApi && session->ResponseId()[0] != '\0'
+		&& session->ResponseMessageCount() < session->CountMessages()) {
+		for (int32 i = 0; i < routes.CountItems(); i++) {
+			if (*routes.ItemAt(i) == session->ResponseEndpoint()) {
+				fLLMClient->SetPreviousResponse(session->ResponseId(),
+					session->ResponseEndpoint(),
+					_BuildMessagesJson(session->ResponseMessageCount())
+						.String());
+				break;
+			}
+		}
+	}
+
 	// Build messages JSON and send request
 	BString messagesJson = _BuildMessagesJson();
 	fLLMClient->SendChatRequest(
@@ -379,6 +491,10 @@ MainWindow::_SelectChat(ChatSession* session)
 void
 MainWindow::_DeleteChat(ChatSession* session)
 {
+	fViewStates.Remove(session);
+	if (session == fShownSession)
+		fShownSession = NULL;
+
 	fSidebarView->RemoveSession(session);
 	fSettings->DeleteSession(session);
 
@@ -426,6 +542,11 @@ MainWindow::_ShowAbout()
 void
 MainWindow::_UpdateChatView()
 {
+	// Keep the layout of the chat going away for switching back to it
+	if (fShownSession != NULL)
+		fViewStates.Put(fShownSession, fChatView->SaveState());
+	fShownSession = NULL;
+
 	fChatView->ClearMessages();
 	fCurrentAssistantMessage = NULL;
 
@@ -434,12 +555,14 @@ MainWindow::_UpdateChatView()
 		return;
 
 	const BObjectList<ChatMessage>& messages = session->Messages();
-	for (int32 i = 0; i < messages.CountItems(); i++) {
+	fChatView->SetMessages(messages, fViewStates.Find(session));
+	fShownSession = session;
+	for (int32 i = messages.CountItems() - 1; i >= 0; i--) {
 		ChatMessage* msg = messages.ItemAt(i);
-		fChatView->AddMessage(msg);
-
-		if (msg->Role() == kRoleAssistant)
+		if (msg->Role() == kRoleAssistant) {
 			fCurrentAssistantMessage = msg;
+			break;
+		}
 	}
 
 	// Update title
@@ -448,7 +571,7 @@ MainWindow::_UpdateChatView()
 
 
 BString
-MainWindow::_BuildMessagesJson()
+MainWindow::_BuildMessagesJson(int32 from)
 {
 	BString json = "[";
 
@@ -456,8 +579,18 @@ MainWindow::_BuildMessagesJson()
 	if (session == NULL)
 		return "[]";
 
+	// Older messages folded into the summary are sent as that summary
+	if (from == 0 && session->SummarizedCount() > 0) {
+		BString summaryJson;
+		summaryJson.SetToFormat("{\"role\":\"system\",\"content\":\"%s\"}",
+			EscapeJson(BString("Summary of the earlier conversation:\n")
+				.Append(session->Summary()).String()).String());
+		json.Append(summaryJson);
+		from = session->SummarizedCount();
+	}
+
 	const BObjectList<ChatMessage>& messages = session->Messages();
-	for (int32 i = 0; i < messages.CountItems(); i++) {
+	for (int32 i = from; i < messages.CountItems(); i++) {
 		ChatMessage* msg = messages.ItemAt(i);
 
 		// Skip empty assistant messages (placeholders)
@@ -482,17 +615,9 @@ MainWindow::_BuildMessagesJson()
 				role = "user";
 		}
 
-		// Escape content for JSON
-		BString content = msg->Content();
-		content.ReplaceAll("\\", "\\\\");
-		content.ReplaceAll("\"", "\\\"");
-		content.ReplaceAll("\n", "\\n");
-		content.ReplaceAll("\r", "\\r");
-		content.ReplaceAll("\t", "\\t");
-
 		BString msgJson;
 		msgJson.SetToFormat("{\"role\":\"%s\",\"content\":\"%s\"}",
-			role, content.String());
+			role, EscapeJson(msg->Content()).String());
 		json.Append(msgJson);
 	}
 
@@ -501,6 +626,63 @@ MainWindow::_BuildMessagesJson()
 }
 
 
+void
+MainWindow::_MaybeCompact(ChatSession* session)
+{
+	if (!fSettings->IsCompactionEnabled())
+		return;
+
+	int32 cutoff = session->CompactionCutoff(
+		fSettings->GetCompactionThreshold(),
+		fSettings->GetCompactionKeepRecent());
+	if (cutoff < 0)
+		return;
+
+	const char* model = fSettings->GetCompactionModel();
+	if (model[0] == '\0')
+		model = fSettings->GetModel();
+
+	BString transcript = session->Transcript(session->SummarizedCount(),
+		cutoff);
+	if (fCompactor->Compact(session->Id(), cutoff, session->Summary(),
+			transcript.String(), fSettings->GetApiType(),
+			fSettings->GetApiEndpoint(), fSettings->GetApiKey(), model)) {
+		LOG("Compacting messages %d-%d of '%s'",
+			(int)session->SummarizedCount(), (int)cutoff, session->Title());
+	}
+}
+
+
+void
+MainWindow::_ApplySummary(BMessage* message)
+{
+	const char* id = message->GetString("session_id", "");
+	int32 count = message->GetInt32("count", 0);
+	const char* summary = message->GetString("summary", "");
+
+	// The chat may have been deleted, cleared or summarized further since
+	ChatSession* session = _FindSession(id);
+	if (session != NULL && count > session->SummarizedCount()
+		&& count <= session->CountMessages()) {
+		session->SetSummary(summary, count);
+		fSettings->SaveSession(session);
+	}
+}
+
+
+ChatSession*
+MainWindow::_FindSession(const char* id) const
+{
+	BObjectList<ChatSession>& sessions = fSettings->GetSessions();
+	for (int32 i = 0; i < sessions.CountItems(); i++) {
+		ChatSession* session = sessions.ItemAt(i);
+		if (strcmp(session->Id(), id) == 0)
+			return session;
+	}
+	return NULL;
+}
+
+
 void
 MainWindow::_RefreshTheme()
 {
@@ -518,8 +700,8 @@ MainWindow::_RefreshTheme()
 	// Refresh input view
 	fInputView->RefreshColors();
 
-	// Refresh chat - need to recreate bubbles with new colors
-	_UpdateChatView();
+	// Bubbles keep their text and layout, only the colors change
+	fChatView->RefreshColors();
 
 	// Force full window redraw
 	fTopBar->Invalidate();
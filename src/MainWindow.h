@@ -11,8 +11,10 @@
 #include "ChatView.h"
 #include "InputView.h"
 #include "LLMClient.h"
+#include "SessionCompactor.h"
 #include "Settings.h"
 #include "SidebarView.h"
+#include "ViewStateCache.h"
 
 class MainWindow : public BWindow {
 public:
@@ -34,7 +36,10 @@ private:
 	void				_ShowAbout();
 	void				_UpdateChatView();
 	void				_RefreshTheme();
-	BString				_BuildMessagesJson();
+	BString				_BuildMessagesJson(int32 from = 0);
+	void				_MaybeCompact(ChatSession* session);
+	void				_ApplySummary(BMessage* message);
+	ChatSession*		_FindSession(const char* id) const;
 
 	Settings*			fSettings;
 
@@ -50,12 +55,18 @@ private:
 	BView*				fMainView;
 	ChatScrollView*		fChatScrollView;
 	ChatView*			fChatView;
+	BButton*			fNewContentButton;
+	ChatSession*		fShownSession;
+	ViewStateCache		fViewStates;
 	InputView*			fInputView;
 
 	// LLM
 	LLMClient*			fLLMClient;
 	ChatMessage*		fCurrentAssistantMessage;
 	bool				fIsWaitingForResponse;
+	BString				fReplySessionId;	// chat the reply is for
+	int32				fReplyMessageCount;	// its messages with the reply
+	SessionCompactor*	fCompactor;
 };
 
 #endif // MAIN_WINDOW_H
@@ -0,0 +1,523 @@
+#include "MarkdownLexer.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const int32_t kNotFound = -1;
+
+// Scan steps between clock reads when a time limit is set
+static const uint32_t kTimeCheckInterval = 256;
+
+
+static inline bool
+IsSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
+static inline bool
+IsWordChar(char c)
+{
+	// Bytes of UTF-8 sequences count as letters
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')
+		|| (c >= 'A' && c <= 'Z') || (unsigned char)c >= 0x80;
+}
+
+
+static inline bool
+IsSpecial(char c)
+{
+	return c == '*' || c == '_' || c == '`' || c == '\n';
+}
+
+
+MarkdownLexer::MarkdownLexer()
+	:
+	fText(NULL),
+	fLength(0),
+	fLexedLength(0),
+	fRuns(NULL),
+	fTimeLimit(0),
+	fTimedOut(false),
+	fRunStart(0),
+	fRunFlags(kMarkdownPlain),
+	fRunLevel(0),
+	fBlockFlags(kMarkdownPlain),
+	fHeaderLevel(0),
+	fInlineFlags(kMarkdownPlain),
+	fBoldChar(0),
+	fItalicChar(0),
+	fParagraphEnd(0)
+{
+	for (int i = 0; i < kCloserKinds; i++) {
+		fSearchedFrom[i] = kNotFound;
+		fCloserAt[i] = kNotFound;
+	}
+	_SaveCheckpoint(0, true);
+}
+
+
+void
+MarkdownLexer::Lex(const char* text, int32_t length,
+	std::vector<MarkdownRun>& runs)
+{
+	runs.clear();
+	fRuns = &runs;
+	fRunStart = 0;
+	fRunFlags = kMarkdownPlain;
+	fRunLevel = 0;
+	_SaveCheckpoint(0, true);
+
+	fText = text;
+	fLength = length;
+	fBlockFlags = kMarkdownPlain;
+	fHeaderLevel = 0;
+	fParagraphEnd = 0;
+	_Scan(0, true);
+}
+
+
+void
+MarkdownLexer::LexAppended(const char* text, int32_t length,
+	std::vector<MarkdownRun>& runs)
+{
+	if (length < fLexedLength || runs.size() < fCheckpoint.runCount) {
+		Lex(text, length, runs);
+		return;
+	}
+
+	// Back to the state at the last block boundary. Inline state and the
+	// closer caches are rebuilt by the paragraph start there.
+	runs.resize(fCheckpoint.runCount);
+	fRuns = &runs;
+	fRunStart = fCheckpoint.runStart;
+	fRunFlags = fCheckpoint.runFlags;
+	fRunLevel = fCheckpoint.runLevel;
+
+	fText = text;
+	fLength = length;
+	fBlockFlags = kMarkdownPlain;
+	fHeaderLevel = 0;
+	fParagraphEnd = 0;
+
+	int32_t pos = fCheckpoint.offset;
+	if (!fCheckpoint.lineStart)
+		_StartParagraph(pos);
+	_Scan(pos, fCheckpoint.lineStart);
+}
+
+
+
+void
+MarkdownLexer::Reset()
+{
+	fRuns = NULL;
+	fRunStart = 0;
+	fRunFlags = kMarkdownPlain;
+	fRunLevel = 0;
+	fLexedLength = 0;
+	_SaveCheckpoint(0, true);
+}
+
+
+void
+MarkdownLexer::_Scan(int32_t pos, bool lineStart)
+{
+	const char* text = fText;
+	int32_t length = fLength;
+	uint32_t steps = 0;
+
+	fTimedOut = false;
+	if (fTimeLimit > 0) {
+		fDeadline = std::chrono::steady_clock::now()
+			+ std::chrono::microseconds(fTimeLimit);
+	}
+
+	while (pos < length) {
+		if (fTimeLimit > 0 && ++steps % kTimeCheckInterval == 0
+			&& _OutOfTime()) {
+			// Give up on styling the rest rather than stall the caller
+			_SetStyle(pos, kMarkdownPlain, 0);
+			break;
+		}
+
+		if (lineStart) {
+			// A line start past the paragraph end follows a blank line
+			if (pos >= fParagraphEnd && pos > 0)
+				_SaveCheckpoint(pos, true);
+			lineStart = false;
+			pos = _LineStart(pos);
+			continue;
+		}
+
+		pos = FindSpecial(text, pos, length);
+		if (pos >= length)
+			break;
+
+		switch (text[pos]) {
+			case '\n':
+				// Headers end with their line
+				if ((fBlockFlags & kMarkdownHeader) != 0) {
+					fBlockFlags = kMarkdownPlain;
+					fHeaderLevel = 0;
+					fInlineFlags = kMarkdownPlain;
+					_Restyle(pos);
+				}
+				pos++;
+				lineStart = true;
+				break;
+
+			case '`':
+				if (pos + 2 < length && text[pos + 1] == '`'
+					&& text[pos + 2] == '`') {
+					pos = _Fence(pos);
+				} else
+					pos = _InlineCode(pos);
+				break;
+
+			default:
+				pos = _Emphasis(pos);
+				break;
+		}
+	}
+
+	if (fRunStart < length) {
+		MarkdownRun run = { fRunStart, length - fRunStart, fRunFlags,
+			fRunLevel };
+		fRuns->push_back(run);
+	}
+	fRuns = NULL;
+	fLexedLength = length;
+}
+
+
+bool
+MarkdownLexer::_OutOfTime()
+{
+	fTimedOut = std::chrono::steady_clock::now() > fDeadline;
+	return fTimedOut;
+}
+
+
+void
+MarkdownLexer::_SaveCheckpoint(int32_t pos, bool lineStart)
+{
+	fCheckpoint.offset = pos;
+	fCheckpoint.lineStart = lineStart;
+	fCheckpoint.runCount = fRuns != NULL ? fRuns->size() : 0;
+	fCheckpoint.runStart = fRunStart;
+	fCheckpoint.runFlags = fRunFlags;
+	fCheckpoint.runLevel = fRunLevel;
+}
+
+
+int32_t
+MarkdownLexer::FindSpecial(const char* text, int32_t pos, int32_t end)
+{
+#if defined(__SSE2__)
+	const __m128i star = _mm_set1_epi8('*');
+	const __m128i underscore = _mm_set1_epi8('_');
+	const __m128i backtick = _mm_set1_epi8('`');
+	const __m128i newline = _mm_set1_epi8('\n');
+
+	while (pos + 16 <= end) {
+		__m128i chunk = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(text + pos));
+		__m128i hits = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, star),
+				_mm_cmpeq_epi8(chunk, underscore)),
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, backtick),
+				_mm_cmpeq_epi8(chunk, newline)));
+		int mask = _mm_movemask_epi8(hits);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#endif
+
+	return FindSpecialScalar(text, pos, end);
+}
+
+
+int32_t
+MarkdownLexer::FindSpecialScalar(const char* text, int32_t pos, int32_t end)
+{
+	while (pos < end && !IsSpecial(text[pos]))
+		pos++;
+	return pos;
+}
+
+
+int32_t
+MarkdownLexer::_LineStart(int32_t pos)
+{
+	if (pos >= fParagraphEnd)
+		_StartParagraph(pos);
+
+	// Headers: up to six # followed by a space
+	int32_t hashes = 0;
+	while (pos + hashes < fLength && fText[pos + hashes] == '#' && hashes < 6)
+		hashes++;
+	if (hashes > 0 && pos + hashes < fLength && fText[pos + hashes] == ' ') {
+		fInlineFlags = kMarkdownPlain;
+		fBlockFlags = kMarkdownHeader;
+		fHeaderLevel = static_cast<uint8_t>(hashes);
+		_SetStyle(pos, kMarkdownHeader | kMarkdownMarker, fHeaderLevel);
+		_Restyle(pos + hashes + 1);
+		return pos + hashes + 1;
+	}
+
+	// Bullets: - or * followed by a space
+	if ((fText[pos] == '-' || fText[pos] == '*') && pos + 1 < fLength
+		&& fText[pos + 1] == ' ') {
+		_SetStyle(pos, kMarkdownBullet, 0);
+		_Restyle(pos + 1);
+		return pos + 1;
+	}
+
+	return pos;
+}
+
+
+int32_t
+MarkdownLexer::_Fence(int32_t pos)
+{
+	// The rest of the opening line is the language name
+	const char* close = NULL;
+	for (int32_t i = pos + 3; i + 2 < fLength; i++) {
+		const char* tick = static_cast<const char*>(
+			memchr(fText + i, '`', fLength - i - 2));
+		if (tick == NULL)
+			break;
+		if (tick[1] == '`' && tick[2] == '`') {
+			close = tick;
+			break;
+		}
+		i = tick - fText;
+	}
+	int32_t closePos = close != NULL ? close - fText : kNotFound;
+
+	int32_t contentStart = pos + 3;
+	const char* newline = static_cast<const char*>(
+		memchr(fText + contentStart, '\n', fLength - contentStart));
+	if (newline != NULL && (closePos < 0 || newline - fText < closePos))
+		contentStart = newline - fText + 1;
+
+	fBlockFlags = kMarkdownPlain;
+	fHeaderLevel = 0;
+	fInlineFlags = kMarkdownPlain;
+	_SetStyle(pos, kMarkdownCodeBlock | kMarkdownMarker, 0);
+
+	if (closePos < 0) {
+		// Still streaming - the block runs to the end
+		if (newline != NULL)
+			_SetStyle(contentStart, kMarkdownCodeBlock, 0);
+		return fLength;
+	}
+
+	_SetStyle(contentStart, kMarkdownCodeBlock, 0);
+	_SetStyle(closePos, kMarkdownCodeBlock | kMarkdownMarker, 0);
+	_StartParagraph(closePos + 3);
+
+	// A closed fence cannot change as more text arrives
+	_SaveCheckpoint(closePos + 3, false);
+	return closePos + 3;
+}
+
+
+int32_t
+MarkdownLexer::_Emphasis(int32_t pos)
+{
+	char marker = fText[pos];
+	int32_t count = 1;
+	while (pos + count < fLength && fText[pos + count] == marker)
+		count++;
+
+	// *** and longer stay literal
+	if (count > 2)
+		return pos + count;
+
+	bool bold = count == 2;
+	uint16_t flag = bold ? kMarkdownBold : kMarkdownItalic;
+	char& openChar = bold ? fBoldChar : fItalicChar;
+	int kind = bold
+		? (marker == '*' ? kCloserBoldStar : kCloserBoldUnderscore)
+		: (marker == '*' ? kCloserItalicStar : kCloserItalicUnderscore);
+
+	if ((fInlineFlags & flag) != 0) {
+		if (openChar == marker && _IsCloser(kind, pos)) {
+			_SetStyle(pos, fBlockFlags | fInlineFlags | kMarkdownMarker,
+				fHeaderLevel);
+			fInlineFlags &= ~flag;
+			_Restyle(pos + count);
+		}
+		return pos + count;
+	}
+
+	// Openers need text right after them, and _ must not sit inside a word
+	int32_t next = pos + count;
+	if (next >= fLength || IsSpace(fText[next]))
+		return next;
+	if (marker == '_' && pos > 0 && IsWordChar(fText[pos - 1]))
+		return next;
+
+	if (_FindCloser(kind, next) == kNotFound)
+		return next;
+
+	_SetStyle(pos, fBlockFlags | fInlineFlags | kMarkdownMarker, fHeaderLevel);
+	fInlineFlags |= flag;
+	openChar = marker;
+	_Restyle(next);
+	return next;
+}
+
+
+int32_t
+MarkdownLexer::_InlineCode(int32_t pos)
+{
+	// `` and other multi-backtick spans are left as text
+	if (pos + 1 < fLength && fText[pos + 1] == '`')
+		return pos + 2;
+
+	int32_t closer = _FindCloser(kCloserCode, pos + 1);
+	if (closer == kNotFound)
+		return pos + 1;
+
+	_SetStyle(pos, fBlockFlags | fInlineFlags | kMarkdownCode, fHeaderLevel);
+	_Restyle(closer + 1);
+	return closer + 1;
+}
+
+
+int32_t
+MarkdownLexer::_FindCloser(int kind, int32_t from)
+{
+	// The last answer stays valid for any later start up to the closer it
+	// found, so each byte is examined at most once per kind
+	int32_t searched = fSearchedFrom[kind];
+	if (searched != kNotFound && searched <= from) {
+		if (fCloserAt[kind] == kNotFound || fCloserAt[kind] >= from)
+			return fCloserAt[kind];
+	}
+
+	char target = kind == kCloserCode ? '`'
+		: (kind == kCloserItalicStar || kind == kCloserBoldStar) ? '*' : '_';
+
+	int32_t found = kNotFound;
+	int32_t i = from;
+	while (i < fParagraphEnd) {
+		const char* hit = static_cast<const char*>(
+			memchr(fText + i, target, fParagraphEnd - i));
+		if (hit == NULL)
+			break;
+		i = hit - fText;
+		if (_IsCloser(kind, i)) {
+			found = i;
+			break;
+		}
+		i++;
+	}
+
+	fSearchedFrom[kind] = from;
+	fCloserAt[kind] = found;
+	return found;
+}
+
+
+bool
+MarkdownLexer::_IsCloser(int kind, int32_t pos) const
+{
+	char c = fText[pos];
+	char previous = pos > 0 ? fText[pos - 1] : '\n';
+
+	if (kind == kCloserCode) {
+		return c == '`' && previous != '`'
+			&& (pos + 1 >= fLength || fText[pos + 1] != '`');
+	}
+
+	int32_t count = (kind == kCloserBoldStar
+		|| kind == kCloserBoldUnderscore) ? 2 : 1;
+	for (int32_t i = 1; i < count; i++) {
+		if (pos + i >= fLength || fText[pos + i] != c)
+			return false;
+	}
+
+	// Exactly count markers, with text right before them
+	if (previous == c || IsSpace(previous))
+		return false;
+	char after = pos + count < fLength ? fText[pos + count] : '\n';
+	if (after == c)
+		return false;
+	if (c == '_' && IsWordChar(after))
+		return false;
+	return true;
+}
+
+
+void
+MarkdownLexer::_StartParagraph(int32_t pos)
+{
+	// Inline spans never cross a blank line or a code fence
+	int32_t end = pos;
+	while (true) {
+		end = FindSpecial(fText, end, fLength);
+		if (end >= fLength)
+			break;
+		if (fText[end] == '\n' && end + 1 < fLength && fText[end + 1] == '\n') {
+			end++;
+			break;
+		}
+		if (fText[end] == '`' && end + 2 < fLength && fText[end + 1] == '`'
+			&& fText[end + 2] == '`') {
+			break;
+		}
+		end++;
+	}
+	fParagraphEnd = end;
+
+	fInlineFlags = kMarkdownPlain;
+	fBoldChar = 0;
+	fItalicChar = 0;
+	for (int i = 0; i < kCloserKinds; i++) {
+		fSearchedFrom[i] = kNotFound;
+		fCloserAt[i] = kNotFound;
+	}
+	_Restyle(pos);
+}
+
+
+void
+MarkdownLexer::_SetStyle(int32_t pos, uint16_t flags, uint8_t level)
+{
+	if (flags == fRunFlags && level == fRunLevel)
+		return;
+
+	if (pos > fRunStart) {
+		MarkdownRun run = { fRunStart, pos - fRunStart, fRunFlags, fRunLevel };
+		fRuns->push_back(run);
+		fRunStart = pos;
+	} else if (fRuns->size() > fCheckpoint.runCount) {
+		// An empty run; rejoin the previous one if it has this style. Runs
+		// before the checkpoint stay put so lexing can resume there.
+		MarkdownRun& last = fRuns->back();
+		if (last.flags == flags && last.level == level
+			&& last.offset + last.length == pos) {
+			fRunStart = last.offset;
+			fRuns->pop_back();
+		}
+	}
+
+	fRunFlags = flags;
+	fRunLevel = level;
+}
+
+
+void
+MarkdownLexer::_Restyle(int32_t pos)
+{
+	_SetStyle(pos, fBlockFlags | fInlineFlags, fHeaderLevel);
+}
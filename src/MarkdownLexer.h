@@ -0,0 +1,143 @@
+#ifndef MARKDOWN_LEXER_H
+#define MARKDOWN_LEXER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+// Portable single-pass markdown tokenizer. It has no Haiku dependencies so
+// it can be built and benchmarked anywhere (see bench/).
+//
+// Lexing is O(n) in the worst case: every branch advances, block scans
+// never overlap, and closer lookups are memoized per delimiter kind so a
+// byte is searched at most once per kind within a paragraph. The
+// pathological corpus in bench/ keeps that honest.
+
+enum {
+	kMarkdownPlain		= 0,
+	kMarkdownBold		= 1 << 0,
+	kMarkdownItalic		= 1 << 1,
+	kMarkdownCode		= 1 << 2,	// inline `code`
+	kMarkdownCodeBlock	= 1 << 3,	// fenced ``` block
+	kMarkdownMarker		= 1 << 4,	// syntax characters, drawn dimmed
+	kMarkdownHeader		= 1 << 5,	// level in MarkdownRun::level
+	kMarkdownBullet		= 1 << 6
+};
+
+
+// Bumped whenever Lex() output changes, so persisted runs get redone
+static const int32_t kMarkdownRunFormat = 1;
+
+
+// A stretch of text with one combination of style flags
+struct MarkdownRun {
+	int32_t				offset;
+	int32_t				length;
+	uint16_t			flags;
+	uint8_t				level;		// header level 1-6, else 0
+};
+
+
+class MarkdownLexer {
+public:
+						MarkdownLexer();
+
+	// Replaces runs with an ordered list of non-overlapping runs covering
+	// all of text, in one forward scan
+	void				Lex(const char* text, int32_t length,
+							std::vector<MarkdownRun>& runs);
+
+	// Lexes text that extends the text of the previous call, as during
+	// streaming. Only the part from StableOffset() on is lexed again; runs
+	// before StableRunCount() are kept. Same result as Lex().
+	void				LexAppended(const char* text, int32_t length,
+							std::vector<MarkdownRun>& runs);
+
+	// Forgets the previous text, so the next LexAppended() lexes it all
+	void				Reset();
+
+	// Caps the time a single Lex() or LexAppended() may take; text past
+	// the limit comes out as one plain run. Zero means no limit.
+	void				SetTimeLimit(int64_t microseconds)
+							{ fTimeLimit = microseconds; }
+	bool				TimedOut() const { return fTimedOut; }
+
+	// Start of the first run that may still change: everything before the
+	// last closed paragraph or code fence is final
+	int32_t				StableOffset() const
+							{ return fCheckpoint.runStart; }
+	size_t				StableRunCount() const
+							{ return fCheckpoint.runCount; }
+
+	// Returns the first index in [pos, end) holding one of * _ ` or a
+	// newline, or end. Vectorized when SSE2 is available.
+	static int32_t		FindSpecial(const char* text, int32_t pos,
+							int32_t end);
+	static int32_t		FindSpecialScalar(const char* text, int32_t pos,
+							int32_t end);
+
+private:
+	enum {
+		kCloserItalicStar = 0,
+		kCloserItalicUnderscore,
+		kCloserBoldStar,
+		kCloserBoldUnderscore,
+		kCloserCode,
+		kCloserKinds
+	};
+
+	// Lexer state at a block boundary, enough to resume lexing there
+	struct Checkpoint {
+		int32_t			offset;
+		bool			lineStart;
+		size_t			runCount;
+		int32_t			runStart;
+		uint16_t		runFlags;
+		uint8_t			runLevel;
+	};
+
+	void				_Scan(int32_t pos, bool lineStart);
+	bool				_OutOfTime();
+	void				_SaveCheckpoint(int32_t pos, bool lineStart);
+	int32_t				_LineStart(int32_t pos);
+	int32_t				_Fence(int32_t pos);
+	int32_t				_Emphasis(int32_t pos);
+	int32_t				_InlineCode(int32_t pos);
+	int32_t				_FindCloser(int kind, int32_t from);
+	bool				_IsCloser(int kind, int32_t pos) const;
+	void				_StartParagraph(int32_t pos);
+	void				_SetStyle(int32_t pos, uint16_t flags,
+							uint8_t level);
+	void				_Restyle(int32_t pos);
+
+	const char*			fText;
+	int32_t				fLength;
+	int32_t				fLexedLength;
+	Checkpoint			fCheckpoint;
+	std::vector<MarkdownRun>* fRuns;
+
+	int64_t				fTimeLimit;
+	std::chrono::steady_clock::time_point fDeadline;
+	bool				fTimedOut;
+
+	// Pending run
+	int32_t				fRunStart;
+	uint16_t			fRunFlags;
+	uint8_t				fRunLevel;
+
+	// Block and inline state
+	uint16_t			fBlockFlags;
+	uint8_t				fHeaderLevel;
+	uint16_t			fInlineFlags;
+	char				fBoldChar;
+	char				fItalicChar;
+
+	// Closer lookups never rescan text: each kind remembers where it last
+	// searched and what it found, up to the end of the paragraph
+	int32_t				fParagraphEnd;
+	int32_t				fSearchedFrom[kCloserKinds];
+	int32_t				fCloserAt[kCloserKinds];
+};
+
+#endif // MARKDOWN_LEXER_H
@@ -0,0 +1,126 @@
+#include "MarkdownPool.h"
+
+#include <Autolock.h>
+#include <Message.h>
+
+#include "Constants.h"
+#include "Log.h"
+
+// Workers are not on the window thread, so they can afford more time
+// than the in-place limit before giving up on a message
+static const int64 kWorkerTimeLimit = 500000;
+
+
+MarkdownPool::MarkdownPool()
+	:
+	fLock("MarkdownPool"),
+	fJobs(20, true),
+	fThreadCount(0),
+	fQuitting(false)
+{
+	fJobSem = create_sem(0, "markdown jobs");
+
+	// Leave a core for the window thread
+	system_info info;
+	int32 count = 1;
+	if (get_system_info(&info) == B_OK && info.cpu_count > 2)
+		count = info.cpu_count - 1;
+	if (count > 4)
+		count = 4;
+
+	for (int32 i = 0; i < count; i++) {
+		thread_id thread = spawn_thread(_WorkerEntry, "markdown worker",
+			B_NORMAL_PRIORITY - 2, this);
+		if (thread < B_OK)
+			break;
+		fThreads[fThreadCount++] = thread;
+		resume_thread(thread);
+	}
+	LOG_DEBUG("MarkdownPool - %ld workers", (long)fThreadCount);
+}
+
+
+MarkdownPool::~MarkdownPool()
+{
+	fLock.Lock();
+	fQuitting = true;
+	fLock.Unlock();
+
+	// Deleting the semaphore wakes every worker
+	delete_sem(fJobSem);
+	for (int32 i = 0; i < fThreadCount; i++) {
+		status_t result;
+		wait_for_thread(fThreads[i], &result);
+	}
+}
+
+
+void
+MarkdownPool::Submit(MarkdownJob* job)
+{
+	if (fThreadCount == 0) {
+		delete job;
+		return;
+	}
+
+	BAutolock lock(fLock);
+	int32 index = fJobs.CountItems();
+	while (index > 0 && fJobs.ItemAt(index - 1)->priority > job->priority)
+		index--;
+	fJobs.AddItem(job, index);
+	release_sem(fJobSem);
+}
+
+
+void
+MarkdownPool::CancelAll()
+{
+	BAutolock lock(fLock);
+	fJobs.MakeEmpty();
+}
+
+
+status_t
+MarkdownPool::_WorkerEntry(void* data)
+{
+	static_cast<MarkdownPool*>(data)->_Work();
+	return B_OK;
+}
+
+
+void
+MarkdownPool::_Work()
+{
+	MarkdownLexer lexer;
+	lexer.SetTimeLimit(kWorkerTimeLimit);
+	CodeHighlighter highlighter;
+
+	while (acquire_sem(fJobSem) == B_OK) {
+		MarkdownJob* job;
+		{
+			BAutolock lock(fLock);
+			if (fQuitting)
+				break;
+			job = fJobs.RemoveItemAt(0);
+		}
+		if (job == NULL)
+			continue;
+
+		const char* text = job->text.String();
+		int32 length = job->text.Length();
+		job->timedOut = false;
+		if (!job->cached) {
+			lexer.Lex(text, length, job->runs);
+			job->timedOut = lexer.TimedOut();
+		}
+
+		// Code block offsets are per message
+		highlighter.Clear();
+		BuildStyleSpans(text, job->runs, 0, highlighter, job->spans);
+
+		BMessage message(kMsgMarkdownReady);
+		message.AddPointer("job", job);
+		if (job->target.SendMessage(&message) != B_OK)
+			delete job;
+	}
+}
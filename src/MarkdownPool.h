@@ -0,0 +1,56 @@
+#ifndef MARKDOWN_POOL_H
+#define MARKDOWN_POOL_H
+
+#include <Locker.h>
+#include <Messenger.h>
+#include <ObjectList.h>
+#include <OS.h>
+#include <String.h>
+
+#include <vector>
+
+#include "MarkdownStyle.h"
+
+class ChatMessage;
+
+// A message's text to style, and the styles once a worker is done
+struct MarkdownJob {
+	BMessenger			target;
+	ChatMessage*		message;	// identity only, not used by workers
+	uint32				version;
+	uint32				generation;
+	int32				index;		// in the session, not the shown rows
+	int32				priority;	// lower goes first
+	BString				text;
+
+	bool				cached;		// runs came from the message
+	bool				timedOut;
+	std::vector<MarkdownRun> runs;
+	std::vector<StyleSpan> spans;
+};
+
+
+// Worker threads that lex and style messages off the window thread.
+// Finished jobs are sent to their target as kMsgMarkdownReady with the
+// job pointer in "job"; the receiver deletes it.
+class MarkdownPool {
+public:
+						MarkdownPool();
+						~MarkdownPool();
+
+	void				Submit(MarkdownJob* job);
+	void				CancelAll();
+
+private:
+	static status_t		_WorkerEntry(void* data);
+	void				_Work();
+
+	BLocker				fLock;
+	sem_id				fJobSem;
+	BObjectList<MarkdownJob> fJobs;		// by priority, then age
+	thread_id			fThreads[4];
+	int32				fThreadCount;
+	bool				fQuitting;
+};
+
+#endif // MARKDOWN_POOL_H
@@ -0,0 +1,97 @@
+#include "MarkdownStyle.h"
+
+#include <string.h>
+
+
+static void
+AddSpan(std::vector<StyleSpan>& spans, int32_t offset, int32_t style)
+{
+	// A later span at the same offset replaces the earlier one
+	if (!spans.empty() && spans.back().offset == offset) {
+		spans.back().style = style;
+		if (spans.size() > 1 && spans[spans.size() - 2].style == style)
+			spans.pop_back();
+		return;
+	}
+	if (!spans.empty() && spans.back().style == style)
+		return;
+
+	StyleSpan span;
+	span.offset = offset;
+	span.style = style;
+	spans.push_back(span);
+}
+
+
+int32_t
+StyleForRun(const MarkdownRun& run)
+{
+	uint16_t flags = run.flags;
+	bool italic = (flags & kMarkdownItalic) != 0;
+
+	if ((flags & kMarkdownBullet) != 0)
+		return kStyleBullet;
+	if ((flags & (kMarkdownCode | kMarkdownCodeBlock)) != 0)
+		return (flags & kMarkdownMarker) != 0 ? kStyleCodeMarker : kStyleCode;
+	if ((flags & kMarkdownMarker) != 0)
+		return kStyleMarker;
+	if ((flags & kMarkdownHeader) != 0 && run.level >= 1 && run.level <= 6)
+		return kStyleHeader + (run.level - 1) * 2 + (italic ? 1 : 0);
+	if ((flags & kMarkdownBold) != 0)
+		return italic ? kStyleBoldItalic : kStyleBold;
+	if (italic)
+		return kStyleItalic;
+	return kStylePlain;
+}
+
+
+const CodeLanguage*
+FenceLanguage(const char* text, int32_t contentStart)
+{
+	// The tag follows the backticks on the line before the code
+	int32_t lineEnd = contentStart - 1;
+	int32_t lineStart = lineEnd;
+	while (lineStart > 0 && text[lineStart - 1] != '\n')
+		lineStart--;
+
+	const char* fence = strstr(text + lineStart, "```");
+	if (fence == NULL || fence - text >= lineEnd)
+		return NULL;
+
+	const char* tag = fence;
+	while (*tag == '`' || *tag == ' ' || *tag == '\t')
+		tag++;
+	const char* tagEnd = tag;
+	while (tagEnd < text + lineEnd && *tagEnd != ' ' && *tagEnd != '\t'
+		&& *tagEnd != '\r' && *tagEnd != '{')
+		tagEnd++;
+
+	return CodeHighlighter::FindLanguage(tag, tagEnd - tag);
+}
+
+
+void
+BuildStyleSpans(const char* text, const std::vector<MarkdownRun>& runs,
+	size_t firstRun, CodeHighlighter& highlighter,
+	std::vector<StyleSpan>& spans)
+{
+	spans.clear();
+	for (size_t i = firstRun; i < runs.size(); i++) {
+		const MarkdownRun& run = runs[i];
+		AddSpan(spans, run.offset, StyleForRun(run));
+		if (run.flags != kMarkdownCodeBlock)
+			continue;
+
+		// Splice in the highlighted tokens of code block content
+		const CodeLanguage* language = FenceLanguage(text, run.offset);
+		const std::vector<CodeToken>& tokens = highlighter.Highlight(
+			run.offset, language, text + run.offset, run.length);
+		for (size_t j = 0; j < tokens.size(); j++) {
+			const CodeToken& token = tokens[j];
+			AddSpan(spans, run.offset + token.offset,
+				kStyleSyntax + token.kind - 1);
+			AddSpan(spans, run.offset + token.offset + token.length,
+				kStyleCode);
+		}
+	}
+}
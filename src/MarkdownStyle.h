@@ -0,0 +1,49 @@
+#ifndef MARKDOWN_STYLE_H
+#define MARKDOWN_STYLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "CodeHighlighter.h"
+#include "MarkdownLexer.h"
+
+// Maps lexer runs and code tokens to the styles a bubble draws with. The
+// style numbers index a palette of fonts and colors, so spans can be built
+// off the window thread and reused when the theme changes.
+
+enum {
+	kStylePlain = 0,
+	kStyleMarker,
+	kStyleBold,
+	kStyleItalic,
+	kStyleBoldItalic,
+	kStyleCode,
+	kStyleCodeMarker,
+	kStyleBullet,
+	kStyleHeader,		// two per level, plain and italic
+	kStyleSyntax = kStyleHeader + 12,	// one per code token kind
+	kStyleCount = kStyleSyntax + kCodeTokenKinds - 1
+};
+
+
+// Style from offset up to the next span
+struct StyleSpan {
+	int32_t				offset;
+	int32_t				style;
+};
+
+
+int32_t					StyleForRun(const MarkdownRun& run);
+
+// Language named on the fence line before a code block's content
+const CodeLanguage*		FenceLanguage(const char* text, int32_t contentStart);
+
+// Replaces spans with the styles of runs from firstRun on, code blocks
+// highlighted. Neighbours with the same style are merged.
+void					BuildStyleSpans(const char* text,
+							const std::vector<MarkdownRun>& runs,
+							size_t firstRun, CodeHighlighter& highlighter,
+							std::vector<StyleSpan>& spans);
+
+#endif // MARKDOWN_STYLE_H
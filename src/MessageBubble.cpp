@@ -1,123 +1,313 @@
 #include "MessageBubble.h"
 
+#include <Clipboard.h>
 #include <LayoutUtils.h>
+#include <OS.h>
 #include <String.h>
+#include <Window.h>
+
+#include <string.h>
 
 #include "Constants.h"
+#include "Log.h"
+#include "MarkdownPool.h"
 
-MessageBubble::MessageBubble(ChatMessage* message)
-	:
-	BView("MessageBubble", B_WILL_DRAW | B_FRAME_EVENTS),
-	fMessage(message),
-	fTextView(NULL),
-	fMaxWidth(400.0f)
-{
-	fIsUser = (message->Role() == kRoleUser);
-	fBubbleColor = fIsUser ? kUserBubbleColor : kAssistantBubbleColor;
-	fTextColor = fIsUser ? kUserTextColor : kAssistantTextColor;
+// Hard cap on lexing one update; past it the rest of the text stays plain
+static const bigtime_t kMarkdownTimeLimit = 50000;
 
-	// Code styling colors
-	fCodeColor = fTextColor;
-	if (IsDarkTheme()) {
-		fCodeBgColor = (rgb_color){60, 60, 60, 255};
-	} else {
-		fCodeBgColor = (rgb_color){240, 240, 240, 255};
+static const int32 kWrapWidthStep = 4;
+
+// Taller bubbles are drawn live rather than kept as bitmaps
+static const float kMaxBitmapHeight = 4096;
+
+// Messages past either limit are collapsed to a preview of their first
+// and last lines, each end also capped in bytes
+static const int32 kPreviewBytes = 64 * 1024;
+static const int32 kPreviewLines = 400;
+static const int32 kPreviewHeadLines = 40;
+static const int32 kPreviewTailLines = 10;
+static const int32 kPreviewEndBytes = 4096;
+
+
+// Whether a code fence is open at offset, pairing the fences before it
+// as the lexer does. Sets opener to the last fence's backticks.
+static bool
+FenceOpenAt(const char* text, int32 offset, int32* opener)
+{
+	bool open = false;
+	for (int32 i = 0; i + 2 < offset;) {
+		const char* tick = static_cast<const char*>(
+			memchr(text + i, '`', offset - 2 - i));
+		if (tick == NULL)
+			break;
+		int32 position = tick - text;
+		if (tick[1] == '`' && tick[2] == '`') {
+			open = !open;
+			*opener = position;
+			i = position + 3;
+		} else
+			i = position + 1;
 	}
+	return open;
+}
 
-	// Initialize fonts
-	fPlainFont = *be_plain_font;
-	fBoldFont = *be_bold_font;
-	fItalicFont = *be_plain_font;
-	fItalicFont.SetFace(B_ITALIC_FACE);
-	fCodeFont = *be_fixed_font;
-	fCodeFont.SetSize(fPlainFont.Size() - 1);
 
+MessageBubble::MessageBubble(ChatMessage* message, bool styleLater)
+	:
+	BView("MessageBubble", B_WILL_DRAW | B_FRAME_EVENTS),
+	fMessage(NULL),
+	fMaxWidth(400.0f),
+	fFontKey(0),
+	fStylePending(false),
+	fTextHeight(0),
+	fLineWidth(0),
+	fMeasured(false),
+	fBitmapCache(NULL),
+	fBitmap(NULL),
+	fStreaming(false),
+	fLive(false),
+	fCachePending(false),
+	fSelectionAnchor(0),
+	fSelecting(false),
+	fCollapsed(false),
+	fNoticeStart(0),
+	fNoticeEnd(0),
+	fRuns(NULL)
+{
+	fLexer.SetTimeLimit(kMarkdownTimeLimit);
 	SetViewColor(B_TRANSPARENT_COLOR);
+	fText.SetStyles(&fSpans, fPalette);
 
-	// Create text view for content
-	BRect textRect(0, 0, fMaxWidth - 2 * kBubblePadding, 100);
-	fTextView = new BTextView(textRect, "content", textRect,
-		B_FOLLOW_NONE, B_WILL_DRAW);
-	fTextView->SetViewColor(fBubbleColor);
-	fTextView->MakeEditable(false);
-	fTextView->MakeSelectable(true);
-	fTextView->SetWordWrap(true);
-	fTextView->SetStylable(true);
+	SetMessage(message, styleLater);
+}
 
-	// Set text and apply formatting
-	fTextView->SetText(message->Content());
-	_ApplyMarkdown();
 
-	AddChild(fTextView);
+MessageBubble::~MessageBubble()
+{
+	_ReleaseBitmap();
 }
 
 
-MessageBubble::~MessageBubble()
+void
+MessageBubble::AttachedToWindow()
 {
+	BView::AttachedToWindow();
+	fCachePending = false;
+	_InvalidateBitmap();
+}
+
+
+void
+MessageBubble::DetachedFromWindow()
+{
+	// Let the cache evict the bitmap while the bubble waits for reuse
+	_ReleaseBitmap();
+	BView::DetachedFromWindow();
 }
 
 
 void
 MessageBubble::Draw(BRect updateRect)
 {
-	BRect bounds = Bounds();
+	if (fBitmap != NULL) {
+		DrawBitmap(fBitmap, BPoint(0, 0));
+		return;
+	}
+	_DrawBubble(this, updateRect);
+}
+
 
+void
+MessageBubble::_DrawBubble(BView* target, BRect updateRect)
+{
 	// First, clear entire bounds with chat background color
-	SetHighColor(kBackgroundColor);
-	FillRect(bounds);
+	target->SetHighColor(kBackgroundColor);
+	target->FillRect(Bounds());
 
-	float textWidth, textHeight;
-	GetPreferredSize(&textWidth, &textHeight);
+	// Draw rounded rectangle background for bubble
+	target->SetHighColor(fBubbleColor);
+	target->FillRoundRect(fBubbleRect, kBubbleRadius, kBubbleRadius);
 
-	// Calculate bubble rect
-	BRect bubbleRect;
-	if (fIsUser) {
-		bubbleRect = BRect(bounds.right - textWidth - 2 * kBubblePadding,
-			0, bounds.right, textHeight + 2 * kBubblePadding);
-	} else {
-		bubbleRect = BRect(0, 0, textWidth + 2 * kBubblePadding,
-			textHeight + 2 * kBubblePadding);
+	target->SetLowColor(fBubbleColor);
+	fText.Draw(target, fTextOrigin, updateRect, fSelectionColor);
+}
+
+
+void
+MessageBubble::GetPreferredSize(float* width, float* height)
+{
+	_Measure();
+	float textWidth = WrapWidth(fMaxWidth);
+
+	// Use the actual text width if it's shorter
+	if (fLineWidth < textWidth && fLineWidth > 0)
+		textWidth = fLineWidth;
+
+	*width = textWidth;
+	*height = fTextHeight;
+}
+
+
+void
+MessageBubble::FrameResized(float newWidth, float newHeight)
+{
+	BView::FrameResized(newWidth, newHeight);
+	_LayoutText();
+	Invalidate();
+}
+
+
+void
+MessageBubble::MouseDown(BPoint where)
+{
+	int32 offset = fText.OffsetAt(where - fTextOrigin);
+	if (fCollapsed && offset >= fNoticeStart && offset < fNoticeEnd
+		&& Parent() != NULL) {
+		// The chat view lays the whole message out in its place
+		BMessage expand(kMsgExpandMessage);
+		expand.AddPointer("message", fMessage);
+		Looper()->PostMessage(&expand, Parent());
+		return;
 	}
 
-	// Draw rounded rectangle background for bubble
-	SetHighColor(fBubbleColor);
-	FillRoundRect(bubbleRect, kBubbleRadius, kBubbleRadius);
+	// The bitmap has no selection; draw live while there is one
+	fLive = true;
+	_ReleaseBitmap();
+	MakeFocus(true);
+	SetMouseEventMask(B_POINTER_EVENTS, B_NO_POINTER_HISTORY);
+
+	int32 clicks = 1;
+	BMessage* current = Window() != NULL ? Window()->CurrentMessage() : NULL;
+	if (current != NULL)
+		current->FindInt32("clicks", &clicks);
+
+	int32 from = offset;
+	int32 to = offset;
+	if (clicks == 2)
+		fText.WordAt(offset, &from, &to);
+	fText.Select(from, to);
+	fSelectionAnchor = from;
+	fSelecting = true;
+	Invalidate();
 }
 
 
 void
-MessageBubble::GetPreferredSize(float* width, float* height)
+MessageBubble::MouseMoved(BPoint where, uint32 transit,
+	const BMessage* dragMessage)
 {
-	if (fTextView == NULL) {
-		*width = 100;
-		*height = 30;
+	if (!fSelecting) {
+		BView::MouseMoved(where, transit, dragMessage);
 		return;
 	}
 
-	float textHeight = fTextView->TextHeight(0, fTextView->CountLines());
-	float textWidth = fMaxWidth - 2 * kBubblePadding;
+	fText.Select(fSelectionAnchor, fText.OffsetAt(where - fTextOrigin));
+	Invalidate();
+}
+
+
+void
+MessageBubble::MouseUp(BPoint where)
+{
+	fSelecting = false;
+	BView::MouseUp(where);
+}
+
+
+void
+MessageBubble::MakeFocus(bool focused)
+{
+	BView::MakeFocus(focused);
+	if (focused || !fLive)
+		return;
+
+	// One selection at a time; the bubble can go back to its bitmap
+	fText.Select(0, 0);
+	fSelecting = false;
+	fLive = false;
+	Invalidate();
+	_InvalidateBitmap();
+}
+
+
+void
+MessageBubble::MessageReceived(BMessage* message)
+{
+	switch (message->what) {
+		case kMsgCacheBubble:
+			_CacheBitmap();
+			break;
+
+		case B_COPY:
+			_CopySelection();
+			break;
 
-	// Find actual text width if it's shorter
-	float lineWidth = 0;
-	for (int32 i = 0; i < fTextView->CountLines(); i++) {
-		float w = fTextView->LineWidth(i);
-		if (w > lineWidth)
-			lineWidth = w;
+		case B_SELECT_ALL:
+			fLive = true;
+			_ReleaseBitmap();
+			fText.Select(0, fText.TextLength());
+			Invalidate();
+			break;
+
+		default:
+			BView::MessageReceived(message);
+			break;
 	}
-	if (lineWidth < textWidth && lineWidth > 0)
-		textWidth = lineWidth;
+}
 
-	*width = textWidth;
-	*height = textHeight;
+
+void
+MessageBubble::SetMessage(ChatMessage* message, bool styleLater)
+{
+	_ReleaseBitmap();
+	fLive = false;
+	fSelecting = false;
+	fStreaming = false;
+	fMessage = message;
+	fRuns = &message->MarkdownRuns();
+	fMeasured = false;
+	fLexer.Reset();
+	fHighlighter.Clear();
+
+	fIsUser = (message->Role() == kRoleUser);
+	_UpdateColors();
+
+	// Set text and apply formatting, or show it plain for now
+	const char* content = message->Content();
+	int32 length = strlen(content);
+	fStylePending = false;
+	BString preview;
+	fCollapsed = BuildPreview(message, preview, &fNoticeStart, &fNoticeEnd);
+	if (fCollapsed)
+		_SetPreview(preview);
+	else if (styleLater && length > 0) {
+		fSpans.resize(1);
+		fSpans[0].offset = 0;
+		fSpans[0].style = kStylePlain;
+		fText.SetText(content, length);
+		fStylePending = true;
+	} else
+		_SetContent(content, length);
+	Invalidate();
 }
 
 
 void
-MessageBubble::FrameResized(float newWidth, float newHeight)
+MessageBubble::RefreshColors()
 {
-	BView::FrameResized(newWidth, newHeight);
-	_LayoutTextView();
+	// Same style ids in the new colors; the fonts and so the layout stay
+	// unless the font settings changed too
+	_UpdateColors();
 	Invalidate();
+	_InvalidateBitmap();
+}
+
+
+void
+MessageBubble::SetStreaming(bool streaming)
+{
+	fStreaming = streaming;
+	_InvalidateBitmap();
 }
 
 
@@ -126,49 +316,189 @@ MessageBubble::SetMaxWidth(float maxWidth)
 {
 	if (maxWidth < 100)
 		maxWidth = 400;  // Use default if width is invalid
+	if (WrapWidth(maxWidth) != WrapWidth(fMaxWidth))
+		fMeasured = false;
 	fMaxWidth = maxWidth;
-	_LayoutTextView();
+	_LayoutText();
 }
 
 
 void
 MessageBubble::UpdateContent()
 {
-	if (fTextView != NULL) {
-		fTextView->SetText(fMessage->Content());
-		_ApplyMarkdown();
-		_LayoutTextView();
-		Invalidate();
+	if (fCollapsed) {
+		// Edited; the preview is built again
+		SetMessage(fMessage);
+		_LayoutText();
+		return;
 	}
+
+	const char* content = fMessage->Content();
+	int32 length = strlen(content);
+	int32 shown = fText.TextLength();
+
+	// While streaming the content only grows: append just the new bytes
+	// so the lines above keep their wrapping, and restyle from the
+	// lexer's stable boundary, the start of the still open block
+	if (shown > 0 && length >= shown
+		&& memcmp(fText.Text(), content, shown) == 0) {
+		if (length == shown)
+			return;
+
+		int32 stable = fLexer.StableOffset();
+		size_t firstRun = fLexer.StableRunCount();
+		if (stable > shown)
+			stable = shown;
+
+		fLexer.LexAppended(content, length, *fRuns);
+		_LexDone(length);
+		fStylePending = false;
+		fText.Append(content + shown, length - shown);
+		int32 restyled = _BuildSpans(content, firstRun);
+		fText.StylesChanged(restyled < stable ? restyled : stable);
+	} else {
+		// Edited or replaced content, the structure above may differ
+		_SetContent(content, length);
+	}
+
+	fMeasured = false;
+	_LayoutText();
+	Invalidate();
 }
 
 
-void
-MessageBubble::_LayoutTextView()
+bool
+MessageBubble::Collapses(const ChatMessage* message)
 {
-	if (fTextView == NULL)
-		return;
+	if (message->IsExpanded())
+		return false;
+
+	const char* text = message->Content();
+	int32 length = strlen(text);
+	if (length > kPreviewBytes)
+		return true;
+
+	int32 lines = 0;
+	for (const char* newline = text; (newline = static_cast<const char*>(
+			memchr(newline, '\n', text + length - newline))) != NULL;
+			newline++) {
+		if (++lines > kPreviewLines)
+			return true;
+	}
+	return false;
+}
+
 
-	float textWidth = fMaxWidth - 2 * kBubblePadding;
+bool
+MessageBubble::BuildPreview(const ChatMessage* message, BString& preview,
+	int32* noticeStart, int32* noticeEnd)
+{
+	if (!Collapses(message))
+		return false;
+
+	const char* text = message->Content();
+	int32 length = strlen(text);
+
+	// The first lines, cut at a character if they are too long
+	int32 headEnd = 0;
+	for (int32 lines = 0; lines < kPreviewHeadLines && headEnd < length;
+			lines++) {
+		const char* newline = static_cast<const char*>(
+			memchr(text + headEnd, '\n', length - headEnd));
+		headEnd = newline != NULL ? newline - text + 1 : length;
+	}
+	if (headEnd > kPreviewEndBytes) {
+		headEnd = kPreviewEndBytes;
+		while (headEnd > 0 && (text[headEnd] & 0xc0) == 0x80)
+			headEnd--;
+	}
+
+	// And the last ones
+	int32 tailStart = length;
+	for (int32 lines = 0; lines < kPreviewTailLines && tailStart > headEnd;
+			lines++) {
+		tailStart--;
+		while (tailStart > headEnd && text[tailStart - 1] != '\n')
+			tailStart--;
+	}
+	if (length - tailStart > kPreviewEndBytes) {
+		tailStart = length - kPreviewEndBytes;
+		while (tailStart < length && (text[tailStart] & 0xc0) == 0x80)
+			tailStart++;
+	}
+	if (tailStart <= headEnd)
+		return false;
+
+	int32 hiddenLines = 0;
+	for (const char* newline = text + headEnd;
+			(newline = static_cast<const char*>(memchr(newline, '\n',
+				text + tailStart - newline))) != NULL; newline++)
+		hiddenLines++;
+	if (text[tailStart - 1] != '\n')
+		hiddenLines++;
+
+	int32 hiddenBytes = tailStart - headEnd;
+	BString size;
+	if (hiddenBytes >= 1024 * 1024)
+		size.SetToFormat("%.1f MB", hiddenBytes / (1024.0 * 1024.0));
+	else
+		size.SetToFormat("%ld KB", (long)((hiddenBytes + 1023) / 1024));
+	BString notice;
+	notice.SetToFormat("*%ld %s (%s) not shown. Click here to show all.*",
+		(long)hiddenLines, hiddenLines == 1 ? "line" : "lines",
+		size.String());
+
+	// A cut inside a code block closes it before the notice and opens it
+	// again after, so only the shown lines are laid out and highlighted
+	int32 opener = 0;
+	preview.SetTo(text, headEnd);
+	if (headEnd > 0 && text[headEnd - 1] != '\n')
+		preview << "\n";
+	if (FenceOpenAt(text, headEnd, &opener))
+		preview << "```\n";
+	preview << "\n";
+	if (noticeStart != NULL)
+		*noticeStart = preview.Length();
+	preview << notice;
+	if (noticeEnd != NULL)
+		*noticeEnd = preview.Length();
+	preview << "\n\n";
+	if (FenceOpenAt(text, tailStart, &opener)) {
+		const char* lineEnd = static_cast<const char*>(
+			memchr(text + opener, '\n', tailStart - opener));
+		preview.Append(text + opener, lineEnd != NULL
+			? lineEnd - (text + opener) : 3);
+		preview << "\n";
+	}
+	preview.Append(text + tailStart, length - tailStart);
+	return true;
+}
+
+
+int32
+MessageBubble::WrapWidth(float maxWidth)
+{
+	float textWidth = maxWidth - 2 * kBubblePadding;
 	if (textWidth < 50)
 		textWidth = 350;  // Fallback to reasonable width
+	return (int32)textWidth / kWrapWidthStep * kWrapWidthStep;
+}
+
 
-	BRect textRect(0, 0, textWidth, 2000);
-	fTextView->SetTextRect(textRect);
+void
+MessageBubble::_LayoutText()
+{
+	float textWidth = WrapWidth(fMaxWidth);
+	fText.SetWidth(textWidth);
 
-	float textHeight = fTextView->TextHeight(0, fTextView->CountLines());
+	_Measure();
+	float textHeight = fTextHeight;
 	if (textHeight < 10)
 		textHeight = 20;  // Minimum height for empty messages
 
 	// Find actual width needed
-	float lineWidth = 0;
-	for (int32 i = 0; i < fTextView->CountLines(); i++) {
-		float w = fTextView->LineWidth(i);
-		if (w > lineWidth)
-			lineWidth = w;
-	}
-	if (lineWidth < textWidth && lineWidth > 0)
-		textWidth = lineWidth;
+	if (fLineWidth < textWidth && fLineWidth > 0)
+		textWidth = fLineWidth;
 
 	BRect bounds = Bounds();
 
@@ -177,49 +507,149 @@ MessageBubble::_LayoutTextView()
 	if (boundsWidth < 100)
 		boundsWidth = fMaxWidth;
 
-	BRect bubbleRect;
 	if (fIsUser) {
-		bubbleRect = BRect(boundsWidth - textWidth - 2 * kBubblePadding,
+		fBubbleRect = BRect(boundsWidth - textWidth - 2 * kBubblePadding,
 			0, boundsWidth, textHeight + 2 * kBubblePadding);
 	} else {
-		bubbleRect = BRect(0, 0, textWidth + 2 * kBubblePadding,
+		fBubbleRect = BRect(0, 0, textWidth + 2 * kBubblePadding,
 			textHeight + 2 * kBubblePadding);
 	}
+	fTextOrigin = BPoint(fBubbleRect.left + kBubblePadding,
+		fBubbleRect.top + kBubblePadding);
+	_InvalidateBitmap();
+}
+
+
+void
+MessageBubble::_InvalidateBitmap()
+{
+	_ReleaseBitmap();
 
-	fTextView->MoveTo(bubbleRect.left + kBubblePadding,
-		bubbleRect.top + kBubblePadding);
-	fTextView->ResizeTo(textWidth, textHeight);
-	fTextView->SetViewColor(fBubbleColor);
+	// Render again once the current round of changes is done
+	if (fCachePending || fBitmapCache == NULL || fStreaming || fLive
+		|| Looper() == NULL)
+		return;
+	fCachePending = true;
+	Looper()->PostMessage(kMsgCacheBubble, this);
 }
 
 
 void
-MessageBubble::_ApplyStyle(int32 start, int32 end, const BFont* font,
-	const rgb_color* color)
+MessageBubble::_ReleaseBitmap()
 {
-	if (start < 0 || end <= start || end > fTextView->TextLength())
+	if (fBitmap == NULL)
 		return;
 
-	fTextView->SetFontAndColor(start, end, font, B_FONT_ALL, color);
+	fBitmapCache->Release(fBitmap);
+	fBitmap = NULL;
+	Invalidate();
 }
 
 
 void
-MessageBubble::_ApplyMarkdown()
+MessageBubble::_CacheBitmap()
 {
-	if (fTextView == NULL)
+	fCachePending = false;
+	BRect bounds = Bounds();
+	if (fBitmap != NULL || fBitmapCache == NULL || fStreaming || fLive
+		|| fStylePending || Window() == NULL || !bounds.IsValid()
+		|| bounds.Height() > kMaxBitmapHeight)
 		return;
 
-	const char* text = fTextView->Text();
-	int32 length = fTextView->TextLength();
+	BubbleCacheKey key;
+	key.message = fMessage->Serial();
+	key.version = fMessage->Version();
+	key.width = bounds.IntegerWidth();
+	key.height = bounds.IntegerHeight();
+	key.theme = (fFontKey * 2 + (IsDarkTheme() ? 1 : 0)) * 2
+		+ (fCollapsed ? 1 : 0);
+
+	fBitmap = fBitmapCache->Acquire(key);
+	if (fBitmap == NULL) {
+		fBitmap = _RenderBitmap();
+		if (fBitmap == NULL)
+			return;
+		fBitmapCache->Add(key, fBitmap);
+	}
+	Invalidate();
+}
+
 
-	if (length == 0)
+BBitmap*
+MessageBubble::_RenderBitmap()
+{
+	BRect bounds = Bounds();
+	BBitmap* bitmap = new BBitmap(bounds, B_BITMAP_ACCEPTS_VIEWS, B_RGB32);
+	if (bitmap->InitCheck() != B_OK) {
+		delete bitmap;
+		return NULL;
+	}
+
+	BView* canvas = new BView(bounds, "canvas", B_FOLLOW_NONE, B_WILL_DRAW);
+	bitmap->AddChild(canvas);
+	if (bitmap->Lock()) {
+		_DrawBubble(canvas, bounds);
+		canvas->Sync();
+		bitmap->Unlock();
+	}
+	return bitmap;
+}
+
+
+void
+MessageBubble::_Measure()
+{
+	if (fMeasured)
 		return;
+	fMeasured = true;
+
+	// The message keeps the size, so showing it again at this width skips
+	// walking the lines. Plain text waiting for styles is not kept.
+	int32 wrapWidth = WrapWidth(fMaxWidth);
+	bool keep = !fStylePending && !fCollapsed && fMessage->HasCurrentRuns();
+	if (keep && fMessage->GetTextSize(wrapWidth, fFontKey, &fTextHeight,
+			&fLineWidth))
+		return;
+
+	fText.SetWidth(wrapWidth);
+	fTextHeight = fText.Height();
+	fLineWidth = fText.Width();
 
-	// First apply default style to all text
-	fTextView->SetFontAndColor(0, length, &fPlainFont, B_FONT_ALL, &fTextColor);
+	if (keep)
+		fMessage->SetTextSize(wrapWidth, fFontKey, fTextHeight, fLineWidth);
+}
 
-	BString content(text);
+
+void
+MessageBubble::_UpdateColors()
+{
+	fBubbleColor = fIsUser ? kUserBubbleColor : kAssistantBubbleColor;
+	fTextColor = fIsUser ? kUserTextColor : kAssistantTextColor;
+
+	// Code styling colors
+	fCodeColor = fTextColor;
+	if (IsDarkTheme()) {
+		fCodeBgColor = (rgb_color){60, 60, 60, 255};
+		fSelectionColor = (rgb_color){38, 79, 120, 255};
+	} else {
+		fCodeBgColor = (rgb_color){240, 240, 240, 255};
+		fSelectionColor = (rgb_color){173, 214, 255, 255};
+	}
+
+	_BuildPalette();
+}
+
+
+void
+MessageBubble::_BuildPalette()
+{
+	// Text is measured with these fonts
+	uint32 fontKey = TextFontKey();
+	bool fontsChanged = fontKey != fFontKey;
+	if (fontsChanged) {
+		fFontKey = fontKey;
+		fMeasured = false;
+	}
 
 	// Dimmed color for markers
 	rgb_color dimColor = fTextColor;
@@ -227,203 +657,172 @@ MessageBubble::_ApplyMarkdown()
 	dimColor.green = (uint8)(dimColor.green * 0.4);
 	dimColor.blue = (uint8)(dimColor.blue * 0.4);
 
-	// Process code blocks first (```) - handle incomplete blocks during streaming
-	int32 pos = 0;
-	while (pos < length) {
-		int32 codeBlockStart = content.FindFirst("```", pos);
-		if (codeBlockStart < 0)
-			break;
+	BFont plainFont(*be_plain_font);
+	BFont codeFont(*be_fixed_font);
+	codeFont.SetSize(plainFont.Size() - 1);
 
-		int32 codeBlockEnd = content.FindFirst("```", codeBlockStart + 3);
-
-		// Skip the language specifier line if present
-		int32 contentStart = codeBlockStart + 3;
-		int32 newlinePos = content.FindFirst('\n', contentStart);
-
-		if (codeBlockEnd < 0) {
-			// Incomplete code block (still streaming) - style to end of text
-			if (newlinePos >= 0 && newlinePos < length) {
-				contentStart = newlinePos + 1;
-			}
-			// Style the opening marker
-			_ApplyStyle(codeBlockStart, contentStart, &fCodeFont, &dimColor);
-			// Style the code content to end
-			if (contentStart < length) {
-				_ApplyStyle(contentStart, length, &fCodeFont, &fCodeColor);
-			}
-			break;  // No more code blocks possible
-		}
-
-		// Complete code block
-		if (newlinePos >= 0 && newlinePos < codeBlockEnd) {
-			contentStart = newlinePos + 1;
-		}
-
-		// Apply code font to the content between ```
-		_ApplyStyle(contentStart, codeBlockEnd, &fCodeFont, &fCodeColor);
-
-		// Apply dimmed style to the ``` markers and language line
-		_ApplyStyle(codeBlockStart, contentStart, &fCodeFont, &dimColor);
-		_ApplyStyle(codeBlockEnd, codeBlockEnd + 3, &fCodeFont, &dimColor);
-
-		pos = codeBlockEnd + 3;
+	for (int32 i = 0; i < kStyleCount; i++) {
+		fPalette[i].font = plainFont;
+		fPalette[i].color = fTextColor;
 	}
 
-	// Process inline code (`) - skip areas inside code blocks
-	pos = 0;
-	while (pos < length) {
-		int32 codeStart = content.FindFirst('`', pos);
-		if (codeStart < 0)
-			break;
+	fPalette[kStyleMarker].color = dimColor;
+	fPalette[kStyleBold].font = *be_bold_font;
+	fPalette[kStyleItalic].font.SetFace(B_ITALIC_FACE);
+	fPalette[kStyleBoldItalic].font = *be_bold_font;
+	fPalette[kStyleBoldItalic].font.SetFace(B_BOLD_FACE | B_ITALIC_FACE);
+	fPalette[kStyleCode].font = codeFont;
+	fPalette[kStyleCode].color = fCodeColor;
+	fPalette[kStyleCodeMarker].font = codeFont;
+	fPalette[kStyleCodeMarker].color = dimColor;
+	fPalette[kStyleBullet].font = *be_bold_font;
+	fPalette[kStyleBullet].color = kAccentColor;
+
+	for (int32 level = 1; level <= 6; level++) {
+		TextStyle& header = fPalette[kStyleHeader + (level - 1) * 2];
+		header.font = *be_bold_font;
+		header.font.SetSize(plainFont.Size() + (6 - level) * 1.5f);
+
+		TextStyle& italicHeader = fPalette[kStyleHeader + (level - 1) * 2 + 1];
+		italicHeader.font = header.font;
+		italicHeader.font.SetFace(B_BOLD_FACE | B_ITALIC_FACE);
+	}
 
-		// Skip if part of code block marker
-		if ((codeStart > 0 && content[codeStart - 1] == '`') ||
-			(codeStart + 1 < length && content[codeStart + 1] == '`')) {
-			pos = codeStart + 1;
-			continue;
-		}
+	// Code token colors, indexed by token kind
+	static const rgb_color kDarkSyntax[kCodeTokenKinds - 1] = {
+		{198, 120, 221, 255},	// keyword
+		{229, 192, 123, 255},	// type
+		{152, 195, 121, 255},	// string
+		{209, 154, 102, 255},	// number
+		{127, 132, 142, 255},	// comment
+		{97, 175, 239, 255},	// meta
+		{152, 195, 121, 255},	// inserted
+		{224, 108, 117, 255}	// deleted
+	};
+	static const rgb_color kLightSyntax[kCodeTokenKinds - 1] = {
+		{166, 38, 164, 255},
+		{193, 132, 1, 255},
+		{80, 161, 79, 255},
+		{152, 104, 1, 255},
+		{160, 161, 167, 255},
+		{64, 120, 242, 255},
+		{80, 161, 79, 255},
+		{228, 86, 73, 255}
+	};
+	const rgb_color* syntax = IsDarkTheme() ? kDarkSyntax : kLightSyntax;
+	for (int32 i = 0; i < kCodeTokenKinds - 1; i++) {
+		fPalette[kStyleSyntax + i].font = codeFont;
+		fPalette[kStyleSyntax + i].color = syntax[i];
+	}
 
-		int32 codeEnd = content.FindFirst('`', codeStart + 1);
-		if (codeEnd < 0)
-			break;
+	if (fontsChanged)
+		fText.SetStyles(&fSpans, fPalette);
+}
 
-		// Skip if code block marker
-		if (codeEnd + 1 < length && content[codeEnd + 1] == '`') {
-			pos = codeEnd + 1;
-			continue;
-		}
 
-		_ApplyStyle(codeStart, codeEnd + 1, &fCodeFont, &fCodeColor);
-		pos = codeEnd + 1;
+void
+MessageBubble::_SetContent(const char* text, int32 length)
+{
+	bigtime_t start = system_time();
+
+	// One forward scan unless the message still has runs for this
+	// content, then text and styles go in with a single call
+	bool cached = fMessage->HasCurrentRuns();
+	fStylePending = false;
+	if (!cached) {
+		fLexer.Lex(text, length, *fRuns);
+		_LexDone(length);
 	}
+	fHighlighter.Clear();
+	_BuildSpans(text, 0);
+	fText.SetText(text, length);
 
-	// Process bold (**text**)
-	pos = 0;
-	while (pos < length - 3) {
-		int32 boldStart = content.FindFirst("**", pos);
-		if (boldStart < 0)
-			break;
+	LOG_DEBUG("Styled %ld bytes with %ld spans in %lld us%s", (long)length,
+		(long)fSpans.size(), (long long)(system_time() - start),
+		cached ? " (cached)" : "");
+}
 
-		int32 boldEnd = content.FindFirst("**", boldStart + 2);
-		if (boldEnd < 0)
-			break;
 
-		_ApplyStyle(boldStart + 2, boldEnd, &fBoldFont, &fTextColor);
-		_ApplyStyle(boldStart, boldStart + 2, &fPlainFont, &dimColor);
-		_ApplyStyle(boldEnd, boldEnd + 2, &fPlainFont, &dimColor);
+void
+MessageBubble::_SetPreview(const BString& preview)
+{
+	// The preview is short enough to style right away. Its runs are kept
+	// apart from the message's, which are for the whole text.
+	fRuns = &fPreviewRuns;
+	fLexer.Lex(preview.String(), preview.Length(), fPreviewRuns);
+	fHighlighter.Clear();
+	_BuildSpans(preview.String(), 0);
+	fText.SetText(preview.String(), preview.Length());
+}
 
-		pos = boldEnd + 2;
+
+void
+MessageBubble::_LexDone(int32 length)
+{
+	// Runs cut short by the time limit are not worth keeping
+	if (fLexer.TimedOut()) {
+		LOG_ERROR("Markdown styling of %ld bytes ran out of time",
+			(long)length);
+		return;
 	}
+	fMessage->SetRunsCurrent();
+}
 
-	// Process italic (*text* or _text_) - be careful not to match ** or __
-	pos = 0;
-	while (pos < length - 1) {
-		int32 italicStart = -1;
-		char marker = 0;
-
-		// Find single * or _ that's not part of ** or __
-		for (int32 i = pos; i < length; i++) {
-			if (content[i] == '*' || content[i] == '_') {
-				// Check it's not a double marker
-				bool isPrevSame = (i > 0 && content[i - 1] == content[i]);
-				bool isNextSame = (i + 1 < length && content[i + 1] == content[i]);
-				if (!isPrevSame && !isNextSame) {
-					italicStart = i;
-					marker = content[i];
-					break;
-				}
-			}
-		}
-
-		if (italicStart < 0)
-			break;
 
-		// Find closing marker
-		int32 italicEnd = -1;
-		for (int32 i = italicStart + 1; i < length; i++) {
-			if (content[i] == marker) {
-				bool isPrevSame = (content[i - 1] == marker);
-				bool isNextSame = (i + 1 < length && content[i + 1] == marker);
-				if (!isPrevSame && !isNextSame) {
-					italicEnd = i;
-					break;
-				}
-			}
-		}
-
-		if (italicEnd < 0)
-			break;
+bool
+MessageBubble::ApplyStyles(MarkdownJob* job)
+{
+	if (!fStylePending || job->version != fMessage->Version()
+		|| job->text.Length() != fText.TextLength())
+		return false;
 
-		_ApplyStyle(italicStart + 1, italicEnd, &fItalicFont, &fTextColor);
-		_ApplyStyle(italicStart, italicStart + 1, &fPlainFont, &dimColor);
-		_ApplyStyle(italicEnd, italicEnd + 1, &fPlainFont, &dimColor);
+	fSpans.swap(job->spans);
+	fText.StylesChanged(0);
+	fStylePending = false;
+	fMeasured = false;
 
-		pos = italicEnd + 1;
-	}
+	_LayoutText();
+	Invalidate();
+	return true;
+}
 
-	// Process headers (# at start of line)
-	pos = 0;
-	while (pos < length) {
-		// Find start of line
-		int32 lineStart = pos;
-		if (pos > 0) {
-			lineStart = content.FindFirst('\n', pos);
-			if (lineStart < 0)
-				break;
-			lineStart++;
-		}
-
-		if (lineStart >= length)
-			break;
 
-		// Count # at start of line
-		int32 hashCount = 0;
-		int32 i = lineStart;
-		while (i < length && content[i] == '#' && hashCount < 6) {
-			hashCount++;
-			i++;
-		}
-
-		if (hashCount > 0 && i < length && content[i] == ' ') {
-			// Find end of line
-			int32 lineEnd = content.FindFirst('\n', i);
-			if (lineEnd < 0)
-				lineEnd = length;
-
-			// Apply bold to header text
-			BFont headerFont = fBoldFont;
-			float sizeDelta = (6 - hashCount) * 1.5f;
-			headerFont.SetSize(fPlainFont.Size() + sizeDelta);
-			_ApplyStyle(i + 1, lineEnd, &headerFont, &fTextColor);
-			_ApplyStyle(lineStart, i + 1, &fPlainFont, &dimColor);
-
-			pos = lineEnd;
-		} else {
-			pos = lineStart + 1;
-		}
+int32
+MessageBubble::_BuildSpans(const char* text, size_t firstRun)
+{
+	// Returns where the styles changed from
+	if (firstRun >= fRuns->size()) {
+		if (firstRun == 0)
+			fSpans.clear();
+		return firstRun == 0 ? 0 : fText.TextLength();
 	}
 
-	// Process bullet points (- or * at start of line)
-	pos = 0;
-	while (pos < length) {
-		int32 lineStart = pos;
-		if (pos > 0) {
-			lineStart = content.FindFirst('\n', pos);
-			if (lineStart < 0)
-				break;
-			lineStart++;
-		}
-
-		if (lineStart >= length)
-			break;
+	// Keep the style ids of all the text, so a theme change only has to
+	// map them to new colors
+	BuildStyleSpans(text, *fRuns, firstRun, fHighlighter, fTailSpans);
+	size_t keep = fSpans.size();
+	while (keep > 0 && fSpans[keep - 1].offset >= fTailSpans[0].offset)
+		keep--;
+	fSpans.resize(keep);
+	fSpans.insert(fSpans.end(), fTailSpans.begin(), fTailSpans.end());
+	return fTailSpans[0].offset;
+}
+
 
-		// Check for bullet
-		if ((content[lineStart] == '-' || content[lineStart] == '*') &&
-			lineStart + 1 < length && content[lineStart + 1] == ' ') {
-			// Apply accent color to bullet
-			_ApplyStyle(lineStart, lineStart + 1, &fBoldFont, &kAccentColor);
-		}
+void
+MessageBubble::_CopySelection()
+{
+	int32 from, to;
+	fText.GetSelection(&from, &to);
+	if (from == to || !be_clipboard->Lock())
+		return;
 
-		pos = lineStart + 1;
+	be_clipboard->Clear();
+	BMessage* clip = be_clipboard->Data();
+	if (clip != NULL) {
+		clip->AddData("text/plain", B_MIME_TYPE, fText.Text() + from,
+			to - from);
+		be_clipboard->Commit();
 	}
+	be_clipboard->Unlock();
 }
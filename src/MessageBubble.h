@@ -2,43 +2,127 @@
 #define MESSAGE_BUBBLE_H
 
 #include <Font.h>
-#include <TextView.h>
+#include <String.h>
 #include <View.h>
 
+#include <vector>
+
+#include "BubbleCache.h"
 #include "ChatMessage.h"
+#include "CodeHighlighter.h"
+#include "MarkdownLexer.h"
+#include "MarkdownStyle.h"
+#include "TextLayout.h"
+
+struct MarkdownJob;
 
 class MessageBubble : public BView {
 public:
-						MessageBubble(ChatMessage* message);
+						MessageBubble(ChatMessage* message,
+							bool styleLater = false);
 	virtual				~MessageBubble();
 
+	virtual void		AttachedToWindow();
+	virtual void		DetachedFromWindow();
 	virtual void		Draw(BRect updateRect);
 	virtual void		GetPreferredSize(float* width, float* height);
 	virtual void		FrameResized(float newWidth, float newHeight);
+	virtual void		MouseDown(BPoint where);
+	virtual void		MouseMoved(BPoint where, uint32 transit,
+							const BMessage* dragMessage);
+	virtual void		MouseUp(BPoint where);
+	virtual void		MakeFocus(bool focused = true);
+	virtual void		MessageReceived(BMessage* message);
 
+	// Shows another message, so the bubble can be reused
+	void				SetMessage(ChatMessage* message,
+							bool styleLater = false);
 	void				SetMaxWidth(float maxWidth);
 	void				UpdateContent();
+	// Takes the colors of the current theme without restyling the text
+	void				RefreshColors();
+	// Width text is wrapped at in a bubble of maxWidth, in steps so small
+	// width changes keep measurements
+	static int32		WrapWidth(float maxWidth);
 	ChatMessage*		Message() const { return fMessage; }
 
+	// Messages too long to lay out whole show their first and last lines
+	// and a notice that expands them when clicked. BuildPreview() returns
+	// false for a message shown whole.
+	static bool			Collapses(const ChatMessage* message);
+	static bool			BuildPreview(const ChatMessage* message,
+							BString& preview, int32* noticeStart = NULL,
+							int32* noticeEnd = NULL);
+
+	// A bubble created with styleLater shows plain text until the styles
+	// a MarkdownPool worker prepared are applied. Returns false for a job
+	// made for an older version of the message.
+	bool				StylePending() const { return fStylePending; }
+	bool				ApplyStyles(MarkdownJob* job);
+
+	// With a cache, a finished bubble draws from a bitmap of itself until
+	// text in it is selected. Streaming bubbles stay live.
+	void				SetBitmapCache(BubbleCache* cache)
+							{ fBitmapCache = cache; }
+	void				SetStreaming(bool streaming);
+
 private:
-	void				_LayoutTextView();
-	void				_ApplyMarkdown();
-	void				_ApplyStyle(int32 start, int32 end, const BFont* font,
-							const rgb_color* color);
+	void				_DrawBubble(BView* target, BRect updateRect);
+	void				_LayoutText();
+	void				_InvalidateBitmap();
+	void				_ReleaseBitmap();
+	void				_CacheBitmap();
+	BBitmap*			_RenderBitmap();
+	void				_Measure();
+	void				_UpdateColors();
+	void				_BuildPalette();
+	void				_SetContent(const char* text, int32 length);
+	void				_SetPreview(const BString& preview);
+	void				_LexDone(int32 length);
+	int32				_BuildSpans(const char* text, size_t firstRun);
+	void				_CopySelection();
 
 	ChatMessage*		fMessage;
-	BTextView*			fTextView;
+	TextLayout			fText;
+	BRect				fBubbleRect;
+	BPoint				fTextOrigin;
 	float				fMaxWidth;
 	rgb_color			fBubbleColor;
 	rgb_color			fTextColor;
 	rgb_color			fCodeColor;
 	rgb_color			fCodeBgColor;
+	rgb_color			fSelectionColor;
 	bool				fIsUser;
 
-	BFont				fPlainFont;
-	BFont				fBoldFont;
-	BFont				fItalicFont;
-	BFont				fCodeFont;
+	TextStyle			fPalette[kStyleCount];
+	uint32				fFontKey;
+	bool				fStylePending;
+
+	// Size of the wrapped text, valid while fMeasured
+	float				fTextHeight;
+	float				fLineWidth;
+	bool				fMeasured;
+
+	BubbleCache*		fBitmapCache;
+	BBitmap*			fBitmap;		// acquired from fBitmapCache
+	bool				fStreaming;
+	bool				fLive;			// has a selection, draw it live
+	bool				fCachePending;
+
+	int32				fSelectionAnchor;
+	bool				fSelecting;
+
+	// Notice line of a collapsed message's preview
+	bool				fCollapsed;
+	int32				fNoticeStart;
+	int32				fNoticeEnd;
+
+	MarkdownLexer		fLexer;
+	std::vector<MarkdownRun>* fRuns;	// the message's, or the preview's
+	std::vector<MarkdownRun> fPreviewRuns;
+	CodeHighlighter		fHighlighter;
+	std::vector<StyleSpan> fSpans;		// all of the text
+	std::vector<StyleSpan> fTailSpans;	// restyled by the last update
 };
 
 #endif // MESSAGE_BUBBLE_H
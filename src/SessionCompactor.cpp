@@ -0,0 +1,164 @@
+#include "SessionCompactor.h"
+
+#include <OS.h>
+
+#include "JsonUtils.h"
+#include "Log.h"
+
+// Wait this long before trying again after a failed summary
+static const bigtime_t kRetryDelay = 300000000;
+
+static const char* kSummaryPrompt =
+	"Summarize the conversation below so it can replace the original "
+	"messages as context for continuing the chat. Keep facts, decisions, "
+	"names, code identifiers, numbers and open questions; drop small talk. "
+	"Write plain prose or short bullet points, at most 400 words, and do "
+	"not address the reader.";
+
+
+SessionCompactor::SessionCompactor(BMessenger target)
+	:
+	BLooper("SessionCompactor", B_LOW_PRIORITY),
+	fTarget(target),
+	fClient(NULL),
+	fBusy(0),
+	fRetryAfter(0),
+	fMessageCount(0),
+	fFailed(false)
+{
+	Run();
+
+	// The client reports to this looper, so it needs a running port first
+	fClient = new LLMClient(BMessenger(this));
+}
+
+
+SessionCompactor::~SessionCompactor()
+{
+	if (fClient != NULL) {
+		fClient->Lock();
+		fClient->Quit();
+	}
+}
+
+
+void
+SessionCompactor::MessageReceived(BMessage* message)
+{
+	switch (message->what) {
+		case kMsgCompactionStart:
+			_Start(message);
+			break;
+
+		case kMsgLLMChunk:
+		{
+			const char* text;
+			if (message->FindString("text", &text) == B_OK)
+				fSummary << text;
+			break;
+		}
+
+		case kMsgLLMError:
+		{
+			const char* error;
+			if (message->FindString("error", &error) == B_OK)
+				LOG_ERROR("SessionCompactor - Summary failed: %s", error);
+			fFailed = true;
+			break;
+		}
+
+		case kMsgLLMDone:
+			_Finish();
+			break;
+
+		default:
+			BLooper::MessageReceived(message);
+			break;
+	}
+}
+
+
+bool
+SessionCompactor::Compact(const char* sessionId, int32 messageCount,
+	const char* previousSummary, const char* transcript, ApiType apiType,
+	const char* endpoint, const char* apiKey, const char* model)
+{
+	if (system_time() < fRetryAfter)
+		return false;
+	if (atomic_test_and_set(&fBusy, 1, 0) != 0)
+		return false;
+
+	BString content(kSummaryPrompt);
+	if (previousSummary != NULL && previousSummary[0] != '\0') {
+		content << "\n\nSummary of the conversation so far:\n"
+			<< previousSummary;
+	}
+	content << "\n\nConversation:\n" << transcript;
+
+	BString messagesJson;
+	messagesJson.SetToFormat("[{\"role\":\"user\",\"content\":\"%s\"}]",
+		EscapeJson(content.String()).String());
+
+	BMessage start(kMsgCompactionStart);
+	start.AddString("session_id", sessionId);
+	start.AddInt32("count", messageCount);
+	start.AddString("messages", messagesJson);
+	start.AddInt32("api_type", apiType);
+	start.AddString("endpoint", endpoint);
+	start.AddString("api_key", apiKey);
+	start.AddString("model", model);
+
+	if (PostMessage(&start) != B_OK) {
+		atomic_set(&fBusy, 0);
+		return false;
+	}
+	return true;
+}
+
+
+void
+SessionCompactor::_Start(BMessage* message)
+{
+	fSessionId = message->GetString("session_id", "");
+	fMessageCount = message->GetInt32("count", 0);
+	fSummary = "";
+	fFailed = false;
+
+	LOG("SessionCompactor - Summarizing %d messages of %s",
+		(int)fMessageCount, fSessionId.String());
+
+	status_t status = fClient->SendChatRequest(
+		message->GetString("messages", "[]"),
+		static_cast<ApiType>(message->GetInt32("api_type", kApiTypeOpenAI)),
+		message->GetString("endpoint", ""), message->GetString("api_key", ""),
+		message->GetString("model", ""));
+
+	// No kMsgLLMDone comes for a request that never started
+	if (status != B_OK) {
+		fFailed = true;
+		_Finish();
+	}
+}
+
+
+void
+SessionCompactor::_Finish()
+{
+	fSummary.Trim();
+	if (fFailed || fSummary.Length() == 0) {
+		fRetryAfter = system_time() + kRetryDelay;
+		LOG_ERROR("SessionCompactor - No summary for %s, retrying later",
+			fSessionId.String());
+	} else {
+		LOG("SessionCompactor - Summary of %d messages is %d bytes",
+			(int)fMessageCount, (int)fSummary.Length());
+
+		BMessage done(kMsgCompactionDone);
+		done.AddString("session_id", fSessionId);
+		done.AddInt32("count", fMessageCount);
+		done.AddString("summary", fSummary);
+		fTarget.SendMessage(&done);
+	}
+
+	atomic_set(&fBusy, 0);
+}
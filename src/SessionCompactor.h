@@ -0,0 +1,46 @@
+#ifndef SESSION_COMPACTOR_H
+#define SESSION_COMPACTOR_H
+
+#include <Looper.h>
+#include <Messenger.h>
+#include <String.h>
+
+#include "Constants.h"
+#include "LLMClient.h"
+
+
+// Summarizes the older part of long chats in the background. It has its
+// own LLMClient, so a summary request never delays or cancels a chat send.
+// Posts kMsgCompactionDone with "session_id", "count" and "summary" to the
+// target when a summary is ready.
+class SessionCompactor : public BLooper {
+public:
+						SessionCompactor(BMessenger target);
+	virtual				~SessionCompactor();
+
+	virtual void		MessageReceived(BMessage* message);
+
+	// Queues a summary of transcript, folding in the previous summary.
+	// Returns false while another job runs or after a recent failure.
+	bool				Compact(const char* sessionId, int32 messageCount,
+							const char* previousSummary,
+							const char* transcript, ApiType apiType,
+							const char* endpoint, const char* apiKey,
+							const char* model);
+
+private:
+	void				_Start(BMessage* message);
+	void				_Finish();
+
+	BMessenger			fTarget;
+	LLMClient*			fClient;
+	int32				fBusy;
+	bigtime_t			fRetryAfter;
+
+	BString				fSessionId;
+	int32				fMessageCount;
+	BString				fSummary;
+	bool				fFailed;
+};
+
+#endif // SESSION_COMPACTOR_H
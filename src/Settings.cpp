@@ -13,6 +13,14 @@ Settings::Settings()
 	fDarkTheme(true),
 	fWindowFrame(100, 100, 900, 700),
 	fSidebarCollapsed(false),
+	fHedgeEnabled(false),
+	fHedgeApiType(kApiTypeOpenAI),
+	fHedgePercentile(0.95f),
+	fHedgeMaxRate(0.1f),
+	fResponsesApi(false),
+	fCompactionEnabled(false),
+	fCompactionThreshold(60000),
+	fCompactionKeepRecent(10),
 	fSessions(20, true),
 	fCurrentSession(NULL)
 {
@@ -27,8 +35,10 @@ Settings::Settings()
 	fModels[kApiTypeGemini] = "gemini-2.0-flash";
 
 	// Initialize cached model lists
-	for (int i = 0; i < 3; i++)
+	for (int i = 0; i < 3; i++) {
 		fCachedModels[i].MakeEmpty();
+		fMirrorEndpoints[i].MakeEmpty();
+	}
 }
 
 
@@ -80,6 +90,15 @@ Settings::SetModel(const char* model)
 }
 
 
+const char*
+Settings::GetHedgeModel() const
+{
+	// Fall back to the model configured for the hedge provider
+	if (fHedgeModel.Length() > 0)
+		return fHedgeModel.String();
+	return GetModelFor(fHedgeApiType);
+}
+
 // Specific API type accessors
 const char*
 Settings::GetApiKeyFor(ApiType type) const
@@ -195,6 +214,38 @@ Settings::Load()
 	if (archive.FindBool("sidebar_collapsed", &collapsed) == B_OK)
 		fSidebarCollapsed = collapsed;
 
+	bool hedgeEnabled;
+	if (archive.FindBool("hedge_enabled", &hedgeEnabled) == B_OK)
+		fHedgeEnabled = hedgeEnabled;
+	int32 hedgeType;
+	if (archive.FindInt32("hedge_api_type", &hedgeType) == B_OK
+		&& hedgeType >= 0 && hedgeType < 3)
+		fHedgeApiType = static_cast<ApiType>(hedgeType);
+	if (archive.FindString("hedge_model", &str) == B_OK)
+		fHedgeModel = str;
+	float hedgeValue;
+	if (archive.FindFloat("hedge_percentile", &hedgeValue) == B_OK)
+		fHedgePercentile = hedgeValue;
+	if (archive.FindFloat("hedge_max_rate", &hedgeValue) == B_OK)
+		fHedgeMaxRate = hedgeValue;
+
+	bool responsesApi;
+	if (archive.FindBool("responses_api", &responsesApi) == B_OK)
+		fResponsesApi = responsesApi;
+
+	bool compaction;
+	if (archive.FindBool("compaction_enabled", &compaction) == B_OK)
+		fCompactionEnabled = compaction;
+	if (archive.FindString("compaction_model", &str) == B_OK)
+		fCompactionModel = str;
+	int32 compactionValue;
+	if (archive.FindInt32("compaction_threshold", &compactionValue) == B_OK
+		&& compactionValue > 0)
+		fCompactionThreshold = compactionValue;
+	if (archive.FindInt32("compaction_keep_recent", &compactionValue) == B_OK
+		&& compactionValue >= 2)
+		fCompactionKeepRecent = compactionValue;
+
 	// Load cached models for each API type
 	for (int32 type = 0; type < 3; type++) {
 		fCachedModels[type].MakeEmpty();
@@ -206,6 +257,16 @@ Settings::Load()
 		}
 	}
 
+	// Load mirror endpoints for each API type
+	for (int32 type = 0; type < 3; type++) {
+		fMirrorEndpoints[type].MakeEmpty();
+		const char* endpoint;
+		BString fieldName;
+		fieldName.SetToFormat("mirror_endpoints_%d", type);
+		for (int32 i = 0; archive.FindString(fieldName.String(), i, &endpoint) == B_OK; i++)
+			fMirrorEndpoints[type].AddItem(new BString(endpoint));
+	}
+
 	// Load sessions
 	LoadSessions();
 
@@ -244,6 +305,17 @@ Settings::Save()
 	archive.AddRect("window_frame", fWindowFrame);
 	archive.AddBool("sidebar_collapsed", fSidebarCollapsed);
 
+	archive.AddBool("hedge_enabled", fHedgeEnabled);
+	archive.AddInt32("hedge_api_type", static_cast<int32>(fHedgeApiType));
+	archive.AddString("hedge_model", fHedgeModel.String());
+	archive.AddFloat("hedge_percentile", fHedgePercentile);
+	archive.AddFloat("hedge_max_rate", fHedgeMaxRate);
+	archive.AddBool("responses_api", fResponsesApi);
+	archive.AddBool("compaction_enabled", fCompactionEnabled);
+	archive.AddString("compaction_model", fCompactionModel.String());
+	archive.AddInt32("compaction_threshold", fCompactionThreshold);
+	archive.AddInt32("compaction_keep_recent", fCompactionKeepRecent);
+
 	// Save per-provider settings
 	for (int32 type = 0; type < 3; type++) {
 		BString keyName, endpointName, modelName;
@@ -268,6 +340,16 @@ Settings::Save()
 		}
 	}
 
+	// Save mirror endpoints for each API type
+	for (int32 type = 0; type < 3; type++) {
+		BString fieldName;
+		fieldName.SetToFormat("mirror_endpoints_%d", type);
+		for (int32 i = 0; i < fMirrorEndpoints[type].CountItems(); i++) {
+			archive.AddString(fieldName.String(),
+				fMirrorEndpoints[type].ItemAt(i)->String());
+		}
+	}
+
 	status = archive.Flatten(&file);
 
 	// Save all sessions
@@ -458,3 +540,25 @@ Settings::HasCachedModels(ApiType type) const
 		return fCachedModels[type].CountItems() > 0;
 	return false;
 }
+
+
+const BObjectList<BString>&
+Settings::GetMirrorEndpoints(ApiType type) const
+{
+	if (type >= 0 && type < 3)
+		return fMirrorEndpoints[type];
+	return fMirrorEndpoints[0];
+}
+
+
+void
+Settings::SetMirrorEndpoints(ApiType type, const BObjectList<BString>& endpoints)
+{
+	if (type < 0 || type >= 3)
+		return;
+
+	fMirrorEndpoints[type].MakeEmpty();
+	for (int32 i = 0; i < endpoints.CountItems(); i++) {
+		fMirrorEndpoints[type].AddItem(new BString(*endpoints.ItemAt(i)));
+	}
+}
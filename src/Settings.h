@@ -41,11 +41,47 @@ public:
 	void				SetApiEndpointFor(ApiType type, const char* endpoint);
 	void				SetModelFor(ApiType type, const char* model);
 
+	// Extra endpoints serving the same models, routed by latency and health.
+	// They share the provider's API key.
+	const BObjectList<BString>& GetMirrorEndpoints(ApiType type) const;
+	void				SetMirrorEndpoints(ApiType type,
+							const BObjectList<BString>& endpoints);
+
 	// Cached models per API type
 	const BObjectList<BString>& GetCachedModels(ApiType type) const;
 	void				SetCachedModels(ApiType type, const BObjectList<BString>& models);
 	bool				HasCachedModels(ApiType type) const;
 
+	// Hedged requests - race a backup provider when the first token is late
+	bool				IsHedgingEnabled() const { return fHedgeEnabled; }
+	void				SetHedgingEnabled(bool enabled) { fHedgeEnabled = enabled; }
+	ApiType				GetHedgeApiType() const { return fHedgeApiType; }
+	void				SetHedgeApiType(ApiType type) { fHedgeApiType = type; }
+	const char*			GetHedgeModel() const;
+	void				SetHedgeModel(const char* model) { fHedgeModel = model; }
+	float				GetHedgePercentile() const { return fHedgePercentile; }
+	float				GetHedgeMaxRate() const { return fHedgeMaxRate; }
+
+	// OpenAI Responses API - keep conversation state on the server
+	bool				UsesResponsesApi() const { return fResponsesApi; }
+	void				SetUsesResponsesApi(bool enabled)
+							{ fResponsesApi = enabled; }
+
+	// Rolling summaries of the older part of long chats
+	bool				IsCompactionEnabled() const
+							{ return fCompactionEnabled; }
+	void				SetCompactionEnabled(bool enabled)
+							{ fCompactionEnabled = enabled; }
+	// Empty means the chat model is used for summaries too
+	const char*			GetCompactionModel() const
+							{ return fCompactionModel.String(); }
+	void				SetCompactionModel(const char* model)
+							{ fCompactionModel = model; }
+	int32				GetCompactionThreshold() const
+							{ return fCompactionThreshold; }
+	int32				GetCompactionKeepRecent() const
+							{ return fCompactionKeepRecent; }
+
 	// Theme settings
 	bool				IsDarkTheme() const { return fDarkTheme; }
 	void				SetDarkTheme(bool dark) { fDarkTheme = dark; }
@@ -78,10 +114,24 @@ private:
 	BRect				fWindowFrame;
 	bool				fSidebarCollapsed;
 
+	bool				fHedgeEnabled;
+	ApiType				fHedgeApiType;
+	BString				fHedgeModel;
+	float				fHedgePercentile;
+	float				fHedgeMaxRate;
+
+	bool				fResponsesApi;
+
+	bool				fCompactionEnabled;
+	BString				fCompactionModel;
+	int32				fCompactionThreshold;
+	int32				fCompactionKeepRecent;
+
 	// Per-provider settings (indexed by ApiType)
 	BString				fApiEndpoints[3];
 	BString				fApiKeys[3];
 	BString				fModels[3];
+	BObjectList<BString> fMirrorEndpoints[3];
 
 	BObjectList<ChatSession> fSessions;
 	ChatSession*		fCurrentSession;
@@ -43,6 +43,9 @@ SettingsWindow::SettingsWindow(BRect frame, Settings* settings)
 	fApiKeyField = new BTextControl("API Key:", "", NULL);
 	fApiKeyField->TextView()->HideTyping(true);
 
+	// Comma-separated mirrors of the endpoint, routed by latency and health
+	fMirrorsField = new BTextControl("Mirrors:", "", NULL);
+
 	// Model dropdown
 	fModelMenu = new BPopUpMenu("Select Model");
 	fModelField = new BMenuField("Model:", fModelMenu);
@@ -54,6 +57,35 @@ SettingsWindow::SettingsWindow(BRect frame, Settings* settings)
 	fDarkThemeCheckbox = new BCheckBox("Dark theme", new BMessage(kMsgThemeChanged));
 	fDarkThemeCheckbox->SetValue(fSettings->IsDarkTheme() ? B_CONTROL_ON : B_CONTROL_OFF);
 
+	// Hedged requests
+	fHedgeCheckbox = new BCheckBox("Race a backup provider when replies are "
+		"slow to start", new BMessage(kMsgHedgeChanged));
+	fHedgeCheckbox->SetValue(fSettings->IsHedgingEnabled()
+		? B_CONTROL_ON : B_CONTROL_OFF);
+
+	fHedgeMenu = new BPopUpMenu("Backup");
+	fHedgeMenu->AddItem(new BMenuItem("OpenAI-compatible", NULL));
+	fHedgeMenu->AddItem(new BMenuItem("Claude (Anthropic)", NULL));
+	fHedgeMenu->AddItem(new BMenuItem("Gemini (Google)", NULL));
+	fHedgeMenu->ItemAt(fSettings->GetHedgeApiType())->SetMarked(true);
+	fHedgeField = new BMenuField("Backup provider:", fHedgeMenu);
+	fHedgeField->SetEnabled(fSettings->IsHedgingEnabled());
+
+	// Stateful OpenAI conversations
+	fResponsesCheckbox = new BCheckBox("Use the Responses API for "
+		"OpenAI (send only new messages)", NULL);
+	fResponsesCheckbox->SetValue(fSettings->UsesResponsesApi()
+		? B_CONTROL_ON : B_CONTROL_OFF);
+
+	// Summaries of older messages in long chats
+	fCompactionCheckbox = new BCheckBox("Summarize older messages in long "
+		"chats", new BMessage(kMsgCompactionChanged));
+	fCompactionCheckbox->SetValue(fSettings->IsCompactionEnabled()
+		? B_CONTROL_ON : B_CONTROL_OFF);
+	fCompactionModelField = new BTextControl("Summary model:",
+		fSettings->GetCompactionModel(), NULL);
+	fCompactionModelField->SetEnabled(fSettings->IsCompactionEnabled());
+
 	// Status view
 	fStatusView = new BStringView("status", "");
 	fStatusView->SetExplicitMinSize(BSize(200, B_SIZE_UNSET));
@@ -73,15 +105,22 @@ SettingsWindow::SettingsWindow(BRect frame, Settings* settings)
 			.Add(fEndpointField->CreateTextViewLayoutItem(), 1, 1, 2)
 			.Add(fApiKeyField->CreateLabelLayoutItem(), 0, 2)
 			.Add(fApiKeyField->CreateTextViewLayoutItem(), 1, 2, 2)
-			.Add(fModelField->CreateLabelLayoutItem(), 0, 3)
-			.Add(fModelField->CreateMenuBarLayoutItem(), 1, 3)
-			.Add(fFetchModelsButton, 2, 3)
+			.Add(fMirrorsField->CreateLabelLayoutItem(), 0, 3)
+			.Add(fMirrorsField->CreateTextViewLayoutItem(), 1, 3, 2)
+			.Add(fModelField->CreateLabelLayoutItem(), 0, 4)
+			.Add(fModelField->CreateMenuBarLayoutItem(), 1, 4)
+			.Add(fFetchModelsButton, 2, 4)
 		.End()
 		.Add(fStatusView)
 		.AddStrut(10)
 		.Add(new BSeparatorView(B_HORIZONTAL))
 		.AddStrut(5)
 		.Add(fDarkThemeCheckbox)
+		.Add(fHedgeCheckbox)
+		.Add(fHedgeField)
+		.Add(fResponsesCheckbox)
+		.Add(fCompactionCheckbox)
+		.Add(fCompactionModelField)
 		.AddGlue()
 		.Add(new BSeparatorView(B_HORIZONTAL))
 		.AddGroup(B_HORIZONTAL)
@@ -96,6 +135,7 @@ SettingsWindow::SettingsWindow(BRect frame, Settings* settings)
 	fApiTypeMenu->ItemAt(fSettings->GetApiType())->SetMarked(true);
 	fEndpointField->SetText(fSettings->GetApiEndpointFor(fCurrentApiType));
 	fApiKeyField->SetText(fSettings->GetApiKeyFor(fCurrentApiType));
+	_LoadMirrors();
 
 	// Load cached models for current API type
 	_LoadCachedModels();
@@ -130,6 +170,15 @@ SettingsWindow::MessageReceived(BMessage* message)
 			// Theme change will be applied on save
 			break;
 
+		case kMsgHedgeChanged:
+			fHedgeField->SetEnabled(fHedgeCheckbox->Value() == B_CONTROL_ON);
+			break;
+
+		case kMsgCompactionChanged:
+			fCompactionModelField->SetEnabled(
+				fCompactionCheckbox->Value() == B_CONTROL_ON);
+			break;
+
 		case kMsgFetchModels:
 			_FetchModels();
 			break;
@@ -180,6 +229,7 @@ SettingsWindow::_SaveSettings()
 	// Save current field values to the current API type's slots
 	fSettings->SetApiEndpointFor(fCurrentApiType, fEndpointField->Text());
 	fSettings->SetApiKeyFor(fCurrentApiType, fApiKeyField->Text());
+	_StoreMirrors();
 
 	// Get selected model for current type
 	BMenuItem* modelItem = fModelMenu->FindMarked();
@@ -194,6 +244,21 @@ SettingsWindow::_SaveSettings()
 		fSettings->SetApiType(static_cast<ApiType>(index));
 	}
 
+	// Save hedge settings
+	fSettings->SetHedgingEnabled(fHedgeCheckbox->Value() == B_CONTROL_ON);
+	BMenuItem* hedgeItem = fHedgeMenu->FindMarked();
+	if (hedgeItem != NULL) {
+		fSettings->SetHedgeApiType(
+			static_cast<ApiType>(fHedgeMenu->IndexOf(hedgeItem)));
+	}
+
+	fSettings->SetUsesResponsesApi(
+		fResponsesCheckbox->Value() == B_CONTROL_ON);
+
+	fSettings->SetCompactionEnabled(
+		fCompactionCheckbox->Value() == B_CONTROL_ON);
+	fSettings->SetCompactionModel(fCompactionModelField->Text());
+
 	// Save theme setting and check if it changed
 	bool darkTheme = (fDarkThemeCheckbox->Value() == B_CONTROL_ON);
 	bool themeChanged = (darkTheme != fSettings->IsDarkTheme());
@@ -243,6 +308,7 @@ SettingsWindow::_UpdateFieldsForApiType(ApiType newType)
 	// Save current field values to the old API type's slots
 	fSettings->SetApiEndpointFor(fCurrentApiType, fEndpointField->Text());
 	fSettings->SetApiKeyFor(fCurrentApiType, fApiKeyField->Text());
+	_StoreMirrors();
 
 	// Save selected model for current type
 	BMenuItem* modelItem = fModelMenu->FindMarked();
@@ -256,6 +322,7 @@ SettingsWindow::_UpdateFieldsForApiType(ApiType newType)
 	// Load the new API type's settings
 	fEndpointField->SetText(fSettings->GetApiEndpointFor(newType));
 	fApiKeyField->SetText(fSettings->GetApiKeyFor(newType));
+	_LoadMirrors();
 
 	// Load cached models for new API type
 	_LoadCachedModels();
@@ -387,3 +454,43 @@ SettingsWindow::_LoadCachedModels()
 		fModelMenu->ItemAt(0)->SetMarked(true);
 	}
 }
+
+
+void
+SettingsWindow::_LoadMirrors()
+{
+	BString text;
+	const BObjectList<BString>& mirrors
+		= fSettings->GetMirrorEndpoints(fCurrentApiType);
+	for (int32 i = 0; i < mirrors.CountItems(); i++) {
+		if (i > 0)
+			text.Append(", ");
+		text.Append(*mirrors.ItemAt(i));
+	}
+	fMirrorsField->SetText(text.String());
+}
+
+
+void
+SettingsWindow::_StoreMirrors()
+{
+	BObjectList<BString> mirrors(4, true);
+	BString text(fMirrorsField->Text());
+
+	int32 start = 0;
+	while (start <= text.Length()) {
+		int32 comma = text.FindFirst(',', start);
+		if (comma < 0)
+			comma = text.Length();
+
+		BString endpoint;
+		text.CopyInto(endpoint, start, comma - start);
+		endpoint.Trim();
+		if (endpoint.Length() > 0)
+			mirrors.AddItem(new BString(endpoint));
+
+		start = comma + 1;
+	}
+
+	fSettings->SetMirrorEndpoints(fCurrentApiType, mirrors);
+}
@@ -26,6 +26,8 @@ private:
 	void				_FetchModels();
 	void				_PopulateModels(BMessage* message);
 	void				_LoadCachedModels();
+	void				_LoadMirrors();
+	void				_StoreMirrors();
 
 	Settings*			fSettings;
 	LLMClient*			fLLMClient;
@@ -35,10 +37,17 @@ private:
 	BMenuField*			fApiTypeField;
 	BTextControl*		fEndpointField;
 	BTextControl*		fApiKeyField;
+	BTextControl*		fMirrorsField;
 	BPopUpMenu*			fModelMenu;
 	BMenuField*			fModelField;
 	BButton*			fFetchModelsButton;
 	BCheckBox*			fDarkThemeCheckbox;
+	BCheckBox*			fHedgeCheckbox;
+	BPopUpMenu*			fHedgeMenu;
+	BMenuField*			fHedgeField;
+	BCheckBox*			fResponsesCheckbox;
+	BCheckBox*			fCompactionCheckbox;
+	BTextControl*		fCompactionModelField;
 	BStringView*		fStatusView;
 	BButton*			fResetButton;
 	BButton*			fSaveButton;
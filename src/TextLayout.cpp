@@ -0,0 +1,513 @@
+#include "TextLayout.h"
+
+#include <ObjectList.h>
+#include <View.h>
+
+#include <algorithm>
+#include <cmath>
+#include <ctype.h>
+#include <map>
+
+// Tab stops, as in BTextView
+static const float kTabWidth = 28;
+
+
+// Widths of the characters of one font, measured when first met. The
+// fonts only change with the system font settings, so they are kept for
+// the life of the app.
+struct FontMetrics {
+	BFont				font;
+	float				ascent;
+	float				descent;	// with the leading
+	float				ascii[128];
+	std::map<uint32, float> others;	// by UTF-8 bytes
+
+	float				Width(const char* text, int32 bytes);
+};
+
+
+float
+FontMetrics::Width(const char* text, int32 bytes)
+{
+	uint8 first = (uint8)text[0];
+	if (bytes == 1 && first < 128) {
+		if (ascii[first] < 0)
+			ascii[first] = font.StringWidth(text, 1);
+		return ascii[first];
+	}
+
+	uint32 key = 0;
+	for (int32 i = 0; i < bytes; i++)
+		key = key << 8 | (uint8)text[i];
+	std::map<uint32, float>::iterator found = others.find(key);
+	if (found != others.end())
+		return found->second;
+
+	float width = font.StringWidth(text, bytes);
+	others[key] = width;
+	return width;
+}
+
+
+static BObjectList<FontMetrics> sFontMetrics(8, true);
+
+
+static FontMetrics*
+MetricsFor(const BFont& font)
+{
+	for (int32 i = 0; i < sFontMetrics.CountItems(); i++) {
+		FontMetrics* metrics = sFontMetrics.ItemAt(i);
+		if (metrics->font == font)
+			return metrics;
+	}
+
+	FontMetrics* metrics = new FontMetrics;
+	metrics->font = font;
+	font_height height;
+	font.GetHeight(&height);
+	metrics->ascent = height.ascent;
+	metrics->descent = height.descent + height.leading;
+	for (int32 i = 0; i < 128; i++)
+		metrics->ascii[i] = -1;
+	sFontMetrics.AddItem(metrics);
+	return metrics;
+}
+
+
+static int32
+CharBytes(const char* text, int32 left)
+{
+	uint8 first = (uint8)text[0];
+	int32 bytes = 1;
+	if ((first & 0xe0) == 0xc0)
+		bytes = 2;
+	else if ((first & 0xf0) == 0xe0)
+		bytes = 3;
+	else if ((first & 0xf8) == 0xf0)
+		bytes = 4;
+	return bytes < left ? bytes : left;
+}
+
+
+static bool
+IsWordByte(char c)
+{
+	return isalnum((uint8)c) || c == '_' || (uint8)c >= 0x80;
+}
+
+
+TextLayout::TextLayout()
+	:
+	fSpans(NULL),
+	fPalette(NULL),
+	fMetricsValid(false),
+	fWidth(0),
+	fDirtyFrom(0),
+	fSelectionStart(0),
+	fSelectionEnd(0)
+{
+}
+
+
+TextLayout::~TextLayout()
+{
+}
+
+
+void
+TextLayout::SetText(const char* text, int32 length)
+{
+	fText.SetTo(text, length);
+	fSelectionStart = fSelectionEnd = 0;
+	_Invalidate(0);
+}
+
+
+void
+TextLayout::Append(const char* text, int32 length)
+{
+	_Invalidate(fText.Length());
+	fText.Append(text, length);
+}
+
+
+void
+TextLayout::SetStyles(const std::vector<StyleSpan>* spans,
+	const TextStyle* palette)
+{
+	fSpans = spans;
+	fPalette = palette;
+	fMetricsValid = false;
+	_Invalidate(0);
+}
+
+
+void
+TextLayout::StylesChanged(int32 from)
+{
+	_Invalidate(from);
+}
+
+
+void
+TextLayout::SetWidth(float width)
+{
+	if (width == fWidth)
+		return;
+	fWidth = width;
+	_Invalidate(0);
+}
+
+
+float
+TextLayout::Height()
+{
+	_Layout();
+	const Line& last = fLines.back();
+	return last.top + last.height;
+}
+
+
+float
+TextLayout::Width()
+{
+	_Layout();
+	float width = 0;
+	for (size_t i = 0; i < fLines.size(); i++)
+		width = std::max(width, fLines[i].width);
+	return width;
+}
+
+
+void
+TextLayout::Draw(BView* view, BPoint origin, BRect updateRect,
+	rgb_color selectionColor)
+{
+	_Layout();
+	if (fPalette == NULL)
+		return;
+
+	const char* text = fText.String();
+	size_t spanCount = fSpans != NULL ? fSpans->size() : 0;
+	view->SetDrawingMode(B_OP_OVER);
+
+	for (int32 l = _LineAt(updateRect.top - origin.y);
+			l < (int32)fLines.size(); l++) {
+		const Line& line = fLines[l];
+		float top = origin.y + line.top;
+		if (top > updateRect.bottom)
+			break;
+		int32 end = line.offset + line.length;
+
+		if (fSelectionStart < end && fSelectionEnd > line.offset) {
+			float left = _XAt(line, std::max(fSelectionStart, line.offset));
+			float right = _XAt(line, std::min(fSelectionEnd, end));
+			view->SetHighColor(selectionColor);
+			view->FillRect(BRect(origin.x + left, top, origin.x + right - 1,
+				top + line.height - 1));
+		}
+
+		// One DrawString() per run of a style, split at tabs
+		float x = 0;
+		int32 i = line.offset;
+		size_t span = _SpanAt(i);
+		while (i < end) {
+			while (span < spanCount && (*fSpans)[span].offset <= i)
+				span++;
+			int32 style = _StyleAt(span);
+			int32 bytes;
+			if (text[i] == '\t') {
+				x += _CharWidth(i, style, x, &bytes);
+				i += bytes;
+				continue;
+			}
+
+			int32 runEnd = end;
+			if (span < spanCount && (*fSpans)[span].offset < end)
+				runEnd = (*fSpans)[span].offset;
+			int32 start = i;
+			float startX = x;
+			while (i < runEnd && text[i] != '\t') {
+				x += _CharWidth(i, style, x, &bytes);
+				i += bytes;
+			}
+
+			view->SetFont(&fPalette[style].font);
+			view->SetHighColor(fPalette[style].color);
+			view->DrawString(text + start, i - start,
+				BPoint(origin.x + startX, top + line.ascent));
+		}
+	}
+
+	view->SetDrawingMode(B_OP_COPY);
+}
+
+
+int32
+TextLayout::OffsetAt(BPoint point)
+{
+	_Layout();
+	const Line& line = fLines[_LineAt(point.y)];
+	int32 end = line.offset + line.length;
+	size_t spanCount = fSpans != NULL ? fSpans->size() : 0;
+	size_t span = _SpanAt(line.offset);
+
+	// The nearer edge of the character under the point
+	float x = 0;
+	for (int32 i = line.offset; i < end;) {
+		while (span < spanCount && (*fSpans)[span].offset <= i)
+			span++;
+		int32 bytes;
+		float width = _CharWidth(i, _StyleAt(span), x, &bytes);
+		if (point.x < x + width / 2)
+			return i;
+		x += width;
+		i += bytes;
+	}
+	return end;
+}
+
+
+void
+TextLayout::WordAt(int32 offset, int32* from, int32* to) const
+{
+	const char* text = fText.String();
+	int32 length = fText.Length();
+	if (offset >= length || !IsWordByte(text[offset])) {
+		*from = offset;
+		*to = std::min(offset + 1, length);
+		return;
+	}
+
+	*from = offset;
+	while (*from > 0 && IsWordByte(text[*from - 1]))
+		(*from)--;
+	*to = offset;
+	while (*to < length && IsWordByte(text[*to]))
+		(*to)++;
+}
+
+
+void
+TextLayout::Select(int32 from, int32 to)
+{
+	if (from > to)
+		std::swap(from, to);
+	fSelectionStart = std::max((int32)0, std::min(from, fText.Length()));
+	fSelectionEnd = std::max((int32)0, std::min(to, fText.Length()));
+}
+
+
+void
+TextLayout::GetSelection(int32* from, int32* to) const
+{
+	*from = fSelectionStart;
+	*to = fSelectionEnd;
+}
+
+
+void
+TextLayout::_Invalidate(int32 from)
+{
+	if (fDirtyFrom < 0 || from < fDirtyFrom)
+		fDirtyFrom = from;
+}
+
+
+void
+TextLayout::_Layout()
+{
+	if (fDirtyFrom < 0)
+		return;
+
+	if (!fMetricsValid) {
+		for (int32 i = 0; i < kStyleCount; i++) {
+			fMetrics[i] = MetricsFor(fPalette != NULL
+				? fPalette[i].font : *be_plain_font);
+		}
+		fMetricsValid = true;
+	}
+
+	// A change can pull its first word up onto the line before, so
+	// breaking starts again one line above it
+	int32 first = std::max((int32)0, _LineOf(fDirtyFrom) - 1);
+	int32 offset = 0;
+	float top = 0;
+	if (first < (int32)fLines.size()) {
+		offset = fLines[first].offset;
+		top = fLines[first].top;
+	}
+	fLines.resize(first);
+	fDirtyFrom = -1;
+
+	const char* text = fText.String();
+	int32 length = fText.Length();
+	size_t spanCount = fSpans != NULL ? fSpans->size() : 0;
+	bool wrap = fWidth > 0;
+
+	while (true) {
+		Line line;
+		line.offset = offset;
+		line.top = top;
+
+		// Break after the last blank that fits, or inside a word too long
+		// for a line of its own. Blanks may hang past the width.
+		float x = 0;
+		float visible = 0;
+		int32 breakAt = -1;
+		float breakWidth = 0;
+		int32 end = -1;
+		int32 i = offset;
+		size_t span = _SpanAt(i);
+		while (i < length && text[i] != '\n') {
+			while (span < spanCount && (*fSpans)[span].offset <= i)
+				span++;
+			int32 bytes;
+			float width = _CharWidth(i, _StyleAt(span), x, &bytes);
+			bool blank = text[i] == ' ' || text[i] == '\t';
+			if (wrap && !blank && x + width > fWidth && i > offset) {
+				end = breakAt > offset ? breakAt : i;
+				line.width = breakAt > offset ? breakWidth : visible;
+				break;
+			}
+
+			x += width;
+			i += bytes;
+			if (blank) {
+				breakAt = i;
+				breakWidth = visible;
+			} else
+				visible = x;
+		}
+
+		bool newline = false;
+		if (end < 0) {
+			end = i;
+			line.width = visible;
+			newline = i < length;
+		}
+		line.length = end - offset;
+		_SetLineMetrics(line);
+		fLines.push_back(line);
+		top += line.height;
+
+		// Text ending in a newline has an empty last line
+		if (!newline && end >= length)
+			break;
+		offset = newline ? end + 1 : end;
+	}
+}
+
+
+void
+TextLayout::_SetLineMetrics(Line& line) const
+{
+	// Tallest font on the line, or the style of an empty one
+	size_t spanCount = fSpans != NULL ? fSpans->size() : 0;
+	int32 end = line.offset + line.length;
+	size_t span = _SpanAt(line.offset);
+	const FontMetrics* metrics = fMetrics[_StyleAt(span)];
+	float ascent = metrics->ascent;
+	float descent = metrics->descent;
+	while (span < spanCount && (*fSpans)[span].offset < end) {
+		span++;
+		metrics = fMetrics[_StyleAt(span)];
+		ascent = std::max(ascent, metrics->ascent);
+		descent = std::max(descent, metrics->descent);
+	}
+
+	line.ascent = ceilf(ascent);
+	line.height = ceilf(ascent + descent);
+}
+
+
+int32
+TextLayout::_LineAt(float y) const
+{
+	int32 low = 0;
+	int32 high = (int32)fLines.size() - 1;
+	while (low < high) {
+		int32 middle = (low + high + 1) / 2;
+		if (fLines[middle].top <= y)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+	return low;
+}
+
+
+int32
+TextLayout::_LineOf(int32 offset) const
+{
+	int32 low = 0;
+	int32 high = (int32)fLines.size() - 1;
+	while (low < high) {
+		int32 middle = (low + high + 1) / 2;
+		if (fLines[middle].offset <= offset)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+	return low;
+}
+
+
+size_t
+TextLayout::_SpanAt(int32 offset) const
+{
+	// Count of spans starting at or before offset
+	if (fSpans == NULL)
+		return 0;
+
+	size_t low = 0;
+	size_t high = fSpans->size();
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if ((*fSpans)[middle].offset <= offset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+
+int32
+TextLayout::_StyleAt(size_t span) const
+{
+	// The style of the text after span spans have started
+	if (span == 0)
+		return kStylePlain;
+	int32 style = (*fSpans)[span - 1].style;
+	return style >= 0 && style < kStyleCount ? style : kStylePlain;
+}
+
+
+float
+TextLayout::_CharWidth(int32 offset, int32 style, float x,
+	int32* bytes) const
+{
+	const char* text = fText.String() + offset;
+	*bytes = CharBytes(text, fText.Length() - offset);
+	if (text[0] == '\t')
+		return (floorf(x / kTabWidth) + 1) * kTabWidth - x;
+	return fMetrics[style]->Width(text, *bytes);
+}
+
+
+float
+TextLayout::_XAt(const Line& line, int32 offset) const
+{
+	size_t spanCount = fSpans != NULL ? fSpans->size() : 0;
+	size_t span = _SpanAt(line.offset);
+	float x = 0;
+	for (int32 i = line.offset; i < offset;) {
+		while (span < spanCount && (*fSpans)[span].offset <= i)
+			span++;
+		int32 bytes;
+		x += _CharWidth(i, _StyleAt(span), x, &bytes);
+		i += bytes;
+	}
+	return x;
+}
@@ -0,0 +1,98 @@
+#ifndef TEXT_LAYOUT_H
+#define TEXT_LAYOUT_H
+
+#include <Font.h>
+#include <GraphicsDefs.h>
+#include <Point.h>
+#include <Rect.h>
+#include <String.h>
+
+#include <vector>
+
+#include "MarkdownStyle.h"
+
+class BView;
+struct FontMetrics;
+
+// Font and color a style id draws with
+struct TextStyle {
+	BFont				font;
+	rgb_color			color;
+};
+
+
+// Read-only styled text broken into lines at a width and drawn straight
+// into a view. Character widths come from a cache shared by all layouts,
+// so text whose characters were seen before is laid out without asking
+// the app_server. Only the lines after a change are broken again.
+class TextLayout {
+public:
+						TextLayout();
+						~TextLayout();
+
+	void				SetText(const char* text, int32 length);
+	void				Append(const char* text, int32 length);
+	const char*			Text() const { return fText.String(); }
+	int32				TextLength() const { return fText.Length(); }
+
+	// The spans and the palette they index stay owned by the caller, who
+	// calls StylesChanged() after changing them
+	void				SetStyles(const std::vector<StyleSpan>* spans,
+							const TextStyle* palette);
+	void				StylesChanged(int32 from);
+
+	// Wrap width; 0 or less does not wrap
+	void				SetWidth(float width);
+	float				Height();
+	float				Width();		// of the longest line
+
+	// Draws the lines in updateRect, both in view coordinates with the
+	// text at origin
+	void				Draw(BView* view, BPoint origin, BRect updateRect,
+							rgb_color selectionColor);
+
+	// In layout coordinates
+	int32				OffsetAt(BPoint point);
+	void				WordAt(int32 offset, int32* from, int32* to) const;
+
+	void				Select(int32 from, int32 to);
+	void				GetSelection(int32* from, int32* to) const;
+	bool				HasSelection() const
+							{ return fSelectionStart < fSelectionEnd; }
+
+private:
+	struct Line {
+		int32			offset;
+		int32			length;		// without the newline
+		float			top;
+		float			height;
+		float			ascent;
+		float			width;		// without trailing blanks
+	};
+
+	void				_Invalidate(int32 from);
+	void				_Layout();
+	void				_SetLineMetrics(Line& line) const;
+	int32				_LineAt(float y) const;
+	int32				_LineOf(int32 offset) const;
+	size_t				_SpanAt(int32 offset) const;
+	int32				_StyleAt(size_t span) const;
+	float				_CharWidth(int32 offset, int32 style, float x,
+							int32* bytes) const;
+	float				_XAt(const Line& line, int32 offset) const;
+
+	BString				fText;
+	const std::vector<StyleSpan>* fSpans;
+	const TextStyle*	fPalette;
+	FontMetrics*		fMetrics[kStyleCount];
+	bool				fMetricsValid;
+
+	float				fWidth;
+	std::vector<Line>	fLines;
+	int32				fDirtyFrom;		// lines from here are stale, or -1
+
+	int32				fSelectionStart;
+	int32				fSelectionEnd;
+};
+
+#endif // TEXT_LAYOUT_H
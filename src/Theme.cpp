@@ -1,5 +1,7 @@
 #include "Constants.h"
 
+#include <Font.h>
+
 // Current theme colors - initialized to dark theme by default
 rgb_color kBackgroundColor = kDarkBackgroundColor;
 rgb_color kSidebarColor = kDarkSidebarColor;
@@ -51,3 +53,16 @@ IsDarkTheme()
 {
 	return sDarkTheme;
 }
+
+
+uint32
+TextFontKey()
+{
+	const BFont* fonts[] = { be_plain_font, be_bold_font, be_fixed_font };
+	uint32 key = 0;
+	for (int32 i = 0; i < 3; i++) {
+		key = key * 31 + fonts[i]->FamilyAndStyle();
+		key = key * 31 + (uint32)(fonts[i]->Size() * 8);
+	}
+	return key;
+}
@@ -0,0 +1,85 @@
+#include "ViewStateCache.h"
+
+#include "Log.h"
+
+
+ViewStateCache::ViewStateCache(int32 maxCount, size_t budget)
+	:
+	fEntries(maxCount + 1, true),
+	fMaxCount(maxCount),
+	fBudget(budget),
+	fBytes(0)
+{
+}
+
+
+ViewStateCache::~ViewStateCache()
+{
+}
+
+
+void
+ViewStateCache::Put(const ChatSession* session, ChatViewState* state)
+{
+	Remove(session);
+	if (state == NULL)
+		return;
+
+	Entry* entry = new Entry;
+	entry->session = session;
+	entry->state = state;
+	fEntries.AddItem(entry, 0);
+	fBytes += state->Bytes();
+	_Trim();
+}
+
+
+const ChatViewState*
+ViewStateCache::Find(const ChatSession* session)
+{
+	int32 index = _IndexOf(session);
+	if (index < 0)
+		return NULL;
+
+	if (index > 0)
+		fEntries.MoveItem(index, 0);
+	return fEntries.ItemAt(0)->state;
+}
+
+
+void
+ViewStateCache::Remove(const ChatSession* session)
+{
+	int32 index = _IndexOf(session);
+	if (index < 0)
+		return;
+
+	Entry* entry = fEntries.RemoveItemAt(index);
+	fBytes -= entry->state->Bytes();
+	delete entry;
+}
+
+
+int32
+ViewStateCache::_IndexOf(const ChatSession* session) const
+{
+	for (int32 i = 0; i < fEntries.CountItems(); i++) {
+		if (fEntries.ItemAt(i)->session == session)
+			return i;
+	}
+	return -1;
+}
+
+
+void
+ViewStateCache::_Trim()
+{
+	while (!fEntries.IsEmpty()
+		&& (fEntries.CountItems() > fMaxCount || fBytes > fBudget)) {
+		Entry* entry = fEntries.RemoveItemAt(fEntries.CountItems() - 1);
+		fBytes -= entry->state->Bytes();
+		LOG_DEBUG("Dropped a view state of %ld bytes",
+			(long)entry->state->Bytes());
+		delete entry;
+	}
+}
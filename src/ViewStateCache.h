@@ -0,0 +1,42 @@
+#ifndef VIEW_STATE_CACHE_H
+#define VIEW_STATE_CACHE_H
+
+#include <ObjectList.h>
+
+#include "ChatView.h"
+
+class ChatSession;
+
+// The view states of the most recently shown sessions, so switching back
+// to one restores its layout and scroll position without measuring.
+// Bounded by count and by the memory the states take.
+class ViewStateCache {
+public:
+						ViewStateCache(int32 maxCount, size_t budget);
+						~ViewStateCache();
+
+	// Takes ownership, replacing any older state of the session
+	void				Put(const ChatSession* session,
+							ChatViewState* state);
+	// NULL if not cached; otherwise marks it most recently used
+	const ChatViewState* Find(const ChatSession* session);
+	void				Remove(const ChatSession* session);
+
+private:
+	struct Entry {
+						~Entry() { delete state; }
+
+		const ChatSession* session;
+		ChatViewState*	state;
+	};
+
+	int32				_IndexOf(const ChatSession* session) const;
+	void				_Trim();
+
+	BObjectList<Entry>	fEntries;	// most recent first
+	int32				fMaxCount;
+	size_t				fBudget;
+	size_t				fBytes;
+};
+
+#endif // VIEW_STATE_CACHE_H